@@ -0,0 +1,110 @@
+/**
+ * \file affinity.c
+ * \brief NUMA node placement of threads and block data
+ *
+ * Uses libnuma when available. Memory is placed by first touch, so block
+ * data is on the node of the thread that wrote it. Threads are bound for
+ * as long as they work on blocks, and then get back the CPUs and memory
+ * policy they had, as OpenMP keeps them around for other work.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+#include "utils.h"
+#include "affinity.h"
+
+#ifdef HAVE_LIBNUMA
+struct affinity_s {
+  struct bitmask* cpus;
+  struct bitmask* nodes;
+  int policy;
+};
+
+
+static void _free_placement(affinity_p placement) {
+  numa_free_cpumask(placement->cpus);
+  numa_free_nodemask(placement->nodes);
+  free(placement);
+}
+#endif
+
+
+int affinity_nodes(void) {
+#ifdef HAVE_LIBNUMA
+  static int nodes = 0;
+  if (nodes == 0)
+    nodes = numa_available() < 0 ? 1 : numa_num_configured_nodes();
+  return nodes > 0 ? nodes : 1;
+#else
+  return 1;
+#endif
+}
+
+
+int affinity_node_of(const void* address) {
+#ifdef HAVE_LIBNUMA
+  int node = -1;
+  if (address == NULL || affinity_nodes() == 1
+      || get_mempolicy(&node, NULL, 0, (void*)address, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+    return -1;
+  return node;
+#else
+  return -1;
+#endif
+}
+
+
+affinity_p affinity_bind(const int node) {
+#ifdef HAVE_LIBNUMA
+  if (affinity_nodes() == 1)
+    return NULL;
+  affinity_p saved = (affinity_p)malloc(sizeof(struct affinity_s));
+  if (saved == NULL)
+    return NULL;
+  saved->cpus = numa_allocate_cpumask();
+  saved->nodes = numa_allocate_nodemask();
+  if (numa_sched_getaffinity(0, saved->cpus) < 0
+      || get_mempolicy(&saved->policy, saved->nodes->maskp, saved->nodes->size + 1, NULL, 0) != 0) {
+    msg(log_debug, "Failed to get placement, not running on node: %d\n", node);
+    _free_placement(saved);
+    return NULL;
+  }
+  if (numa_run_on_node(node) != 0)
+    msg(log_debug, "Failed to run on node: %d\n", node);
+  numa_set_preferred(node);
+  return saved;
+#else
+  return NULL;
+#endif
+}
+
+
+void affinity_restore(affinity_p* saved) {
+#ifdef HAVE_LIBNUMA
+  if (*saved == NULL)
+    return;
+  if (numa_sched_setaffinity(0, (*saved)->cpus) < 0)
+    msg(log_debug, "Failed to restore CPUs of thread\n");
+  if (set_mempolicy((*saved)->policy, (*saved)->nodes->maskp, (*saved)->nodes->size + 1) != 0)
+    msg(log_debug, "Failed to restore memory policy of thread\n");
+  _free_placement(*saved);
+  *saved = NULL;
+#endif
+}
@@ -0,0 +1,38 @@
+/**
+ * \file affinity.h
+ * \brief NUMA node placement of threads and block data
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 1 without NUMA support
+extern int affinity_nodes(void);
+// Node of the memory at address, -1 when unknown
+extern int affinity_node_of(const void* address);
+// Placement of a thread from before it was bound
+typedef struct affinity_s* affinity_p;
+
+// Run the calling thread on the CPUs of node and allocate from its memory.
+// Returns the placement to restore, NULL when it wasn't changed.
+extern affinity_p affinity_bind(const int node);
+extern void affinity_restore(affinity_p* saved);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -13,8 +13,12 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 
+#include "utils.h"
 #include "block.h"
+#include "budget.h"
 
 nf_block_p block_new()
 {
@@ -28,5 +32,96 @@ void block_free(nf_block_p *block) {
   *block = NULL;
   free(bl->records);
   free(bl->data);
+  budget_release(&bl->reserved);
   free(bl);
 }
+
+int block_is_data(const nf_block_p block)
+{
+  return block_id_is_data(block->header.id);
+}
+
+int block_id_is_data(const uint16_t id)
+{
+  // Everything else (catalog, dictionary) is stored as is
+  switch (id) {
+    case DATA_BLOCK_TYPE_1:
+    case DATA_BLOCK_TYPE_2:
+    case Large_BLOCK_Type:
+    case COLUMNAR_BLOCK:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+int block_validate(const nf_block_p block)
+{
+  // Checks that the record sizes of a decompressed data block add up to the
+  // block size and that there are as many records as the header says. Each
+  // offset depends on the previous size, so there is nothing to vectorize;
+  // the loop only loads the sizes and is bound by memory bandwidth.
+  const char* data = block->data;
+  const size_t size = block->header.size;
+  size_t offset = 0;
+  uint32_t records = 0;
+  while (offset + sizeof(record_header_t) <= size) {
+    uint16_t record_size;
+    memcpy(&record_size, data + offset + offsetof(record_header_t, size), sizeof(record_size));
+    if (record_size < sizeof(record_header_t))
+      break;
+    offset += record_size;
+    ++records;
+  }
+  if (offset != size) {
+    msg(log_error, "Invalid record at offset %lu in block of size %lu\n", offset, size);
+    return -1;
+  }
+  if (records != block->header.NumRecords) {
+    msg(log_error, "Block has %u records instead of %u\n", records, block->header.NumRecords);
+    return -1;
+  }
+  return 0;
+}
+
+int block_swap_records(nf_block_p block, const int to_native)
+{
+  // Swaps the byte order of the records of a decompressed data block.
+  // Returns the number of records that were only partly converted, or -1
+  // when the record sizes don't add up.
+  // Extensions are laid out by the maps that come before them in the block.
+  size_t offset = 0;
+  int partial = 0;
+  record_maps_t maps;
+  maps.count = 0;
+  while (offset + sizeof(record_header_t) <= block->header.size) {
+    record_header_t* record = (record_header_t*)(block->data + offset);
+    int result = record_swap(record, block->header.size - offset, to_native, &maps);
+    if (result < 0) {
+      msg(log_error, "Invalid record size at offset %lu\n", offset);
+      return -1;
+    }
+    partial += result;
+    offset += to_native ? record->size : __builtin_bswap16(record->size);
+  }
+  return partial;
+}
+
+int block_for_each_record(const nf_block_p block, record_handler_p handle_record, void* context)
+{
+  // Walks the records of a decompressed data block. Stops when the handler
+  // returns non-zero and returns that.
+  size_t offset = 0;
+  while (offset + sizeof(record_header_t) <= block->header.size) {
+    const record_header_t* record = (const record_header_t*)(block->data + offset);
+    if (record->size < sizeof(record_header_t) || offset + record->size > block->header.size) {
+      msg(log_error, "Invalid record size: %u at offset %lu\n", record->size, offset);
+      return -1;
+    }
+    int result = handle_record(record, context);
+    if (result != 0)
+      return result;
+    offset += record->size;
+  }
+  return 0;
+}
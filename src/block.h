@@ -26,6 +26,14 @@ typedef struct {
   size_t uncompressed_size;
   compression_t compression;
   compression_t file_compression;
+  off_t offset;  // of the block header in the file
+  // Records of blocks from a file of the other byte order are converted
+  // when decompressed: 1 until then, 2 when only partly converted
+  int foreign;
+  // Dictionary the data is compressed against. Owned by the file.
+  const char* dictionary;
+  size_t dictionary_size;
+  size_t reserved;  // bytes of the memory budget held for the data
   // Data
   data_block_header_t header;
   char* data;
@@ -35,9 +43,16 @@ typedef nf_block_t* nf_block_p;
 
 
 typedef void (*block_handler_p) (const int, nf_block_p);
+typedef int (*record_handler_p) (const record_header_t*, void*);
 
 extern nf_block_p block_new();
 extern void block_free(nf_block_p *block);
+extern int block_is_data(const nf_block_p block);
+extern int block_id_is_data(const uint16_t id);
+// Checks the record sizes and count of a decompressed data block
+extern int block_validate(const nf_block_p block);
+extern int block_swap_records(nf_block_p block, const int to_native);
+extern int block_for_each_record(const nf_block_p block, record_handler_p handle_record, void* context);
 
 #ifdef __cplusplus
 }  // extern "C"
@@ -0,0 +1,228 @@
+/**
+ * \file bloom.c
+ * \brief Per block Bloom filter on IP addresses
+ *
+ * A BLOOM_BLOCK in front of the data blocks holds a bloom_filter_t header
+ * followed by a filter over the source and destination addresses of each
+ * data block, in the order of the data blocks. A host lookup only has to
+ * read and decompress the blocks whose filter has all bits of the address
+ * set.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "record.h"
+#include "bloom.h"
+
+typedef struct {
+  uint64_t* addresses;  // pairs of uint64_t
+  size_t count;
+  size_t capacity;  // in addresses
+} _addresses_t;
+
+static inline uint64_t _mix(uint64_t x);
+static int _add_addresses(const record_header_t* record, void* context);
+static int _fill_filter(uint8_t* filter, const uint32_t bits, const _addresses_t* addresses);
+
+
+int bloom_build(nf_file_p *file) {
+  nf_file_p fl = *file;
+  bloom_remove(fl);
+
+  // Same size for all filters, so their offsets follow from the block ordinal.
+  // Record counts include extension maps, so this is an upper bound.
+  int data_blocks = 0;
+  size_t max_records = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    if (block->compression != compressed_none) {
+      msg(log_error, "Bloom filters need decompressed blocks\n");
+      return -1;
+    }
+    if (block->header.NumRecords > max_records)
+      max_records = block->header.NumRecords;
+    ++data_blocks;
+  }
+  uint32_t bits = 64;
+  while (bits < 2 * max_records * BLOOM_BITS_PER_ADDRESS)
+    bits <<= 1;
+
+  nf_block_p bloom = block_new();
+  size_t size = sizeof(bloom_filter_t) + (size_t)data_blocks * bits / 8;
+  if (bloom == NULL || (bloom->data = (char*)calloc(1, size)) == NULL) {
+    msg(log_error, "Failed to allocate bloom filter\n");
+    block_free(&bloom);
+    return -1;
+  }
+  bloom_filter_t* header = (bloom_filter_t*)bloom->data;
+  header->bits = bits;
+  header->hashes = BLOOM_HASHES;
+
+  nf_block_p* blocks = (nf_block_p*)malloc(data_blocks * sizeof(nf_block_p));
+  if (blocks == NULL) {
+    msg(log_error, "Failed to allocate bloom filter\n");
+    block_free(&bloom);
+    return -1;
+  }
+  int data_block = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    if (block_is_data(fl->blocks[i]))
+      blocks[data_block++] = fl->blocks[i];
+  }
+
+  uint8_t* filters = (uint8_t*)(header + 1);
+  int result = 0;
+  #pragma omp parallel for reduction(|:result)
+  for (int i = 0; i < data_blocks; ++i) {
+    _addresses_t addresses;
+    addresses.count = 0;
+    addresses.capacity = (size_t)blocks[i]->header.NumRecords * 2;
+    addresses.addresses = (uint64_t*)malloc(blocks[i]->header.NumRecords * 4 * sizeof(uint64_t));
+    if ((addresses.addresses == NULL && blocks[i]->header.NumRecords > 0)
+        || block_for_each_record(blocks[i], &_add_addresses, &addresses) != 0
+        || _fill_filter(filters + (size_t)i * bits / 8, bits, &addresses) != 0)
+      result = -1;
+    free(addresses.addresses);
+  }
+  free(blocks);
+  if (result != 0) {
+    msg(log_error, "Failed to build bloom filter\n");
+    block_free(&bloom);
+    return -1;
+  }
+
+  bloom->header.id = BLOOM_BLOCK;
+  bloom->header.NumRecords = data_blocks;
+  bloom->header.size = size;
+  bloom->compressed_size = size;
+  bloom->uncompressed_size = size;
+  if (file_insert_block(file, 0, bloom) != 0) {
+    block_free(&bloom);
+    return -1;
+  }
+  msg(log_debug, "Built bloom filters of %u bits for %d blocks\n", bits, data_blocks);
+  return 0;
+}
+
+
+void bloom_remove(nf_file_p file) {
+  int index = file_find_block(file, BLOOM_BLOCK);
+  if (index < 0)
+    return;
+  nf_block_p bloom = file_remove_block(file, index);
+  block_free(&bloom);
+}
+
+
+int bloom_select(const nf_file_p file, const uint64_t addr[2], int* selected) {
+  // Mark the blocks of file that may hold addr. Without a bloom filter, or
+  // when it doesn't fit the blocks, all data blocks are selected.
+  int index = file_find_block(file, BLOOM_BLOCK);
+  const bloom_filter_t* header = NULL;
+  int data_blocks = 0;
+  for (int i = 0; i < file->header.NumBlocks; ++i) {
+    if (block_is_data(file->blocks[i]))
+      ++data_blocks;
+  }
+  if (index >= 0 && file->blocks[index]->data != NULL) {
+    header = (const bloom_filter_t*)file->blocks[index]->data;
+    size_t size = file->blocks[index]->header.size;
+    if (size < sizeof(bloom_filter_t) || header->bits < 8 || (header->bits & (header->bits - 1)) != 0
+        || size != sizeof(bloom_filter_t) + (size_t)data_blocks * header->bits / 8) {
+      msg(log_info, "Bloom filter doesn't match data blocks, ignoring it\n");
+      header = NULL;
+    }
+  }
+
+  uint64_t hash = _mix(addr[0] ^ _mix(addr[1]));
+  uint32_t h1 = (uint32_t)hash;
+  uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+  int count = 0;
+  int data_block = 0;
+  for (int i = 0; i < file->header.NumBlocks; ++i) {
+    selected[i] = 0;
+    if (!block_is_data(file->blocks[i]))
+      continue;
+    int match = 1;
+    if (header != NULL) {
+      const uint8_t* filter = (const uint8_t*)(header + 1) + (size_t)data_block * header->bits / 8;
+      for (uint32_t k = 0; k < header->hashes && match; ++k) {
+        uint32_t bit = (h1 + k * h2) & (header->bits - 1);
+        match = (filter[bit >> 3] >> (bit & 7)) & 1;
+      }
+    }
+    if (match) {
+      selected[i] = 1;
+      ++count;
+    }
+    ++data_block;
+  }
+  return count;
+}
+
+
+static inline uint64_t _mix(uint64_t x) {
+  // MurmurHash3 finalizer
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+
+static int _add_addresses(const record_header_t* record, void* context) {
+  _addresses_t* addresses = (_addresses_t*)context;
+  nf_flow_t flow;
+  if (record_decode(record, &flow) != 0)
+    return 0;
+  if (addresses->count == addresses->capacity) {
+    msg(log_error, "More records in block than its header says\n");
+    return -1;
+  }
+  uint64_t* addr = addresses->addresses + 2 * addresses->count;
+  addr[0] = flow.srcaddr[0];
+  addr[1] = flow.srcaddr[1];
+  addr[2] = flow.dstaddr[0];
+  addr[3] = flow.dstaddr[1];
+  addresses->count += 2;
+  return 0;
+}
+
+
+static int _fill_filter(uint8_t* filter, const uint32_t bits, const _addresses_t* addresses) {
+  // Hash all addresses in one go, so the loop can be vectorized, then set the bits
+  if (addresses->count == 0)
+    return 0;
+  uint64_t* hashes = (uint64_t*)malloc(addresses->count * sizeof(uint64_t));
+  if (hashes == NULL)
+    return -1;
+  const uint64_t* addr = addresses->addresses;
+  #pragma omp simd
+  for (size_t i = 0; i < addresses->count; ++i)
+    hashes[i] = _mix(addr[2 * i] ^ _mix(addr[2 * i + 1]));
+  for (size_t i = 0; i < addresses->count; ++i) {
+    uint32_t h1 = (uint32_t)hashes[i];
+    uint32_t h2 = (uint32_t)(hashes[i] >> 32) | 1;
+    for (uint32_t k = 0; k < BLOOM_HASHES; ++k) {
+      uint32_t bit = (h1 + k * h2) & (bits - 1);
+      filter[bit >> 3] |= 1 << (bit & 7);
+    }
+  }
+  free(hashes);
+  return 0;
+}
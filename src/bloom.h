@@ -0,0 +1,36 @@
+/**
+ * \file bloom.h
+ * \brief Per block Bloom filter on IP addresses
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _BLOOM_H
+#define _BLOOM_H
+
+#include "file.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// About 1% false positives
+#define BLOOM_BITS_PER_ADDRESS 10
+#define BLOOM_HASHES 7
+
+extern int bloom_build(nf_file_p *file);
+extern void bloom_remove(nf_file_p file);
+extern int bloom_select(const nf_file_p file, const uint64_t addr[2], int* selected);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * \file budget.c
+ * \brief Process wide memory budget for block data
+ *
+ * Blocks hold on to their data for as long as a file is loaded, so the
+ * budget can't always be met. Work on blocks therefore only waits for
+ * other work to finish and free its buffers; once none is going on, it
+ * goes ahead over budget, one block at a time.
+ *
+ * Blocks that are written in order hold on to their buffers until those
+ * before them are written. These are worked on in turns: a block after
+ * the one in turn waits while it would leave too little room for those
+ * before it, and only the block in turn goes ahead over budget, as none
+ * of the others frees anything before it does.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "budget.h"
+
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _freed = PTHREAD_COND_INITIALIZER;
+static size_t _budget = 0;
+static size_t _used = 0;
+static size_t _peak = 0;
+static int _active = 0;  // work between acquire and settle
+static long _next_turn = 0;  // turn of the first block not yet done
+static int _turns = 0;  // blocks between begin and end of their turn
+static size_t _largest = 0;  // most bytes held in a turn that ended
+static __thread long _turn = -1;  // of the block this thread works on
+static __thread size_t _held = 0;  // in the turn
+static __thread size_t _most_held = 0;  // in the turn
+static __thread int _working = 0;  // between acquire and settle
+static __thread size_t _grown = 0;  // since acquire
+
+
+static void _hold(const size_t bytes, const size_t freed) {
+  // Keeps track of the bytes held by the block in turn on this thread
+  if (_turn < 0)
+    return;
+  _held = _held + bytes > freed ? _held + bytes - freed : 0;
+  if (_held > _most_held)
+    _most_held = _held;
+}
+
+
+static size_t _room(void) {
+  // Blocks after the one in turn leave room for each block before them to
+  // hold as much as any block did, and wait for a block that held anything
+  // to end its turn to learn how much that is
+  if (_turn < 0 || _turn == _next_turn)
+    return 0;
+  return _largest > 0 ? (_turn - _next_turn) * _largest : _budget;
+}
+
+
+static int _may_go_over(void) {
+  // The block in turn goes ahead, as the others only free their buffers
+  // once it's done. Other work does when nothing else is going on.
+  if (_turn >= 0)
+    return _turn == _next_turn;
+  return _active == 0 && _turns == 0;
+}
+
+
+void budget_set(const size_t bytes) {
+  pthread_mutex_lock(&_lock);
+  _budget = bytes;
+  pthread_mutex_unlock(&_lock);
+}
+
+
+size_t budget_acquire(const size_t bytes) {
+  if (_budget == 0)
+    return 0;
+  pthread_mutex_lock(&_lock);
+  while (_used + bytes + _room() > _budget && !_may_go_over())
+    pthread_cond_wait(&_freed, &_lock);
+  if (_used + bytes > _budget)
+    msg(log_debug, "Going over memory budget by %zu bytes\n", _used + bytes - _budget);
+  _used += bytes;
+  if (_used > _peak)
+    _peak = _used;
+  _hold(bytes, 0);
+  ++_active;
+  _working = 1;
+  _grown = 0;
+  pthread_mutex_unlock(&_lock);
+  return bytes;
+}
+
+
+void budget_grow(const size_t bytes) {
+  // Work that is going on can't wait for others, which may be waiting on it
+  if (_budget == 0 || !_working)
+    return;
+  pthread_mutex_lock(&_lock);
+  _used += bytes;
+  if (_used > _peak)
+    _peak = _used;
+  _hold(bytes, 0);
+  _grown += bytes;
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void budget_settle(size_t* reserved, const size_t acquired, const size_t held) {
+  if (_budget == 0)
+    return;
+  pthread_mutex_lock(&_lock);
+  _used = _used - *reserved - acquired - _grown + held;
+  if (_used > _peak)
+    _peak = _used;
+  _hold(held + acquired, *reserved + acquired + _grown);
+  *reserved = held;
+  --_active;
+  _working = 0;
+  _grown = 0;
+  pthread_cond_broadcast(&_freed);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void budget_release(size_t* reserved) {
+  if (*reserved == 0)
+    return;
+  pthread_mutex_lock(&_lock);
+  _used -= *reserved;
+  _hold(0, *reserved);
+  *reserved = 0;
+  pthread_cond_broadcast(&_freed);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+long budget_turns(void) {
+  pthread_mutex_lock(&_lock);
+  long turn = _next_turn;
+  pthread_mutex_unlock(&_lock);
+  return turn;
+}
+
+
+void budget_begin_turn(const long turn) {
+  pthread_mutex_lock(&_lock);
+  _turn = turn;
+  _held = 0;
+  _most_held = 0;
+  ++_turns;
+  pthread_mutex_unlock(&_lock);
+}
+
+
+void budget_end_turn(void) {
+  pthread_mutex_lock(&_lock);
+  _next_turn = _turn + 1;
+  if (_most_held > _largest)
+    _largest = _most_held;
+  _turn = -1;
+  --_turns;
+  pthread_cond_broadcast(&_freed);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+size_t budget_peak(void) {
+  pthread_mutex_lock(&_lock);
+  size_t peak = _peak;
+  pthread_mutex_unlock(&_lock);
+  return peak;
+}
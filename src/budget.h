@@ -0,0 +1,49 @@
+/**
+ * \file budget.h
+ * \brief Process wide memory budget for block data
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _BUDGET_H
+#define _BUDGET_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Zero (the default) disables the budget
+extern void budget_set(const size_t bytes);
+// Reserves bytes for the work on a block, waiting while that would go over
+// budget and other work is still going on. Returns the bytes reserved.
+extern size_t budget_acquire(const size_t bytes);
+// Counts bytes that the work on this thread takes beyond what it acquired,
+// without waiting, until it settles
+extern void budget_grow(const size_t bytes);
+// Ends the work: of the acquired and already reserved bytes, keeps those
+// still held by the block in reserved
+extern void budget_settle(size_t* reserved, const size_t acquired, const size_t held);
+extern void budget_release(size_t* reserved);
+// Blocks that are written in order take turns, numbered on from the one
+// returned by budget_turns. Turns end in order, after the block is
+// written and its buffers are released.
+extern long budget_turns(void);
+extern void budget_begin_turn(const long turn);
+extern void budget_end_turn(void);
+// Most bytes reserved at any time
+extern size_t budget_peak(void);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,253 @@
+/**
+ * \file cache.c
+ * \brief Process wide cache of decompressed blocks
+ *
+ * Entries are found through a hash table on the block key and evicted in
+ * CLOCK order once the byte budget is reached. Entries that are still
+ * referenced are never evicted; an entry that doesn't fit is handed out
+ * uncached and freed on its last release.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "cache.h"
+
+#define INITIAL_BUCKETS 1024
+
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t _budget = 0;
+static size_t _bytes = 0;
+// Hash table
+static cache_entry_p* _buckets = NULL;
+static size_t _bucket_count = 0;
+// Clock
+static cache_entry_p* _entries = NULL;
+static size_t _count = 0;
+static size_t _capacity = 0;
+static size_t _hand = 0;
+static size_t _hits = 0;
+static size_t _misses = 0;
+
+static size_t _hash(const cache_key_t* key);
+static cache_entry_p _find(const cache_key_t* key);
+static int _insert(cache_entry_p entry);
+static void _remove(cache_entry_p entry);
+static void _evict(const size_t needed);
+static void _free_entry(cache_entry_p entry);
+
+
+void cache_set_size(const size_t bytes) {
+  pthread_mutex_lock(&_lock);
+  _budget = bytes;
+  _evict(0);
+  pthread_mutex_unlock(&_lock);
+}
+
+
+int cache_key_init(cache_key_t* key, const char* filename) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    msg(log_error, "Failed to stat: %s\n", filename);
+    return -1;
+  }
+  key->dev = st.st_dev;
+  key->ino = st.st_ino;
+  key->size = st.st_size;
+  key->mtime = st.st_mtim;
+  key->offset = 0;
+  return 0;
+}
+
+
+cache_entry_p cache_get(const cache_key_t* key) {
+  pthread_mutex_lock(&_lock);
+  cache_entry_p entry = _find(key);
+  if (entry != NULL) {
+    ++entry->refs;
+    entry->referenced = 1;
+    ++_hits;
+  }
+  else {
+    ++_misses;
+  }
+  pthread_mutex_unlock(&_lock);
+  return entry;
+}
+
+
+cache_entry_p cache_put(const cache_key_t* key, nf_block_p block) {
+  // Takes the data of the decompressed block
+  cache_entry_p entry = (cache_entry_p)calloc(1, sizeof(cache_entry_t));
+  if (entry == NULL) {
+    msg(log_error, "Failed to allocate cache entry\n");
+    return NULL;
+  }
+  entry->key = *key;
+  entry->data = block->data;
+  entry->size = block->header.size;
+  entry->records = block->header.NumRecords;
+  entry->id = block->header.id;
+  entry->refs = 1;
+  block->data = NULL;
+
+  pthread_mutex_lock(&_lock);
+  cache_entry_p existing = _find(key);
+  if (existing != NULL) {
+    // Another reader was first
+    ++existing->refs;
+    existing->referenced = 1;
+    pthread_mutex_unlock(&_lock);
+    _free_entry(entry);
+    return existing;
+  }
+  if (entry->size <= _budget) {
+    _evict(entry->size);
+    if (_bytes + entry->size <= _budget && _insert(entry) == 0) {
+      entry->cached = 1;
+      _bytes += entry->size;
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+  return entry;
+}
+
+
+void cache_release(cache_entry_p* entry) {
+  if (*entry == NULL)
+    return;
+  cache_entry_p en = *entry;
+  *entry = NULL;
+  pthread_mutex_lock(&_lock);
+  int unused = --en->refs == 0 && !en->cached;
+  pthread_mutex_unlock(&_lock);
+  if (unused)
+    _free_entry(en);
+}
+
+
+void cache_stats(cache_stats_t* stats) {
+  pthread_mutex_lock(&_lock);
+  stats->hits = _hits;
+  stats->misses = _misses;
+  stats->entries = _count;
+  stats->bytes = _bytes;
+  pthread_mutex_unlock(&_lock);
+}
+
+
+static size_t _hash(const cache_key_t* key) {
+  uint64_t hash = (uint64_t)key->dev * 0x9e3779b97f4a7c15ULL;
+  hash ^= (uint64_t)key->ino + (hash << 6) + (hash >> 2);
+  hash ^= (uint64_t)key->offset * 0xff51afd7ed558ccdULL;
+  hash ^= (uint64_t)key->mtime.tv_sec + (uint64_t)key->mtime.tv_nsec + (uint64_t)key->size;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return (size_t)hash;
+}
+
+
+int cache_key_equal(const cache_key_t* a, const cache_key_t* b) {
+  return a->offset == b->offset && a->ino == b->ino && a->dev == b->dev
+      && a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec
+      && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+
+static cache_entry_p _find(const cache_key_t* key) {
+  if (_bucket_count == 0)
+    return NULL;
+  cache_entry_p entry = _buckets[_hash(key) & (_bucket_count - 1)];
+  while (entry != NULL && !cache_key_equal(&entry->key, key))
+    entry = entry->next;
+  return entry;
+}
+
+
+static int _insert(cache_entry_p entry) {
+  if (_count >= _capacity) {
+    size_t capacity = _capacity > 0 ? 2 * _capacity : INITIAL_BUCKETS;
+    cache_entry_p* entries = (cache_entry_p*)realloc(_entries, capacity * sizeof(cache_entry_p));
+    if (entries == NULL)
+      return -1;
+    _entries = entries;
+    _capacity = capacity;
+  }
+  if (_count >= _bucket_count) {
+    // Rehash at a load factor of 1
+    size_t bucket_count = _bucket_count > 0 ? 2 * _bucket_count : INITIAL_BUCKETS;
+    cache_entry_p* buckets = (cache_entry_p*)calloc(bucket_count, sizeof(cache_entry_p));
+    if (buckets == NULL)
+      return -1;
+    for (size_t i = 0; i < _count; ++i) {
+      cache_entry_p moved = _entries[i];
+      size_t bucket = _hash(&moved->key) & (bucket_count - 1);
+      moved->next = buckets[bucket];
+      buckets[bucket] = moved;
+    }
+    free(_buckets);
+    _buckets = buckets;
+    _bucket_count = bucket_count;
+  }
+  size_t bucket = _hash(&entry->key) & (_bucket_count - 1);
+  entry->next = _buckets[bucket];
+  _buckets[bucket] = entry;
+  entry->slot = _count;
+  _entries[_count++] = entry;
+  return 0;
+}
+
+
+static void _remove(cache_entry_p entry) {
+  cache_entry_p* link = &_buckets[_hash(&entry->key) & (_bucket_count - 1)];
+  while (*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+  // The last entry takes the slot in the clock
+  cache_entry_p last = _entries[--_count];
+  _entries[entry->slot] = last;
+  last->slot = entry->slot;
+  entry->cached = 0;
+  _bytes -= entry->size;
+}
+
+
+static void _evict(const size_t needed) {
+  // Two rounds of the clock clear all referenced bits
+  size_t steps = 2 * _count + 1;
+  while (_bytes + needed > _budget && _count > 0 && steps-- > 0) {
+    if (_hand >= _count)
+      _hand = 0;
+    cache_entry_p entry = _entries[_hand];
+    if (entry->refs > 0) {
+      ++_hand;
+    }
+    else if (entry->referenced) {
+      entry->referenced = 0;
+      ++_hand;
+    }
+    else {
+      // The hand now points at the entry that took the slot
+      _remove(entry);
+      _free_entry(entry);
+    }
+  }
+}
+
+
+static void _free_entry(cache_entry_p entry) {
+  free(entry->data);
+  free(entry);
+}
@@ -0,0 +1,75 @@
+/**
+ * \file cache.h
+ * \brief Process wide cache of decompressed blocks
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "block.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A block of a file, as it is on disk. A rewritten file gets new keys.
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;  // a file rewritten within a second still differs
+  off_t offset;  // of the block header
+} cache_key_t;
+
+// Decompressed records of a block. Shared between readers, valid until
+// released.
+typedef struct cache_entry_s {
+  cache_key_t key;
+  char* data;
+  size_t size;
+  uint32_t records;
+  uint16_t id;
+  // Owned by the cache
+  int refs;
+  int referenced;  // since the clock hand last passed
+  int cached;
+  size_t slot;
+  struct cache_entry_s* next;
+} cache_entry_t;
+typedef cache_entry_t* cache_entry_p;
+
+typedef struct {
+  size_t hits;
+  size_t misses;
+  size_t entries;
+  size_t bytes;
+} cache_stats_t;
+
+// Zero (the default) disables caching
+extern void cache_set_size(const size_t bytes);
+extern int cache_key_init(cache_key_t* key, const char* filename);
+extern int cache_key_equal(const cache_key_t* a, const cache_key_t* b);
+// Both return the entry with a reference held, cache_get NULL on a miss
+extern cache_entry_p cache_get(const cache_key_t* key);
+extern cache_entry_p cache_put(const cache_key_t* key, nf_block_p block);
+extern void cache_release(cache_entry_p* entry);
+extern void cache_stats(cache_stats_t* stats);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
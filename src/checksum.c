@@ -0,0 +1,266 @@
+/**
+ * \file checksum.c
+ * \brief Per block CRC32C checksums
+ *
+ * A CHECKSUM_BLOCK at the front of the file holds a checksum_t for every
+ * block after it: the CRC32C of the block as stored, which can be checked
+ * without decompressing, and for data blocks the CRC32C of the records,
+ * which stays the same when the file is recompressed. The SSE4.2 crc32
+ * instruction is used when the CPU has it.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42
+#endif
+
+#include "utils.h"
+#include "compress.h"
+#include "checksum.h"
+
+// Reflected CRC32C (Castagnoli) polynomial
+#define CRC32C_POLY 0x82f63b78
+
+typedef uint32_t (*_crc_fun_p) (uint32_t, const unsigned char*, size_t);
+
+static uint32_t _table[8][256];
+static _crc_fun_p _crc = NULL;
+
+static uint32_t _stored_crc(const nf_block_p block);
+
+
+uint32_t crc32c(uint32_t crc, const void* data, const size_t size) {
+  return ~_crc(~crc, (const unsigned char*)data, size);
+}
+
+
+int checksum_build(nf_file_p *file) {
+  // Takes the content checksums of the decompressed data blocks. The stored
+  // checksums follow with checksum_update, once the blocks are compressed.
+  nf_file_p fl = *file;
+  checksum_remove(fl);
+
+  int data_blocks = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    if (block->compression != compressed_none || block->header.id == COLUMNAR_BLOCK) {
+      msg(log_error, "Checksums need decompressed blocks\n");
+      return -1;
+    }
+    ++data_blocks;
+  }
+
+  nf_block_p checksums = block_new();
+  size_t size = data_blocks * sizeof(checksum_t);
+  if (checksums == NULL || (checksums->data = (char*)calloc(1, size + 1)) == NULL) {
+    msg(log_error, "Failed to allocate checksums\n");
+    block_free(&checksums);
+    return -1;
+  }
+  checksum_t* entries = (checksum_t*)checksums->data;
+  int data_block = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (block_is_data(block))
+      entries[data_block++].id = i;  // Just for now
+  }
+  #pragma omp parallel for
+  for (int i = 0; i < data_blocks; ++i) {
+    nf_block_p block = fl->blocks[entries[i].id];
+    entries[i].content = crc32c(0, block->data, block->header.size);
+    entries[i].id = block->header.id;
+  }
+
+  checksums->header.id = CHECKSUM_BLOCK;
+  checksums->header.NumRecords = data_blocks;
+  checksums->header.size = size;
+  checksums->compressed_size = size;
+  checksums->uncompressed_size = size;
+  if (file_insert_block(file, 0, checksums) != 0) {
+    block_free(&checksums);
+    return -1;
+  }
+  return 0;
+}
+
+
+int checksum_update(nf_file_p *file) {
+  // Moves the checksums to the front, with an entry for every block after
+  // them and the checksums of the blocks as they are now.
+  nf_file_p fl = *file;
+  int index = file_find_block(fl, CHECKSUM_BLOCK);
+  if (index < 0)
+    return 0;
+  nf_block_p old = file_remove_block(fl, index);
+  const checksum_t* old_entries = (const checksum_t*)old->data;
+  int old_count = old->header.size / sizeof(checksum_t);
+  int old_data_blocks = 0;
+  for (int i = 0; i < old_count; ++i)
+    old_data_blocks += block_id_is_data(old_entries[i].id);
+  int data_blocks = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i)
+    data_blocks += block_is_data(fl->blocks[i]);
+  if (old_data_blocks != data_blocks) {
+    msg(log_error, "Checksums don't match the data blocks\n");
+    block_free(&old);
+    return -1;
+  }
+
+  nf_block_p checksums = block_new();
+  size_t size = fl->header.NumBlocks * sizeof(checksum_t);
+  if (checksums == NULL || (checksums->data = (char*)calloc(1, size + 1)) == NULL) {
+    msg(log_error, "Failed to allocate checksums\n");
+    block_free(&checksums);
+    block_free(&old);
+    return -1;
+  }
+  checksum_t* entries = (checksum_t*)checksums->data;
+  int old_entry = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    entries[i].id = block->header.id;
+    if (!block_is_data(block))
+      continue;
+    while (!block_id_is_data(old_entries[old_entry].id))
+      ++old_entry;
+    entries[i].content = old_entries[old_entry++].content;
+  }
+  block_free(&old);
+  #pragma omp parallel for
+  for (int i = 0; i < fl->header.NumBlocks; ++i)
+    entries[i].stored = _stored_crc(fl->blocks[i]);
+
+  checksums->header.id = CHECKSUM_BLOCK;
+  checksums->header.NumRecords = fl->header.NumBlocks;
+  checksums->header.size = size;
+  checksums->compressed_size = size;
+  checksums->uncompressed_size = size;
+  if (file_insert_block(file, 0, checksums) != 0) {
+    block_free(&checksums);
+    return -1;
+  }
+  return 0;
+}
+
+
+void checksum_remove(nf_file_p file) {
+  int index = file_find_block(file, CHECKSUM_BLOCK);
+  if (index < 0)
+    return;
+  nf_block_p checksums = file_remove_block(file, index);
+  block_free(&checksums);
+}
+
+
+int checksum_verify(nf_file_p file, const int check_content) {
+  // Returns the number of bad blocks, or -1 when the file has no checksums.
+  // Checking the content decompresses the data blocks.
+  if (file->header.NumBlocks == 0 || file->blocks[0]->header.id != CHECKSUM_BLOCK)
+    return -1;
+  nf_block_p checksums = file->blocks[0];
+  const checksum_t* entries = (const checksum_t*)checksums->data;
+  if (checksums->data == NULL || checksums->header.size % sizeof(checksum_t) != 0
+      || checksums->header.size / sizeof(checksum_t) != file->header.NumBlocks - 1) {
+    msg(log_error, "Checksums don't match the blocks\n");
+    return file->header.NumBlocks;
+  }
+  int bad = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(+:bad)
+  for (int i = 1; i < file->header.NumBlocks; ++i) {
+    nf_block_p block = file->blocks[i];
+    const checksum_t* entry = &entries[i - 1];
+    if (block->status != 0 || block->data == NULL || entry->id != block->header.id
+        || _stored_crc(block) != entry->stored) {
+      msg(log_error, "Checksum mismatch in block: %d\n", i);
+      ++bad;
+    }
+    else if (check_content && block_is_data(block)) {
+      if (decompress(block) != 0 || crc32c(0, block->data, block->header.size) != entry->content) {
+        msg(log_error, "Content checksum mismatch in block: %d\n", i);
+        ++bad;
+      }
+    }
+  }
+  return bad;
+}
+
+
+static uint32_t _stored_crc(const nf_block_p block) {
+  uint32_t crc = crc32c(0, &block->header, sizeof(block->header));
+  return crc32c(crc, block->data, block->header.size);
+}
+
+
+static uint32_t _crc32c_sw(uint32_t crc, const unsigned char* data, size_t size) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // Slicing by 8
+  while (size >= 8) {
+    uint32_t low, high;
+    memcpy(&low, data, sizeof(low));
+    memcpy(&high, data + 4, sizeof(high));
+    low ^= crc;
+    crc = _table[7][low & 0xff] ^ _table[6][(low >> 8) & 0xff]
+        ^ _table[5][(low >> 16) & 0xff] ^ _table[4][low >> 24]
+        ^ _table[3][high & 0xff] ^ _table[2][(high >> 8) & 0xff]
+        ^ _table[1][(high >> 16) & 0xff] ^ _table[0][high >> 24];
+    data += 8;
+    size -= 8;
+  }
+#endif
+  while (size-- > 0)
+    crc = _table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_sse42(uint32_t crc, const unsigned char* data, size_t size) {
+  uint64_t crc64 = crc;
+  while (size >= 8) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    crc64 = _mm_crc32_u64(crc64, value);
+    data += 8;
+    size -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (size-- > 0)
+    crc = _mm_crc32_u8(crc, *data++);
+  return crc;
+}
+#endif
+
+
+__attribute__((constructor))
+static void _crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    _table[0][i] = crc;
+  }
+  for (int k = 1; k < 8; ++k) {
+    for (int i = 0; i < 256; ++i)
+      _table[k][i] = (_table[k - 1][i] >> 8) ^ _table[0][_table[k - 1][i] & 0xff];
+  }
+  _crc = &_crc32c_sw;
+#ifdef HAVE_CRC32C_SSE42
+  if (__builtin_cpu_supports("sse4.2"))
+    _crc = &_crc32c_sse42;
+#endif
+}
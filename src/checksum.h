@@ -0,0 +1,36 @@
+/**
+ * \file checksum.h
+ * \brief Per block CRC32C checksums
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include "file.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Continues crc with data. Start with a crc of 0.
+extern uint32_t crc32c(uint32_t crc, const void* data, const size_t size);
+
+extern int checksum_build(nf_file_p *file);
+extern int checksum_update(nf_file_p *file);
+extern void checksum_remove(nf_file_p file);
+extern int checksum_verify(nf_file_p file, const int check_content);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,397 @@
+/**
+ * \file columnar.c
+ * \brief Column wise storage of the records of a data block
+ *
+ * A COLUMNAR_BLOCK holds the same records as the data block it was made
+ * from, but with each field of the flow records in a column of its own.
+ * Times are stored as differences, which together with the like values of
+ * a column makes for much better compression than the rows. Each column is
+ * compressed separately, so a reader that needs a few fields only has to
+ * decompress those. Records other than flows (extension maps, ..) and any
+ * extensions of the flows are kept as they are, so the rows are restored
+ * exactly.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "utils.h"
+#include "compress.h"
+#include "columnar.h"
+#include "budget.h"
+
+#define FLOW_HEADER_SIZE offsetof(common_record_t, data)
+
+compression_t columnar_compression = compressed_none;
+
+// Bytes per flow of the fixed width columns
+static const size_t _widths[column_count] = {
+  0, 0, 2, 2, 2, 2, 4, 4, 1, 1, 1, 1, 2, 2, 2, 2, 0, 0, 0
+};
+
+typedef struct {
+  char* data[column_count];
+  size_t size[column_count];
+  size_t rows;     // size of the records
+  uint32_t flows;
+  uint32_t first;  // of the previous flow
+} _columns_t;
+
+typedef struct {
+  const char* data;
+  size_t size;
+  size_t offset;
+} _cursor_t;
+
+static size_t _addresses_size(const uint16_t flags);
+static size_t _counters_size(const uint16_t flags);
+static int _measure_record(const record_header_t* record, void* context);
+static int _split_record(const record_header_t* record, void* context);
+static int _columns(const nf_block_t* block, const columnar_header_t** header,
+                    const column_header_t** columns, const char** data);
+static int _take(_cursor_t* cursor, void* target, const size_t size);
+
+
+int columnar_encode(nf_block_p block, const compression_t compression) {
+  // Returns 1 when the records can't be stored column wise, leaving the
+  // block as it is.
+  if (block->header.id == COLUMNAR_BLOCK && block->compression == compression)
+    return 0;
+  if (!block_is_data(block) || block->header.id == COLUMNAR_BLOCK)
+    return 1;
+  if (block->compression != compressed_none) {
+    msg(log_error, "Block is already compressed\n");
+    return -1;
+  }
+
+  _columns_t columns;
+  memset(&columns, 0, sizeof(columns));
+  char* compressed[column_count] = { NULL };
+  size_t compressed_size[column_count] = { 0 };
+  char* buffer = NULL;
+  int result = -1;
+
+  if (block_for_each_record(block, &_measure_record, &columns) != 0
+      || columns.rows != block->header.size) {
+    msg(log_debug, "Keeping rows of block with unexpected records\n");
+    return 1;
+  }
+  size_t sizes[column_count];
+  for (int i = 0; i < column_count; ++i) {
+    sizes[i] = _widths[i] > 0 ? columns.flows * _widths[i] : columns.size[i];
+    columns.size[i] = 0;
+    if (sizes[i] > 0 && (columns.data[i] = (char*)malloc(sizes[i])) == NULL) {
+      msg(log_error, "Failed to allocate column\n");
+      goto failure;
+    }
+  }
+  block_for_each_record(block, &_split_record, &columns);
+
+  size_t size = sizeof(columnar_header_t) + column_count * sizeof(column_header_t);
+  for (int i = 0; i < column_count; ++i) {
+    if (sizes[i] == 0)
+      continue;
+    if (compress_buffer(compression, columns.data[i], sizes[i], &compressed[i], &compressed_size[i]) != 0)
+      goto failure;
+    size += compressed_size[i];
+  }
+  if (size > UINT32_MAX) {
+    msg(log_error, "Columnar block too large\n");
+    goto failure;
+  }
+
+  buffer = (char*)malloc(size);
+  if (buffer == NULL) {
+    msg(log_error, "Failed to allocate columnar block\n");
+    goto failure;
+  }
+  columnar_header_t* header = (columnar_header_t*)buffer;
+  header->id = block->header.id;
+  header->columns = column_count;
+  header->flows = columns.flows;
+  column_header_t* column = (column_header_t*)(header + 1);
+  char* data = (char*)(column + column_count);
+  for (int i = 0; i < column_count; ++i) {
+    column[i].size = compressed_size[i];
+    column[i].uncompressed_size = sizes[i];
+    if (compressed_size[i] > 0)
+      memcpy(data, compressed[i], compressed_size[i]);
+    data += compressed_size[i];
+  }
+
+  free(block->data);
+  block->data = buffer;
+  block->header.id = COLUMNAR_BLOCK;
+  block->header.size = size;
+  block->compressed_size = size;
+  block->compression = compression;
+  buffer = NULL;
+  result = 0;
+failure:
+  for (int i = 0; i < column_count; ++i) {
+    free(columns.data[i]);
+    free(compressed[i]);
+  }
+  free(buffer);
+  return result;
+}
+
+
+int columnar_decode(nf_block_p block) {
+  char* rows = NULL;
+  size_t size = 0;
+  if (columnar_rows(block, &rows, &size) != 0)
+    return -1;
+  const columnar_header_t* header = (const columnar_header_t*)block->data;
+  block->header.id = header->id;
+  free(block->data);
+  block->data = rows;
+  block->header.size = size;
+  block->uncompressed_size = size;
+  block->compression = compressed_none;
+  return 0;
+}
+
+
+int columnar_column(const nf_block_t* block, const column_t column, char** data, size_t* size) {
+  // Decompresses a single column. An empty column gives NULL.
+  const columnar_header_t* header = NULL;
+  const column_header_t* columns = NULL;
+  const char* column_data[column_count];
+  if (_columns(block, &header, &columns, column_data) != 0)
+    return -1;
+  *data = NULL;
+  *size = 0;
+  if (columns[column].size == 0)
+    return columns[column].uncompressed_size == 0 ? 0 : -1;
+  if (decompress_buffer(block->compression, column_data[column], columns[column].size, data, size) != 0)
+    return -1;
+  if (*size != columns[column].uncompressed_size) {
+    msg(log_error, "Unexpected column size: %lu\n", *size);
+    free(*data);
+    *data = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+int columnar_rows(const nf_block_t* block, char** rows, size_t* size) {
+  // Restores the records into a newly allocated buffer
+  char* data[column_count] = { NULL };
+  _cursor_t cursors[column_count];
+  char* buffer = NULL;
+  for (int i = 0; i < column_count; ++i) {
+    cursors[i].offset = 0;
+    if (columnar_column(block, i, &data[i], &cursors[i].size) != 0)
+      goto failure;
+    cursors[i].data = data[i];
+  }
+
+  size_t rows_size = 0;
+  for (size_t offset = 0; offset + sizeof(record_header_t) <= cursors[column_records].size;
+       offset += sizeof(record_header_t))
+    rows_size += ((const record_header_t*)(data[column_records] + offset))->size;
+  buffer = (char*)malloc(rows_size > 0 ? rows_size : 1);
+  if (buffer == NULL) {
+    msg(log_error, "Failed to allocate records\n");
+    goto failure;
+  }
+
+  size_t offset = 0;
+  uint32_t first = 0;
+  record_header_t record;
+  while (_take(&cursors[column_records], &record, sizeof(record)) == 0) {
+    char* target = buffer + offset;
+    if (record.size < sizeof(record))
+      goto invalid;
+    memcpy(target, &record, sizeof(record));
+    offset += record.size;
+    if (record.type != CommonRecordType) {
+      if (_take(&cursors[column_others], target + sizeof(record), record.size - sizeof(record)) != 0)
+        goto invalid;
+      continue;
+    }
+    common_record_t* flow = (common_record_t*)target;
+    uint32_t delta, duration;
+    if (record.size < FLOW_HEADER_SIZE
+        || _take(&cursors[column_flags], &flow->flags, sizeof(flow->flags)) != 0
+        || _take(&cursors[column_ext_map], &flow->ext_map, sizeof(flow->ext_map)) != 0
+        || _take(&cursors[column_msec_first], &flow->msec_first, sizeof(flow->msec_first)) != 0
+        || _take(&cursors[column_msec_last], &flow->msec_last, sizeof(flow->msec_last)) != 0
+        || _take(&cursors[column_first], &delta, sizeof(delta)) != 0
+        || _take(&cursors[column_duration], &duration, sizeof(duration)) != 0
+        || _take(&cursors[column_fwd_status], &flow->fwd_status, sizeof(flow->fwd_status)) != 0
+        || _take(&cursors[column_tcp_flags], &flow->tcp_flags, sizeof(flow->tcp_flags)) != 0
+        || _take(&cursors[column_protocol], &flow->prot, sizeof(flow->prot)) != 0
+        || _take(&cursors[column_tos], &flow->tos, sizeof(flow->tos)) != 0
+        || _take(&cursors[column_srcport], &flow->srcport, sizeof(flow->srcport)) != 0
+        || _take(&cursors[column_dstport], &flow->dstport, sizeof(flow->dstport)) != 0
+        || _take(&cursors[column_exporter], &flow->exporter_sysid, sizeof(flow->exporter_sysid)) != 0
+        || _take(&cursors[column_reserved], &flow->reserved, sizeof(flow->reserved)) != 0)
+      goto invalid;
+    first += delta;
+    flow->first = first;
+    flow->last = first + duration;
+    size_t addresses = _addresses_size(flow->flags);
+    size_t counters = _counters_size(flow->flags);
+    char* extra = (char*)flow->data;
+    if (record.size < FLOW_HEADER_SIZE + addresses + counters
+        || _take(&cursors[column_addresses], extra, addresses) != 0
+        || _take(&cursors[column_counters], extra + addresses, counters) != 0
+        || _take(&cursors[column_extensions], extra + addresses + counters,
+                 record.size - FLOW_HEADER_SIZE - addresses - counters) != 0)
+      goto invalid;
+  }
+
+  for (int i = 0; i < column_count; ++i)
+    free(data[i]);
+  *rows = buffer;
+  *size = rows_size;
+  return 0;
+invalid:
+  msg(log_error, "Invalid columnar block\n");
+failure:
+  for (int i = 0; i < column_count; ++i)
+    free(data[i]);
+  free(buffer);
+  return -1;
+}
+
+
+void columnar_compressor(const int blocknum, nf_block_t* block)
+{
+  msg(log_debug, "Column compressing block: %d\n", blocknum);
+  // The columns and their compressed output, at worst
+  size_t needed = block->data != NULL && block_is_data(block) && block->compression == compressed_none
+      ? block->header.size + compress_funs_list[columnar_compression].size(block->header.size) : 0;
+  size_t acquired = budget_acquire(needed);
+  int result = columnar_encode(block, columnar_compression);
+  // Blocks that can't be split up are compressed as rows
+  block->status = result > 0 ? compress(block, columnar_compression) : result;
+  budget_settle(&block->reserved, acquired, block->data != NULL ? block->header.size : 0);
+}
+
+
+static size_t _addresses_size(const uint16_t flags) {
+  return flags & FLAG_IPV6_ADDR ? 4 * sizeof(uint64_t) : 2 * sizeof(uint32_t);
+}
+
+
+static size_t _counters_size(const uint16_t flags) {
+  return (flags & FLAG_PKG_64 ? sizeof(uint64_t) : sizeof(uint32_t))
+      + (flags & FLAG_BYTES_64 ? sizeof(uint64_t) : sizeof(uint32_t));
+}
+
+
+static int _measure_record(const record_header_t* record, void* context) {
+  _columns_t* columns = (_columns_t*)context;
+  columns->rows += record->size;
+  columns->size[column_records] += sizeof(record_header_t);
+  if (record->type != CommonRecordType) {
+    columns->size[column_others] += record->size - sizeof(record_header_t);
+    return 0;
+  }
+  const common_record_t* flow = (const common_record_t*)record;
+  if (record->size < FLOW_HEADER_SIZE)
+    return 1;
+  size_t addresses = _addresses_size(flow->flags);
+  size_t counters = _counters_size(flow->flags);
+  if (record->size < FLOW_HEADER_SIZE + addresses + counters)
+    return 1;
+  ++columns->flows;
+  columns->size[column_addresses] += addresses;
+  columns->size[column_counters] += counters;
+  columns->size[column_extensions] += record->size - FLOW_HEADER_SIZE - addresses - counters;
+  return 0;
+}
+
+
+static void _append(_columns_t* columns, const column_t column, const void* value, const size_t size) {
+  memcpy(columns->data[column] + columns->size[column], value, size);
+  columns->size[column] += size;
+}
+
+
+static int _split_record(const record_header_t* record, void* context) {
+  _columns_t* columns = (_columns_t*)context;
+  _append(columns, column_records, record, sizeof(record_header_t));
+  if (record->type != CommonRecordType) {
+    _append(columns, column_others, (const char*)record + sizeof(record_header_t),
+            record->size - sizeof(record_header_t));
+    return 0;
+  }
+  const common_record_t* flow = (const common_record_t*)record;
+  uint32_t delta = flow->first - columns->first;
+  uint32_t duration = flow->last - flow->first;
+  columns->first = flow->first;
+  _append(columns, column_flags, &flow->flags, sizeof(flow->flags));
+  _append(columns, column_ext_map, &flow->ext_map, sizeof(flow->ext_map));
+  _append(columns, column_msec_first, &flow->msec_first, sizeof(flow->msec_first));
+  _append(columns, column_msec_last, &flow->msec_last, sizeof(flow->msec_last));
+  _append(columns, column_first, &delta, sizeof(delta));
+  _append(columns, column_duration, &duration, sizeof(duration));
+  _append(columns, column_fwd_status, &flow->fwd_status, sizeof(flow->fwd_status));
+  _append(columns, column_tcp_flags, &flow->tcp_flags, sizeof(flow->tcp_flags));
+  _append(columns, column_protocol, &flow->prot, sizeof(flow->prot));
+  _append(columns, column_tos, &flow->tos, sizeof(flow->tos));
+  _append(columns, column_srcport, &flow->srcport, sizeof(flow->srcport));
+  _append(columns, column_dstport, &flow->dstport, sizeof(flow->dstport));
+  _append(columns, column_exporter, &flow->exporter_sysid, sizeof(flow->exporter_sysid));
+  _append(columns, column_reserved, &flow->reserved, sizeof(flow->reserved));
+  size_t addresses = _addresses_size(flow->flags);
+  size_t counters = _counters_size(flow->flags);
+  const char* extra = (const char*)flow->data;
+  _append(columns, column_addresses, extra, addresses);
+  _append(columns, column_counters, extra + addresses, counters);
+  _append(columns, column_extensions, extra + addresses + counters,
+          record->size - FLOW_HEADER_SIZE - addresses - counters);
+  return 0;
+}
+
+
+static int _columns(const nf_block_t* block, const columnar_header_t** header,
+                    const column_header_t** columns, const char** data) {
+  size_t size = sizeof(columnar_header_t) + column_count * sizeof(column_header_t);
+  if (block->data == NULL || block->header.size < size) {
+    msg(log_error, "Invalid columnar block\n");
+    return -1;
+  }
+  *header = (const columnar_header_t*)block->data;
+  if ((*header)->columns != column_count) {
+    msg(log_error, "Unexpected number of columns: %u\n", (*header)->columns);
+    return -1;
+  }
+  *columns = (const column_header_t*)(*header + 1);
+  const char* column_data = (const char*)(*columns + column_count);
+  for (int i = 0; i < column_count; ++i) {
+    data[i] = column_data;
+    column_data += (*columns)[i].size;
+    size += (*columns)[i].size;
+  }
+  if (size != block->header.size) {
+    msg(log_error, "Invalid columnar block size\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+static int _take(_cursor_t* cursor, void* target, const size_t size) {
+  if (cursor->offset + size > cursor->size)
+    return -1;
+  if (size > 0)
+    memcpy(target, cursor->data + cursor->offset, size);
+  cursor->offset += size;
+  return 0;
+}
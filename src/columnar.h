@@ -0,0 +1,61 @@
+/**
+ * \file columnar.h
+ * \brief Column wise storage of the records of a data block
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _COLUMNAR_H
+#define _COLUMNAR_H
+
+#include "block.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  column_records,     // type and size of every record
+  column_others,      // records other than flows, without their header
+  column_flags,
+  column_ext_map,
+  column_msec_first,
+  column_msec_last,
+  column_first,       // difference with the previous flow
+  column_duration,    // last - first
+  column_fwd_status,
+  column_tcp_flags,
+  column_protocol,
+  column_tos,
+  column_srcport,
+  column_dstport,
+  column_exporter,
+  column_reserved,
+  column_addresses,   // source and destination, 4 or 16 bytes each
+  column_counters,    // packets and bytes, 4 or 8 bytes each
+  column_extensions,  // rest of the flow record
+  column_count        // terminator: leave as last element
+} column_t;
+
+// Compression of the columns by columnar_compressor
+extern compression_t columnar_compression;
+
+extern int columnar_encode(nf_block_p block, const compression_t compression);
+extern int columnar_decode(nf_block_p block);
+extern int columnar_rows(const nf_block_t* block, char** rows, size_t* size);
+extern int columnar_column(const nf_block_t* block, const column_t column, char** data, size_t* size);
+
+extern void columnar_compressor(const int blocknum, nf_block_t* block);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
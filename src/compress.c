@@ -13,8 +13,13 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include <lzo/lzo1x.h>
 
 #include "config.h"
@@ -40,13 +45,69 @@
 #include "types.h"
 #include "utils.h"
 #include "compress.h"
+#include "columnar.h"
+#include "budget.h"
+#include "record.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+// Enough for the 64 MB dictionary of LZMA level 9 and the decoder itself
+#define LZMA_MEMORY_LIMIT (128 * 1024 * 1024)
+// Whole blocks don't decompress to more than this many times their size.
+// LZ4 and LZO don't get beyond about 255 times anyway.
+#define MAX_RATIO 256
+#define MAX_STREAM_RATIO 1024
 
 int bz2_preset = DEFAULT_BZ2_PRESET;
 int lzma_preset = DEFAULT_LZMA_PRESET;
+size_t mt_threshold = DEFAULT_MT_THRESHOLD;
+
+// Threads compressing a block at the moment
+static int _compressing = 0;
+
+
+static int _mt_threads(const size_t source_len) {
+  // Threads that large blocks are split up for. This doesn't change while
+  // a block is compressed, so the bounds on its size hold.
+  if (source_len < mt_threshold)
+    return 1;
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
 
 
+#if defined(HAVE_LIBLZMA) && defined(HAVE_LZMA_STREAM_ENCODER_MT)
+static int _free_threads(const size_t source_len) {
+  // Encoder threads a large block can start: one, and those of the threads
+  // that aren't compressing blocks of their own
+  int threads = _mt_threads(source_len);
+  int compressing;
+  #pragma omp atomic read
+  compressing = _compressing;
+  if (compressing > 1)
+    threads -= compressing - 1;
+  return threads > 1 ? threads : 1;
+}
+#endif
+
+
+static size_t _bz2_chunk_size(const size_t source_len) {
+  // Chunks are a whole number of bz2 blocks, so splitting costs next to nothing in ratio
+  size_t bz2_block = bz2_preset * 100000;
+  int threads = _mt_threads(source_len);
+  size_t chunk = (source_len + threads - 1) / threads;
+  return (chunk + bz2_block - 1) / bz2_block * bz2_block;
+}
+
+
+static size_t _lzma_chunk_size(const size_t source_len) {
+  int threads = _mt_threads(source_len);
+  size_t chunk = (source_len + threads - 1) / threads;
+  return chunk < 0x100000 ? 0x100000 : chunk;
+}
+
 
 int compress_none(const char* source, const size_t source_len, char* target, size_t* target_len) {
   size_t len = min(source_len, *target_len);
@@ -68,16 +129,72 @@ int compress_lzo(const char* source, const size_t source_len, char* target, size
 }
 
 
+#ifdef HAVE_LIBBZ2
+static void _compress_bz2_chunks(const char* source, const size_t source_len, const size_t chunk_size,
+                                 const int chunks, char** buffers, unsigned int* sizes, int* results) {
+  #pragma omp taskloop
+  for (int i = 0; i < chunks; ++i) {
+    size_t offset = i * chunk_size;
+    size_t len = min(chunk_size, source_len - offset);
+    sizes[i] = 101 * len / 100 + 600;
+    buffers[i] = (char*)malloc(sizes[i]);
+    if (buffers[i] == NULL) {
+      results[i] = BZ_MEM_ERROR;
+      continue;
+    }
+    results[i] = BZ2_bzBuffToBuffCompress(
+        buffers[i], &sizes[i], (char*)source + offset, len, bz2_preset, 0, 30);
+  }
+}
+#endif
+
+
 int compress_bz2(const char* source, const size_t source_len, char* target, size_t* target_len) {
 #ifdef HAVE_LIBBZ2
-  return BZ2_bzBuffToBuffCompress(
-      target,
-      (unsigned int*)target_len,
-      (char*)source,
-      source_len,
-      bz2_preset,  // * 100k: block size
-      0,           // verbosity: be quiet
-      30);         // workFactor, threshold for fallback to alt algo: defaults to 30
+  if (_mt_threads(source_len) <= 1) {
+    return BZ2_bzBuffToBuffCompress(
+        target,
+        (unsigned int*)target_len,
+        (char*)source,
+        source_len,
+        bz2_preset,  // * 100k: block size
+        0,           // verbosity: be quiet
+        30);         // workFactor, threshold for fallback to alt algo: defaults to 30
+  }
+  // Large block: compress chunks as separate, concatenated bz2 streams.
+  // Threads of the current team that are done with their own blocks pick
+  // up the chunk tasks. Outside of a team, one is started for them.
+  size_t chunk_size = _bz2_chunk_size(source_len);
+  int chunks = (source_len + chunk_size - 1) / chunk_size;
+  char* buffers[chunks];
+  unsigned int sizes[chunks];
+  int results[chunks];
+  memset(buffers, 0, sizeof(buffers));
+#ifdef _OPENMP
+  if (!omp_in_parallel()) {
+    #pragma omp parallel
+    #pragma omp single
+    _compress_bz2_chunks(source, source_len, chunk_size, chunks, buffers, sizes, results);
+  }
+  else
+#endif
+    _compress_bz2_chunks(source, source_len, chunk_size, chunks, buffers, sizes, results);
+  int result = BZ_OK;
+  size_t target_pos = 0;
+  for (int i = 0; i < chunks; ++i) {
+    if (result == BZ_OK && results[i] != BZ_OK)
+      result = results[i];
+    if (result == BZ_OK && target_pos + sizes[i] > *target_len)
+      result = BZ_OUTBUFF_FULL;
+    if (result == BZ_OK) {
+      memcpy(target + target_pos, buffers[i], sizes[i]);
+      target_pos += sizes[i];
+    }
+    free(buffers[i]);
+  }
+  if (result == BZ_OK)
+    *target_len = target_pos;
+  return result;
 #else
   msg(log_error, "BZ2 support is not compiled in.\n");
   return -1;
@@ -100,8 +217,78 @@ int compress_lz4(const char* source, const size_t source_len, char* target, size
 }
 
 
+int compress_lz4_dict(const char* source, const size_t source_len, char* target, size_t* target_len,
+                      const char* dictionary, const size_t dictionary_len) {
+#ifdef HAVE_LIBLZ4
+  LZ4_stream_t stream;
+  LZ4_initStream(&stream, sizeof(stream));
+  LZ4_loadDict(&stream, dictionary, dictionary_len);
+  int result = LZ4_compress_fast_continue(&stream, source, target, source_len, *target_len, 1);
+  if (result > 0) {
+    *target_len = result;
+    result = 0;
+  }
+  else {
+    result = -1;
+  }
+  return result;
+#else
+  msg(log_error, "LZ4 support is not compiled in.\n");
+  return -1;
+#endif
+}
+
+
+#if defined(HAVE_LIBLZMA) && defined(HAVE_LZMA_STREAM_ENCODER_MT)
+static lzma_mt _lzma_mt_options(const size_t source_len, const int threads) {
+  lzma_mt options = {
+    .flags = 0,
+    .threads = threads,
+    .block_size = _lzma_chunk_size(source_len),
+    .timeout = 0,
+    .preset = lzma_preset,
+    .filters = NULL,
+    .check = LZMA_CHECK_CRC64
+  };
+  return options;
+}
+
+
+static int compress_lzma_mt(const char* source, const size_t source_len, char* target, size_t* target_len) {
+  // The xz blocks are the same for any number of threads
+  lzma_mt options = _lzma_mt_options(source_len, _free_threads(source_len));
+  lzma_stream stream = LZMA_STREAM_INIT;
+  int result = lzma_stream_encoder_mt(&stream, &options);
+  if (result != LZMA_OK)
+    return result;
+  stream.next_in = (uint8_t*)source;
+  stream.avail_in = source_len;
+  stream.next_out = (uint8_t*)target;
+  stream.avail_out = *target_len;
+  while ((result = lzma_code(&stream, LZMA_FINISH)) == LZMA_OK) {
+    if (stream.avail_out == 0) {
+      result = LZMA_BUF_ERROR;
+      break;
+    }
+  }
+  if (result == LZMA_STREAM_END) {
+    result = LZMA_OK;
+    *target_len = stream.total_out;
+  }
+  lzma_end(&stream);
+  return result;
+}
+#endif
+
+
 int compress_lzma(const char* source, const size_t source_len, char* target, size_t* target_len) {
 #ifdef HAVE_LIBLZMA
+#ifdef HAVE_LZMA_STREAM_ENCODER_MT
+  // Large block: the multithreaded encoder writes a regular xz stream with
+  // multiple xz blocks, which the single threaded decoder reads as is.
+  if (_mt_threads(source_len) > 1)
+    return compress_lzma_mt(source, source_len, target, target_len);
+#endif
   size_t target_pos = 0;
   int result = lzma_easy_buffer_encode(
       lzma_preset,       // preset: high values are expensive and don't bring much
@@ -132,7 +319,12 @@ size_t compress_max_size_lzo(const size_t uncompressed_size) {
 
 
 size_t compress_max_size_bz2(const size_t uncompressed_size) {
-  return 101 * uncompressed_size / 100 + 600;
+  size_t chunks = 1;
+  if (_mt_threads(uncompressed_size) > 1) {
+    size_t chunk_size = _bz2_chunk_size(uncompressed_size);
+    chunks = (uncompressed_size + chunk_size - 1) / chunk_size;
+  }
+  return 101 * uncompressed_size / 100 + 600 * chunks;
 }
 
 
@@ -147,7 +339,13 @@ size_t compress_max_size_lz4(const size_t uncompressed_size) {
 
 size_t compress_max_size_lzma(const size_t uncompressed_size) {
 #ifdef HAVE_LIBLZMA
-  return lzma_stream_buffer_bound(uncompressed_size);
+  size_t chunks = 0;
+  if (_mt_threads(uncompressed_size) > 1) {
+    size_t chunk_size = _lzma_chunk_size(uncompressed_size);
+    chunks = (uncompressed_size + chunk_size - 1) / chunk_size;
+  }
+  // Every extra xz block adds a block header, check and index record
+  return lzma_stream_buffer_bound(uncompressed_size) + chunks * (LZMA_BLOCK_HEADER_SIZE_MAX + 64);
 #else
   return uncompressed_size;
 #endif
@@ -174,13 +372,34 @@ int decompress_lzo(const char* source, const size_t source_len, char* target, si
 
 int decompress_bz2(const char* source, const size_t source_len, char* target, size_t* target_len) {
 #ifdef HAVE_LIBBZ2
-  return BZ2_bzBuffToBuffDecompress(
-      target,
-      (unsigned int*)target_len,
-      (char*)source,
-      source_len,
-      0,  // verbosity: be quiet
-      0); // "small" for small memories, we don't expect to have that
+  // Large blocks hold multiple concatenated streams (see compress_bz2)
+  size_t source_pos = 0, target_pos = 0;
+  int result = BZ_OK;
+  while (result == BZ_OK && source_pos < source_len) {
+    bz_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    result = BZ2_bzDecompressInit(
+        &stream,
+        0,  // verbosity: be quiet
+        0); // "small" for small memories, we don't expect to have that
+    if (result != BZ_OK)
+      break;
+    stream.next_in = (char*)source + source_pos;
+    stream.avail_in = source_len - source_pos;
+    stream.next_out = target + target_pos;
+    stream.avail_out = *target_len - target_pos;
+    result = BZ2_bzDecompress(&stream);
+    if (result == BZ_STREAM_END)
+      result = BZ_OK;
+    else if (result == BZ_OK)
+      result = stream.avail_out == 0 ? BZ_OUTBUFF_FULL : BZ_UNEXPECTED_EOF;
+    source_pos = source_len - stream.avail_in;
+    target_pos = *target_len - stream.avail_out;
+    BZ2_bzDecompressEnd(&stream);
+  }
+  if (result == BZ_OK)
+    *target_len = target_pos;
+  return result;
 #else
   msg(log_error, "BZ2 support is not compiled in.\n");
   return -1;
@@ -207,9 +426,31 @@ int decompress_lz4(const char* source, const size_t source_len, char* target, si
 }
 
 
+int decompress_lz4_dict(const char* source, const size_t source_len, char* target, size_t* target_len,
+                        const char* dictionary, const size_t dictionary_len) {
+#ifdef HAVE_LIBLZ4
+  int result = LZ4_decompress_safe_usingDict(
+      source,
+      target,
+      source_len,
+      *target_len,
+      dictionary,
+      dictionary_len);
+  if (result < 0)
+    return -1;
+  else
+    *target_len = result;
+  return 0;
+#else
+  msg(log_error, "LZ4 support is not compiled in.\n");
+  return -1;
+#endif
+}
+
+
 int decompress_lzma(const char* source, const size_t source_len, char* target, size_t* target_len) {
 #ifdef HAVE_LIBLZMA
-  uint64_t mem_limit = 0x04000000;
+  uint64_t mem_limit = LZMA_MEMORY_LIMIT;
   size_t source_pos = 0, target_pos = 0;
   int result = lzma_stream_buffer_decode(
       &mem_limit,  // Max memory to be used
@@ -257,11 +498,99 @@ size_t decompress_suggested_size_lzma(const size_t compressed_size) {
 }
 
 
+int decompress_stream_bz2(const char* source, const size_t source_len, char* window, const size_t window_size,
+                           window_handler_p handle_window, void* context) {
+#ifdef HAVE_LIBBZ2
+  bz_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  char* next_in = (char*)source;
+  unsigned int avail_in = source_len;
+  size_t fill = 0;
+  int active = 0;
+  int result = BZ_OK;
+  while (result == BZ_OK) {
+    if (!active) {
+      // Start on the next of possibly multiple concatenated streams
+      if (avail_in == 0)
+        break;
+      result = BZ2_bzDecompressInit(&stream, 0, 0);
+      if (result != BZ_OK)
+        break;
+      active = 1;
+    }
+    stream.next_in = next_in;
+    stream.avail_in = avail_in;
+    stream.next_out = window + fill;
+    stream.avail_out = window_size - fill;
+    result = BZ2_bzDecompress(&stream);
+    next_in = stream.next_in;
+    avail_in = stream.avail_in;
+    fill = window_size - stream.avail_out;
+    if (result == BZ_STREAM_END) {
+      BZ2_bzDecompressEnd(&stream);
+      active = 0;
+      result = BZ_OK;
+    }
+    else if (result == BZ_OK && fill < window_size) {
+      // Input exhausted in the middle of a stream
+      result = BZ_UNEXPECTED_EOF;
+    }
+    if (result == BZ_OK && fill == window_size) {
+      if (handle_window(window, fill, context) != 0)
+        result = -1;
+      fill = 0;
+    }
+  }
+  if (active)
+    BZ2_bzDecompressEnd(&stream);
+  if (result == BZ_OK && fill > 0 && handle_window(window, fill, context) != 0)
+    result = -1;
+  return result;
+#else
+  msg(log_error, "BZ2 support is not compiled in.\n");
+  return -1;
+#endif
+}
+
+
+int decompress_stream_lzma(const char* source, const size_t source_len, char* window, const size_t window_size,
+                            window_handler_p handle_window, void* context) {
+#ifdef HAVE_LIBLZMA
+  lzma_stream stream = LZMA_STREAM_INIT;
+  int result = lzma_stream_decoder(
+      &stream,
+      LZMA_MEMORY_LIMIT,  // Max memory to be used
+      0);          // Flags
+  if (result != LZMA_OK)
+    return result;
+  stream.next_in = (uint8_t*)source;
+  stream.avail_in = source_len;
+  size_t fill = 0;
+  while (result == LZMA_OK) {
+    stream.next_out = (uint8_t*)window + fill;
+    stream.avail_out = window_size - fill;
+    result = lzma_code(&stream, LZMA_FINISH);
+    fill = window_size - stream.avail_out;
+    if ((result == LZMA_OK && fill == window_size) || (result == LZMA_STREAM_END && fill > 0)) {
+      if (handle_window(window, fill, context) != 0)
+        result = -1;
+      fill = 0;
+    }
+  }
+  lzma_end(&stream);
+  return result == LZMA_STREAM_END ? LZMA_OK : result;
+#else
+  msg(log_error, "LZMA support is not compiled in.\n");
+  return -1;
+#endif
+}
+
+
 const transform_funs_t compress_funs_list[] = {
   {&compress_none, &compress_max_size_none, "None", 0},
   {&compress_lzo, &compress_max_size_lzo, "LZO", LZO_E_OK},
   {&compress_bz2, &compress_max_size_bz2, "BZ2", BZ_OK},
-  {&compress_lz4, &compress_max_size_lz4, "LZ4", 0},
+  {&compress_lz4, &compress_max_size_lz4, "LZ4", 0, -1, &compress_lz4_dict},
   {&compress_lzma, &compress_max_size_lzma, "LZMA", LZMA_OK}
 };
 
@@ -269,65 +598,55 @@ static const transform_funs_t decompress_funs_list[] = {
   {&decompress_none, &decompress_suggested_size_none, "None", 0, -1},
   {&decompress_lzo, &decompress_suggested_size_lzo, "LZO", LZO_E_OK, LZO_E_OUTPUT_OVERRUN},
   {&decompress_bz2, &decompress_suggested_size_bz2, "BZ2", BZ_OK, BZ_OUTBUFF_FULL},
-  {&decompress_lz4, &decompress_suggested_size_lz4, "LZ4", 0, -1},
+  {&decompress_lz4, &decompress_suggested_size_lz4, "LZ4", 0, -1, &decompress_lz4_dict},
   {&decompress_lzma, &decompress_suggested_size_lzma, "LZMA", LZMA_OK, LZMA_BUF_ERROR}
 };
 
-int compress(nf_block_t* block, compression_t compression) {
-  // Expected the block to have data
-  if (block->data == NULL) {
-    msg(log_error, "Block has no data\n");
-    return -1;
-  }
-
-  // Expected decompressed block
-  if (block->compression != compressed_none) {
-    msg(log_error, "Block is already compressed\n");
-    return -1;
-  }
-
-  if (compression < compressed_none || compression >= compressed_term) {
-    msg(log_error, "Unknown compression method: %d\n", compression);
-    return -1;
-  }
-
-  if (compression == compressed_none) {
-    // Nothing to be done
-    return 0;
-  }
+// Codecs that can decompress into fixed-size windows. LZO and LZ4 blocks
+// are single raw blocks without a streaming format.
+static const stream_fun_p decompress_stream_list[] = {
+  NULL,
+  NULL,
+  &decompress_stream_bz2,
+  NULL,
+  &decompress_stream_lzma
+};
 
-  if (block->header.id == CATALOG_BLOCK) {
-    // Catalog blocks should not be compressed
-    return 0;
-  }
-  size_t size = block->header.size;
+static int _compress_buffer(const compression_t compression, const char* source, const size_t size,
+                            const char* dictionary, const size_t dictionary_size,
+                            char** target, size_t* target_size) {
   size_t buffer_size = compress_funs_list[compression].size(size);
   char* buffer = (char*)malloc(buffer_size);
   if (buffer == NULL) {
     msg(log_error, "Failed to allocate compression memory\n");
     goto failure;
   }
-  int result = compress_funs_list[compression].transform(
-      block->data,
-      size,
-      buffer,
-      &buffer_size);
+  int result = dictionary != NULL && compress_funs_list[compression].dict_transform != NULL
+      ? compress_funs_list[compression].dict_transform(
+          source,
+          size,
+          buffer,
+          &buffer_size,
+          dictionary,
+          dictionary_size)
+      : compress_funs_list[compression].transform(
+          source,
+          size,
+          buffer,
+          &buffer_size);
   if (result != compress_funs_list[compression].ok_result) {
     msg(log_error, "%s compression error: %d\n", compress_funs_list[compression].name, result);
     goto failure;
   }
   // Shrink buffer to compressed size
-  buffer = (char*)realloc(buffer, buffer_size);
+  char* new_buffer = (char*)realloc(buffer, buffer_size > 0 ? buffer_size : 1);
   // .. shouldn't really fail, but just in case
-  if (buffer == NULL) {
+  if (new_buffer == NULL) {
     msg(log_error, "Failed to shrink compression buffer\n");
     goto failure;
   }
-  free(block->data);
-  block->header.size = buffer_size;
-  block->compressed_size = buffer_size;
-  block->compression = compression;
-  block->data = buffer;
+  *target = new_buffer;
+  *target_size = buffer_size;
   return 0;
 failure:
   free(buffer);
@@ -335,54 +654,178 @@ failure:
 }
 
 
-int decompress(nf_block_t* block) {
+static int _decompress_buffer(const compression_t compression, const char* source, const size_t size,
+                              const char* dictionary, const size_t dictionary_size,
+                              char** target, size_t* target_size);
+
+
+int compress(nf_block_t* block, compression_t compression) {
   // Expected the block to have data
   if (block->data == NULL) {
     msg(log_error, "Block has no data\n");
     return -1;
   }
 
-  compression_t compression = block->compression;
+  if (compression < compressed_none || compression >= compressed_term) {
+    msg(log_error, "Unknown compression method: %d\n", compression);
+    return -1;
+  }
+
+  if (block->compression == compression) {
+    // Passed through as is
+    return 0;
+  }
+
+  // Expected decompressed block
+  if (block->compression != compressed_none) {
+    msg(log_error, "Block is already compressed\n");
+    return -1;
+  }
+
   if (compression == compressed_none) {
-    // The block is already decompressed
+    // Nothing to be done
     return 0;
   }
 
-  size_t size = block->header.size;
-  size_t buffer_size = decompress_funs_list[compression].size(size);
+  if (!block_is_data(block)) {
+    // Catalog and dictionary blocks should not be compressed
+    return 0;
+  }
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  #pragma omp atomic
+  ++_compressing;
+  int result = _compress_buffer(compression, block->data, block->header.size,
+                                block->dictionary, block->dictionary_size, &buffer, &buffer_size);
+  #pragma omp atomic
+  --_compressing;
+  if (result != 0)
+    return -1;
+  free(block->data);
+  block->header.size = buffer_size;
+  block->compressed_size = buffer_size;
+  block->compression = compression;
+  block->data = buffer;
+  return 0;
+}
+
+
+int compress_buffer(const compression_t compression, const char* source, const size_t size,
+                    char** target, size_t* target_size) {
+  return _compress_buffer(compression, source, size, NULL, 0, target, target_size);
+}
+
+
+int decompress_buffer(const compression_t compression, const char* source, const size_t size,
+                      char** target, size_t* target_size) {
+  return _decompress_buffer(compression, source, size, NULL, 0, target, target_size);
+}
+
+
+static int _decompress_buffer(const compression_t compression, const char* source, const size_t size,
+                              const char* dictionary, const size_t dictionary_size,
+                              char** target, size_t* target_size) {
+  dict_transform_fun_p dict_transform = dictionary != NULL ? decompress_funs_list[compression].dict_transform : NULL;
+  // Dictionary matches make the data expand further than usual. The limit
+  // bounds the growth on corrupt data; BZ2 and LZMA blocks beyond it can
+  // still be walked record by record in windows. A block header can't
+  // hold more than 32 bits of size.
+  size_t max_size = (decompress_stream_list[compression] != NULL ? MAX_STREAM_RATIO : MAX_RATIO)
+      * (size + (dict_transform != NULL ? dictionary_size : 0));
+  if (max_size > UINT32_MAX)
+    max_size = UINT32_MAX;
+  size_t buffer_size = min(decompress_funs_list[compression].size(size), max_size);
   char* buffer = (char*)malloc(buffer_size);
   if (buffer == NULL) {
     msg(log_error, "Failed to allocate decompression buffer\n");
     return -1;
   }
   int result = 0;
-  while ((result = decompress_funs_list[compression].transform(
-      block->data,
-      size,
-      buffer,
-      &buffer_size)) != decompress_funs_list[compression].ok_result) {
-    if (result == decompress_funs_list[compression].buffer_error
-        && buffer_size < 64 * size) {
+  while ((result = dict_transform != NULL
+      ? dict_transform(source, size, buffer, &buffer_size, dictionary, dictionary_size)
+      : decompress_funs_list[compression].transform(
+          source,
+          size,
+          buffer,
+          &buffer_size)) != decompress_funs_list[compression].ok_result) {
+    if (result == decompress_funs_list[compression].buffer_error && buffer_size < max_size) {
       // Double size of decompression buffer if it was too small
-      buffer_size *= 2;
-      char* new_buffer = (char*)realloc(buffer, buffer_size);
+      size_t new_size = min(2 * buffer_size, max_size);
+      char* new_buffer = (char*)realloc(buffer, new_size);
       if (new_buffer == NULL) {
         msg(log_error, "Failed to grow decompression buffer\n");
         goto failure;
       }
+      budget_grow(new_size - buffer_size);
       buffer = new_buffer;
+      buffer_size = new_size;
+    }
+    else if (result == decompress_funs_list[compression].buffer_error) {
+      msg(log_error, "%s block decompresses to more than %zu bytes\n", decompress_funs_list[compression].name, max_size);
+      goto failure;
     }
     else {
       msg(log_error, "%s decompression error: %d\n", decompress_funs_list[compression].name, result);
       goto failure;
     }
   }
+  *target = buffer;
+  *target_size = buffer_size;
+  return 0;
+failure:
+  free(buffer);
+  return -1;
+}
+
+
+static int _to_native(nf_block_t* block) {
+  // Converts the records of a block that was read from a file of the other
+  // byte order, once decompressed
+  if (block->foreign != 1 || !block_is_data(block))
+    return 0;
+  int partial = block_swap_records(block, 1);
+  if (partial < 0)
+    return -1;
+  if (partial > 0)
+    msg(log_info, "Left %d records partly in foreign byte order\n", partial);
+  block->foreign = partial > 0 ? 2 : 0;
+  return 0;
+}
+
+
+int decompress(nf_block_t* block) {
+  // Expected the block to have data
+  if (block->data == NULL) {
+    msg(log_error, "Block has no data\n");
+    return -1;
+  }
+
+  if (block->header.id == COLUMNAR_BLOCK) {
+    if (block->foreign) {
+      msg(log_error, "Columnar blocks in foreign byte order are not supported\n");
+      return -1;
+    }
+    return columnar_decode(block);
+  }
+
+  compression_t compression = block->compression;
+  if (compression == compressed_none) {
+    // The block is already decompressed
+    return _to_native(block);
+  }
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  if (_decompress_buffer(compression, block->data, block->header.size,
+                         block->dictionary, block->dictionary_size, &buffer, &buffer_size) != 0)
+    return -1;
   // Shrink buffer to decompressed size
-  buffer = (char*)realloc(buffer, buffer_size);
+  char* new_buffer = (char*)realloc(buffer, buffer_size);
   // .. shouldn't really fail, but just in case
-  if (buffer == NULL) {
+  if (new_buffer == NULL) {
     msg(log_error, "Failed to shrink decompression buffer\n");
-    goto failure;
+    free(buffer);
+    return -1;
   }
   // Free the original compressed data and update the block with
   // the new decompressed data
@@ -390,45 +833,296 @@ int decompress(nf_block_t* block) {
   block->header.size = buffer_size;
   block->uncompressed_size = buffer_size;
   block->compression = compressed_none;
-  block->data = buffer;
+  block->data = new_buffer;
+  return _to_native(block);
+}
+
+
+// Records of a block that is decompressed window by window
+typedef struct {
+  record_handler_p handle_record;
+  void* context;
+  int foreign;
+  record_maps_t maps;  // seen so far, for the extensions of foreign flows
+  char* record;  // put together from windows, or swapped
+  size_t fill;
+  int result;  // of the handler
+} _record_walk_t;
+
+static int _decompress_windowed(const nf_block_t* block, char* window, const size_t window_size,
+                                window_handler_p handle_window, void* context);
+static int _walk_window(const char* window, const size_t size, void* context);
+
+
+int decompress_windowed(const nf_block_t* block, char* window, const size_t window_size,
+                        window_handler_p handle_window, void* context) {
+  if (block->foreign) {
+    // Records can straddle windows
+    msg(log_error, "Windowed decompression of blocks in foreign byte order is not supported\n");
+    return -1;
+  }
+  return _decompress_windowed(block, window, window_size, handle_window, context);
+}
+
+
+int decompress_for_each_record(const nf_block_t* block, record_handler_p handle_record, void* context) {
+  // Records of blocks left partly converted have their headers in native order
+  const int foreign = block->foreign == 1;
+  if (block->compression == compressed_none && !foreign && block->header.id != COLUMNAR_BLOCK)
+    return block_for_each_record((nf_block_p)block, handle_record, context);
+  _record_walk_t walk = { handle_record, context, foreign, { 0 }, NULL, 0, 0 };
+  char* window = (char*)malloc(DEFAULT_WINDOW_SIZE);
+  walk.record = (char*)malloc(UINT16_MAX + 1);
+  if (window == NULL || walk.record == NULL) {
+    msg(log_error, "Failed to allocate decompression window\n");
+    free(window);
+    free(walk.record);
+    return -1;
+  }
+  int result = _decompress_windowed(block, window, DEFAULT_WINDOW_SIZE, &_walk_window, &walk);
+  if (result == 0 && walk.fill > 0) {
+    msg(log_error, "Invalid record at the end of block\n");
+    result = -1;
+  }
+  free(window);
+  free(walk.record);
+  return walk.result != 0 ? walk.result : result;
+}
+
+
+static uint16_t _record_size(const char* record, const int foreign) {
+  uint16_t size;
+  memcpy(&size, record + offsetof(record_header_t, size), sizeof(size));
+  return foreign ? __builtin_bswap16(size) : size;
+}
+
+
+static int _hand_out(_record_walk_t* walk, const char* record, const size_t size) {
+  if (walk->foreign) {
+    if (record != walk->record)
+      memcpy(walk->record, record, size);
+    if (record_swap((record_header_t*)walk->record, size, 1, &walk->maps) < 0)
+      return -1;
+    record = walk->record;
+  }
+  walk->result = walk->handle_record((const record_header_t*)record, walk->context);
+  return walk->result;
+}
+
+
+static int _walk_window(const char* window, const size_t size, void* context) {
+  // Hands out the records in the window, and puts together those that
+  // straddle windows
+  _record_walk_t* walk = (_record_walk_t*)context;
+  size_t offset = 0;
+  while (offset < size) {
+    if (walk->fill == 0 && size - offset >= sizeof(record_header_t)) {
+      uint16_t record_size = _record_size(window + offset, walk->foreign);
+      if (record_size < sizeof(record_header_t)) {
+        msg(log_error, "Invalid record size: %u\n", record_size);
+        return -1;
+      }
+      if (size - offset >= record_size) {
+        if (_hand_out(walk, window + offset, record_size) != 0)
+          return -1;
+        offset += record_size;
+        continue;
+      }
+    }
+    // First the header, then the rest of the record
+    if (walk->fill < sizeof(record_header_t)) {
+      size_t part = min(sizeof(record_header_t) - walk->fill, size - offset);
+      memcpy(walk->record + walk->fill, window + offset, part);
+      walk->fill += part;
+      offset += part;
+      if (walk->fill < sizeof(record_header_t))
+        continue;
+    }
+    uint16_t record_size = _record_size(walk->record, walk->foreign);
+    if (record_size < sizeof(record_header_t)) {
+      msg(log_error, "Invalid record size: %u\n", record_size);
+      return -1;
+    }
+    size_t part = min(record_size - walk->fill, size - offset);
+    memcpy(walk->record + walk->fill, window + offset, part);
+    walk->fill += part;
+    offset += part;
+    if (walk->fill == record_size) {
+      walk->fill = 0;
+      if (_hand_out(walk, walk->record, record_size) != 0)
+        return -1;
+    }
+  }
   return 0;
-failure:
+}
+
+
+static int _decompress_windowed(const nf_block_t* block, char* window, const size_t window_size,
+                                window_handler_p handle_window, void* context) {
+  if (block->data == NULL) {
+    msg(log_error, "Block has no data\n");
+    return -1;
+  }
+
+  if (block->header.id == COLUMNAR_BLOCK) {
+    if (block->foreign) {
+      msg(log_error, "Columnar blocks in foreign byte order are not supported\n");
+      return -1;
+    }
+    // Records are only complete once all columns are decoded
+    char* rows = NULL;
+    size_t rows_size = 0;
+    if (columnar_rows(block, &rows, &rows_size) != 0)
+      return -1;
+    int result = 0;
+    for (size_t offset = 0; offset < rows_size && result == 0; offset += window_size) {
+      size_t size = min(window_size, rows_size - offset);
+      memcpy(window, rows + offset, size);
+      result = handle_window(window, size, context);
+    }
+    free(rows);
+    return result == 0 ? 0 : -1;
+  }
+
+  compression_t compression = block->compression;
+  if (compression == compressed_none) {
+    // Hand out the data as is
+    for (size_t offset = 0; offset < block->header.size; offset += window_size) {
+      if (handle_window(block->data + offset, min(window_size, block->header.size - offset), context) != 0)
+        return -1;
+    }
+    return 0;
+  }
+
+  if (decompress_stream_list[compression] != NULL) {
+    int result = decompress_stream_list[compression](
+        block->data, block->header.size, window, window_size, handle_window, context);
+    if (result != decompress_funs_list[compression].ok_result) {
+      msg(log_error, "%s decompression error: %d\n", decompress_funs_list[compression].name, result);
+      return -1;
+    }
+    return 0;
+  }
+
+  // No streaming decoder: decompress whole and hand that out
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  if (_decompress_buffer(compression, block->data, block->header.size,
+                         block->dictionary, block->dictionary_size, &buffer, &buffer_size) != 0)
+    return -1;
+  int result = 0;
+  for (size_t offset = 0; offset < buffer_size && result == 0; offset += window_size) {
+    size_t size = min(window_size, buffer_size - offset);
+    memcpy(window, buffer + offset, size);
+    result = handle_window(window, size, context);
+  }
   free(buffer);
-  return -1;
+  return result == 0 ? 0 : -1;
+}
 
+int compress_matches(const nf_block_t* block, const compression_t compression, const int preset) {
+  if (block->compression != compression)
+    return 0;
+  switch (compression) {
+    case compressed_bz2:
+      // The stream header "BZh1" .. "BZh9" holds the block size, which is the level
+      if (preset < 0)
+        return 1;
+      // Columns are separate streams, so don't bother
+      if (block->header.id == COLUMNAR_BLOCK)
+        return 0;
+      return block->data != NULL && block->header.size >= 4
+          && memcmp(block->data, "BZh", 3) == 0 && block->data[3] == '0' + preset;
+    case compressed_lzma:
+      // The preset isn't recorded in the xz stream
+      return preset < 0;
+    default:
+      return 1;
+  }
 }
 
+
 void decompressor(const int blocknum, nf_block_t* block)
 {
   msg(log_debug, "Decompressing block: %d\n", blocknum);
+  // Reserve the codec's estimate of the output up front
+  size_t needed = block->data != NULL && block_is_data(block)
+      ? decompress_funs_list[block->compression].size(block->header.size) : 0;
+  size_t acquired = budget_acquire(needed);
   int result = decompress(block);
+  if (result == 0 && block_is_data(block))
+    result = block_validate(block);
+  budget_settle(&block->reserved, acquired, block->data != NULL ? block->header.size : 0);
   block->status = result;
 }
 
 
+static size_t _encoder_memory(const compression_t compression, const size_t source_len)
+{
+  // Most memory the encoder takes, with as many threads as it may start
+  uint64_t memory = 0;
+  switch (compression) {
+    case compressed_bz2:
+      // For the block sorting, per stream being compressed
+      memory = (uint64_t)_mt_threads(source_len) * (400000 + 8 * 100000 * bz2_preset);
+      break;
+#ifdef HAVE_LIBLZMA
+    case compressed_lzma:
+#ifdef HAVE_LZMA_STREAM_ENCODER_MT
+      if (_mt_threads(source_len) > 1) {
+        lzma_mt options = _lzma_mt_options(source_len, _mt_threads(source_len));
+        memory = lzma_stream_encoder_mt_memusage(&options);
+        break;
+      }
+#endif
+      memory = lzma_easy_encoder_memusage(lzma_preset);
+      break;
+#endif
+    default:
+      break;
+  }
+  return memory != UINT64_MAX ? memory : 0;
+}
+
+
+static int _compress_budgeted(nf_block_t* block, const compression_t compression)
+{
+  // Reserve the worst case output of the codec, and the memory of the
+  // encoder, up front
+  size_t needed = block->data != NULL && block_is_data(block)
+      && block->compression == compressed_none && compression != compressed_none
+      ? compress_funs_list[compression].size(block->header.size)
+        + _encoder_memory(compression, block->header.size) : 0;
+  size_t acquired = budget_acquire(needed);
+  int result = compress(block, compression);
+  budget_settle(&block->reserved, acquired, block->data != NULL ? block->header.size : 0);
+  return result;
+}
+
+
 void lzo_compressor(const int blocknum, nf_block_t* block)
 {
   msg(log_debug, "LZO compressing block: %d\n", blocknum);
-  block->status = compress(block, compressed_lzo);
+  block->status = _compress_budgeted(block, compressed_lzo);
 }
 
 
 void bz2_compressor(const int blocknum, nf_block_t* block)
 {
   msg(log_debug, "BZ2 compressing block: %d\n", blocknum);
-  block->status = compress(block, compressed_bz2);
+  block->status = _compress_budgeted(block, compressed_bz2);
 }
 
 
 void lz4_compressor(const int blocknum, nf_block_t* block)
 {
   msg(log_debug, "LZ4 compressing block: %d\n", blocknum);
-  block->status = compress(block, compressed_lz4);
+  block->status = _compress_budgeted(block, compressed_lz4);
 }
 
 
 void lzma_compressor(const int blocknum, nf_block_t* block)
 {
   msg(log_debug, "LZMA compressing block: %d\n", blocknum);
-  block->status = compress(block, compressed_lzma);
+  block->status = _compress_budgeted(block, compressed_lzma);
 }
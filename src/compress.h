@@ -32,13 +32,44 @@ static const uint32_t compression_flags[] = {
 
 #define DEFAULT_BZ2_PRESET 9
 #define DEFAULT_LZMA_PRESET 6
+// Blocks from this size up are compressed by multiple threads (BZ2 and LZMA).
+// Kept above nfdump's 5MB block buffer, so nfcapd blocks remain single stream.
+#define DEFAULT_MT_THRESHOLD (8 * 1024 * 1024)
 
 extern int bz2_preset;
 extern int lzma_preset;
+extern size_t mt_threshold;
+
+// Output window size for streaming decompression
+#define DEFAULT_WINDOW_SIZE (1024 * 1024)
 
 int compress(nf_block_t* block, compression_t compression);
 int decompress(nf_block_t* block);
 
+// (De)compress a buffer on its own, into a newly allocated target
+int compress_buffer(const compression_t compression, const char* source, const size_t size,
+                    char** target, size_t* target_size);
+int decompress_buffer(const compression_t compression, const char* source, const size_t size,
+                      char** target, size_t* target_size);
+
+// Whether the block is already compressed with compression at level preset.
+// A negative preset matches any level.
+int compress_matches(const nf_block_t* block, const compression_t compression, const int preset);
+
+// Handles one window of decompressed data. Returning non-zero aborts.
+typedef int (*window_handler_p) (const char* window, const size_t size, void* context);
+
+// Decompress block data in pieces of at most window_size bytes, passing them
+// on in order to handle_window. The block itself is left untouched. Memory
+// use is bounded by the window for BZ2 and LZMA; LZO and LZ4 blocks have no
+// streaming format and are decompressed whole first.
+int decompress_windowed(const nf_block_t* block, char* window, const size_t window_size,
+                        window_handler_p handle_window, void* context);
+// Walk the records of a data block, decompressing it window by window when
+// it's compressed, and converting records of the other byte order. Stops
+// when the handler returns non-zero and returns that.
+int decompress_for_each_record(const nf_block_t* block, record_handler_p handle_record, void* context);
+
 extern void decompressor(const int blocknum, nf_block_t* block);
 
 extern void lzo_compressor(const int blocknum, nf_block_t* block);
@@ -47,13 +78,16 @@ extern void lz4_compressor(const int blocknum, nf_block_t* block);
 extern void lzma_compressor(const int blocknum, nf_block_t* block);
 
 typedef int (*transform_fun_p) (const char*, const size_t, char*, size_t*);
+typedef int (*dict_transform_fun_p) (const char*, const size_t, char*, size_t*, const char*, const size_t);
 typedef size_t (*size_fun_p) (const size_t);
+typedef int (*stream_fun_p) (const char*, const size_t, char*, const size_t, window_handler_p, void*);
 typedef struct {
   transform_fun_p transform;
   size_fun_p size;
   const char* name;
   const int ok_result;
   const int buffer_error;
+  dict_transform_fun_p dict_transform;  // NULL when the codec takes no dictionary
 } transform_funs_t;
 extern const transform_funs_t compress_funs_list[];
 
@@ -0,0 +1,105 @@
+/**
+ * \file dictionary.c
+ * \brief Per file compression dictionary functions
+ *
+ * The dictionary is stored once per file in a DICTIONARY_BLOCK in front of
+ * the data blocks. Codecs that support it (LZ4) prime each block with it,
+ * so every block stays decodable on its own given the dictionary.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "dictionary.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+static void _set_dictionary(nf_file_p file, const nf_block_p dictionary);
+
+
+int dictionary_build(nf_file_p *file, const size_t size) {
+  nf_file_p fl = *file;
+  dictionary_remove(fl);
+
+  int data_blocks = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    if (block->compression != compressed_none) {
+      msg(log_error, "Dictionary needs decompressed blocks\n");
+      return -1;
+    }
+    ++data_blocks;
+  }
+  if (data_blocks == 0)
+    return 0;
+
+  nf_block_p dictionary = block_new();
+  if (dictionary == NULL || (dictionary->data = (char*)malloc(size)) == NULL) {
+    msg(log_error, "Failed to allocate dictionary\n");
+    block_free(&dictionary);
+    return -1;
+  }
+
+  // Take equal slices from the start of evenly spaced data blocks
+  int samples = min(data_blocks, DICTIONARY_SAMPLES);
+  size_t sample_size = size / samples;
+  size_t dictionary_size = 0;
+  int sample = 0;
+  int data_block = 0;
+  for (int i = 0; i < fl->header.NumBlocks && sample < samples; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    if (data_block++ != sample * data_blocks / samples)
+      continue;
+    size_t len = min(sample_size, block->header.size);
+    memcpy(dictionary->data + dictionary_size, block->data, len);
+    dictionary_size += len;
+    ++sample;
+  }
+
+  dictionary->header.id = DICTIONARY_BLOCK;
+  dictionary->header.size = dictionary_size;
+  dictionary->compressed_size = dictionary_size;
+  dictionary->uncompressed_size = dictionary_size;
+  if (file_insert_block(file, 0, dictionary) != 0) {
+    block_free(&dictionary);
+    return -1;
+  }
+  msg(log_debug, "Built dictionary of %lu bytes from %d blocks\n", dictionary_size, samples);
+  _set_dictionary(*file, dictionary);
+  return 0;
+}
+
+
+void dictionary_remove(nf_file_p file) {
+  int index = file_find_block(file, DICTIONARY_BLOCK);
+  if (index < 0)
+    return;
+  nf_block_p dictionary = file_remove_block(file, index);
+  _set_dictionary(file, NULL);
+  block_free(&dictionary);
+}
+
+
+static void _set_dictionary(nf_file_p file, const nf_block_p dictionary) {
+  for (int i = 0; i < file->header.NumBlocks; ++i) {
+    nf_block_p block = file->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    block->dictionary = dictionary != NULL ? dictionary->data : NULL;
+    block->dictionary_size = dictionary != NULL ? dictionary->header.size : 0;
+  }
+}
@@ -0,0 +1,36 @@
+/**
+ * \file dictionary.h
+ * \brief Per file compression dictionary functions
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _DICTIONARY_H
+#define _DICTIONARY_H
+
+#include "file.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// LZ4 only looks back 64k, so a larger dictionary wouldn't help
+#define DEFAULT_DICTIONARY_SIZE (64 * 1024)
+// Number of data blocks the dictionary is sampled from
+#define DICTIONARY_SAMPLES 16
+
+extern int dictionary_build(nf_file_p *file, const size_t size);
+extern void dictionary_remove(nf_file_p file);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
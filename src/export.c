@@ -0,0 +1,209 @@
+/**
+ * \file export.c
+ * \brief Export of selected flow fields as CSV or fixed width binary
+ *
+ * Flow records of a data block are decoded one by one and the selected
+ * fields are written into a single output buffer per block, so blocks can
+ * be exported in parallel and written out in order. Compressed blocks are
+ * decompressed a window at a time on the way.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "utils.h"
+#include "record.h"
+#include "compress.h"
+#include "export.h"
+
+// Smallest flow record: header, IPv4 addresses and 32 bit counters
+#define MIN_FLOW_SIZE (offsetof(common_record_t, data) + 4 * sizeof(uint32_t))
+// Longest CSV field (an IPv6 address) including separator
+#define MAX_FIELD_TEXT 48
+
+static const char* _names[field_count] = {
+  "ts", "te", "srcip", "dstip", "srcport", "dstport",
+  "proto", "flags", "tos", "packets", "bytes", "exporter"
+};
+
+// Bytes of the fields in binary output
+static const size_t _sizes[field_count] = {
+  8, 8, 16, 16, 2, 2, 1, 1, 1, 8, 8, 2
+};
+
+typedef struct {
+  const export_t* export;
+  char* buffer;
+  size_t size;
+  size_t capacity;
+  size_t row_size;  // at most
+} _output_t;
+
+static int _export_record(const record_header_t* record, void* context);
+
+
+int export_parse_fields(const char* text, export_t* export) {
+  // Comma separated field names. Returns -1 on an unknown name.
+  export->count = 0;
+  while (*text != '\0') {
+    size_t len = strcspn(text, ",");
+    int field = -1;
+    for (int i = 0; i < field_count; ++i) {
+      if (strlen(_names[i]) == len && strncmp(text, _names[i], len) == 0)
+        field = i;
+    }
+    if (field < 0 || export->count >= MAX_FIELDS) {
+      msg(log_error, "Unexpected field: %.*s\n", (int)len, text);
+      return -1;
+    }
+    export->fields[export->count++] = (field_t)field;
+    text += len;
+    if (*text == ',')
+      ++text;
+  }
+  return export->count > 0 ? 0 : -1;
+}
+
+
+int export_header(const export_t* export, char* text, const size_t size) {
+  // CSV header line with the field names
+  size_t len = 0;
+  for (int i = 0; i < export->count; ++i) {
+    const char* name = _names[export->fields[i]];
+    if (len + strlen(name) + 2 > size)
+      return -1;
+    strcpy(text + len, name);
+    len += strlen(name);
+    text[len++] = i + 1 < export->count ? ',' : '\n';
+  }
+  text[len] = '\0';
+  return 0;
+}
+
+
+size_t export_record_size(const export_t* export) {
+  size_t size = 0;
+  for (int i = 0; i < export->count; ++i)
+    size += _sizes[export->fields[i]];
+  return size;
+}
+
+
+int export_block(const export_t* export, const nf_block_p block, char** buffer, size_t* size) {
+  // Exports the flows of a data block into a newly allocated buffer. The
+  // buffer fits the flows of a decompressed block, and grows for those of
+  // a compressed one.
+  size_t rows = block->header.size / MIN_FLOW_SIZE + 1;
+  size_t row_size = export->format == export_binary
+      ? export_record_size(export) : export->count * MAX_FIELD_TEXT;
+  _output_t output = { export, (char*)malloc(rows * row_size), 0, rows * row_size, row_size };
+  if (output.buffer == NULL) {
+    msg(log_error, "Failed to allocate export buffer\n");
+    return -1;
+  }
+  if (decompress_for_each_record(block, &_export_record, &output) != 0) {
+    free(output.buffer);
+    return -1;
+  }
+  *buffer = output.buffer;
+  *size = output.size;
+  return 0;
+}
+
+
+static size_t _put_uint(char* text, uint64_t value) {
+  char digits[20];
+  size_t len = 0;
+  do {
+    digits[len++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  for (size_t i = 0; i < len; ++i)
+    text[i] = digits[len - 1 - i];
+  return len;
+}
+
+
+static void _put_le(char* data, const uint64_t value, const size_t size) {
+  for (size_t i = 0; i < size; ++i)
+    data[i] = (char)(value >> (8 * i));
+}
+
+
+static void _put_address(char* data, const uint64_t addr[2]) {
+  // Network order, as for in6_addr
+  for (int i = 0; i < 8; ++i) {
+    data[i] = (char)(addr[0] >> (56 - 8 * i));
+    data[i + 8] = (char)(addr[1] >> (56 - 8 * i));
+  }
+}
+
+
+static uint64_t _value(const nf_flow_t* flow, const field_t field) {
+  switch (field) {
+    case field_first: return flow->first;
+    case field_last: return flow->last;
+    case field_srcport: return flow->srcport;
+    case field_dstport: return flow->dstport;
+    case field_protocol: return flow->protocol;
+    case field_tcp_flags: return flow->tcp_flags;
+    case field_tos: return flow->tos;
+    case field_packets: return flow->packets;
+    case field_bytes: return flow->bytes;
+    case field_exporter: return flow->exporter;
+    default: return 0;
+  }
+}
+
+
+static int _export_record(const record_header_t* record, void* context) {
+  _output_t* output = (_output_t*)context;
+  const export_t* export = output->export;
+  nf_flow_t flow;
+  if (record_decode(record, &flow) != 0)
+    return 0;
+  if (output->size + output->row_size > output->capacity) {
+    size_t capacity = 2 * output->capacity;
+    char* buffer = (char*)realloc(output->buffer, capacity);
+    if (buffer == NULL) {
+      msg(log_error, "Failed to grow export buffer\n");
+      return -1;
+    }
+    output->buffer = buffer;
+    output->capacity = capacity;
+  }
+  char* data = output->buffer + output->size;
+  for (int i = 0; i < export->count; ++i) {
+    field_t field = export->fields[i];
+    const uint64_t* addr = field == field_srcaddr ? flow.srcaddr
+        : field == field_dstaddr ? flow.dstaddr : NULL;
+    if (export->format == export_binary) {
+      if (addr != NULL)
+        _put_address(data, addr);
+      else
+        _put_le(data, _value(&flow, field), _sizes[field]);
+      data += _sizes[field];
+    }
+    else {
+      if (addr != NULL) {
+        record_format_address(addr, data, MAX_FIELD_TEXT);
+        data += strlen(data);
+      }
+      else
+        data += _put_uint(data, _value(&flow, field));
+      *data++ = i + 1 < export->count ? ',' : '\n';
+    }
+  }
+  output->size = data - output->buffer;
+  return 0;
+}
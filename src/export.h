@@ -0,0 +1,62 @@
+/**
+ * \file export.h
+ * \brief Export of selected flow fields as CSV or fixed width binary
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _EXPORT_H
+#define _EXPORT_H
+
+#include "block.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  field_first,      // ts: msec since the epoch
+  field_last,       // te: msec since the epoch
+  field_srcaddr,
+  field_dstaddr,
+  field_srcport,
+  field_dstport,
+  field_protocol,
+  field_tcp_flags,
+  field_tos,
+  field_packets,
+  field_bytes,
+  field_exporter,
+  field_count       // terminator: leave as last element
+} field_t;
+
+typedef enum {
+  export_csv,
+  export_binary     // little endian, addresses as 16 bytes IPv6 (mapped for IPv4)
+} export_format_t;
+
+#define MAX_FIELDS 32
+
+typedef struct {
+  int count;
+  field_t fields[MAX_FIELDS];
+  export_format_t format;
+} export_t;
+
+extern int export_parse_fields(const char* text, export_t* export);
+extern int export_header(const export_t* export, char* text, const size_t size);
+extern size_t export_record_size(const export_t* export);
+extern int export_block(const export_t* export, const nf_block_p block, char** buffer, size_t* size);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -12,19 +12,77 @@
  * terms of the BSD license. See the LICENSE file for details.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "config.h"
 #include "utils.h"
 #include "compress.h"
 #include "file.h"
+#include "budget.h"
+#include "affinity.h"
+
+#define WRITE_BATCH (4 * 1024 * 1024)
+#define DROP_BATCH (16 * 1024 * 1024)
+#define WRITE_VECTORS 64
+#define STREAM_BLOCKS_PER_THREAD 2
+
+#ifndef HAVE_POSIX_FADVISE
+#define POSIX_FADV_SEQUENTIAL 0
+#define POSIX_FADV_WILLNEED 0
+#define POSIX_FADV_DONTNEED 0
+#endif
+
+// Collects pieces of the file to write them with few system calls
+typedef struct {
+  int fd;
+  struct iovec vectors[WRITE_VECTORS];
+  int count;
+  size_t bytes;
+} _writer_t;
 
 // Private functions
-static int _read_block(FILE *f, nf_block_t* block);
-static int _write_block(FILE *f, nf_block_t* block);
+static FILE* _open(const char* filename);
+static void _close(FILE* f);
+static nf_file_p _read_file_header(FILE *f);
+static compression_t _file_compression(const nf_file_p file);
+static int _add_block(nf_file_p *file, const int index, nf_block_p block,
+                      const compression_t file_compression, nf_block_p *dictionary);
+static int _read_block_header(FILE *f, nf_block_t* block, const int foreign);
+static int _read_data(FILE *f, const off_t offset, char* data, const size_t size);
+static int _read_block_data(FILE *f, const off_t offset, nf_block_t* block);
+static int _read_block(FILE *f, nf_block_t* block, const int foreign);
+static int _write(_writer_t* writer, const void* data, const size_t size);
+static int _write_flush(_writer_t* writer);
+static int _write_block(_writer_t* writer, nf_block_t* block);
+static int _write_file(_writer_t* writer, const nf_file_p file, block_handler_p handle_block);
+static void _set_compression(nf_file_p file);
+static size_t _file_size(const nf_file_p file);
+static int _save(nf_file_p file, const char* filename, block_handler_p handle_block);
+static int _open_temporary(const char* filename, char** temporary);
+static void _sync_directory(const char* filename);
+static void _advise(FILE* f, const off_t offset, const off_t size, const int advice);
 static int _blocks_status(const nf_file_p file);
-static void _handle_free_block(int blocknum, nf_block_p block);
+static void _swap_file_header(nf_file_p file);
+static void _remove_foreign_metadata(nf_file_p file);
+static void _throttle(const size_t bytes);
+
+int file_drop_cache = 0;
+size_t file_max_rate = 0;
 
 nf_file_p file_new()
 {
@@ -33,103 +91,246 @@ nf_file_p file_new()
 
 
 nf_file_p file_load(const char* filename, block_handler_p handle_block) {
-  nf_file_p fl = file_new();
-  if (fl == NULL) {
-    msg(log_error, "Failed to allocate file buffer\n");
-    return NULL;
+  msg(log_info, "Reading %s\n", filename);
+
+  nf_file_p fl = NULL;
+  FILE *f = _open(filename);
+  if (!f) {
+    msg(log_error, "Failed to open: %s\n", filename);
+    goto failure;
+  }
+
+  _advise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
+  fl = _read_file_header(f);
+  if (fl == NULL)
+    goto failure;
+  fl->name = strdup(filename);
+
+  compression_t file_compression = _file_compression(fl);
+  msg(log_info, "File compression: %d  flags: %u\n", file_compression, fl->header.flags);
+
+  // Counted rather than asked for, as pipes don't tell
+  long position = sizeof(fl->header) + sizeof(fl->stats);
+  long dropped = 0;
+  int blocks_read = 0;
+  nf_block_p dictionary = NULL;
+  #pragma omp parallel
+  #pragma omp master
+  for (;;) {
+    nf_block_p block = block_new();
+    if (block == NULL) {
+      msg(log_error, "Failed to allocate block buffer\n");
+      break;
+    }
+    if (_read_block(f, block, fl->foreign) != 0) {
+      free(block);
+      break;
+    }
+    int block_idx = blocks_read;
+    if (_add_block(&fl, block_idx, block, file_compression, &dictionary) != 0) {
+      block_free(&block);
+      break;
+    }
+    ++blocks_read;
+    position += sizeof(block->header) + block->header.size;
+    // What is read already is in the blocks
+    if (file_drop_cache && position - dropped >= DROP_BATCH) {
+      _advise(f, dropped, position - dropped, POSIX_FADV_DONTNEED);
+      dropped = position;
+    }
+    if (handle_block != NULL) {
+      #pragma omp task firstprivate(block_idx, block)
+      handle_block(block_idx, block);
+    }
+  }
+
+  if (blocks_read < fl->header.NumBlocks) {
+    msg(log_error, "Missing blocks in file. found %d, expected %d\n", blocks_read, fl->header.NumBlocks);
+    goto failure;
+  }
+
+  if (_blocks_status(fl) < 0) {
+    msg(log_error, "One or more blocks failed to load properly\n");
+    goto failure;
   }
+  _remove_foreign_metadata(fl);
+
+  fl->size = position;
+  if (file_drop_cache)
+    _advise(f, dropped, 0, POSIX_FADV_DONTNEED);
+
+  _close(f);
+  return fl;
+failure:
+  if (f)
+    _close(f);
+  file_free(&fl);
+  return NULL;
+}
+
 
+int file_stream(const char* filename, block_handler_p handle_block,
+                stream_handler_p emit_block, void* context) {
+  // Blocks are read and handled in batches and then emitted in order. The
+  // data of data blocks goes after, other blocks (dictionary, zone map, ..)
+  // are kept for the blocks that follow them.
   msg(log_info, "Reading %s\n", filename);
 
-  FILE *f = fopen(filename, "rb");
+  int result = -1;
+  nf_file_p fl = NULL;
+  FILE *f = _open(filename);
   if (!f) {
     msg(log_error, "Failed to open: %s\n", filename);
     goto failure;
   }
 
-  size_t bytes_read = fread(&fl->header, 1, sizeof(fl->header), f);
-  if (bytes_read != sizeof(fl->header)) {
-    msg(log_error, "Failed to read file header\n");
+  _advise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
+  fl = _read_file_header(f);
+  if (fl == NULL)
     goto failure;
+  fl->name = strdup(filename);
+
+  compression_t file_compression = _file_compression(fl);
+  msg(log_info, "File compression: %d  flags: %u\n", file_compression, fl->header.flags);
+
+#ifdef _OPENMP
+  const int batch = STREAM_BLOCKS_PER_THREAD * omp_get_max_threads();
+#else
+  const int batch = STREAM_BLOCKS_PER_THREAD;
+#endif
+  long position = sizeof(fl->header) + sizeof(fl->stats);
+  int blocks_read = 0;
+  int done = 0;
+  nf_block_p dictionary = NULL;
+  while (!done) {
+    int first = blocks_read;
+    #pragma omp parallel
+    #pragma omp master
+    while (blocks_read - first < batch) {
+      nf_block_p block = block_new();
+      if (block == NULL) {
+        msg(log_error, "Failed to allocate block buffer\n");
+        done = -1;
+        break;
+      }
+      if (_read_block(f, block, fl->foreign) != 0) {
+        free(block);
+        done = 1;
+        break;
+      }
+      int block_idx = blocks_read;
+      if (_add_block(&fl, block_idx, block, file_compression, &dictionary) != 0) {
+        block_free(&block);
+        done = -1;
+        break;
+      }
+      ++blocks_read;
+      position += sizeof(block->header) + block->header.size;
+      if (handle_block != NULL) {
+        #pragma omp task firstprivate(block_idx, block)
+        handle_block(block_idx, block);
+      }
+    }
+    if (done < 0)
+      goto failure;
+
+    for (int i = first; i < blocks_read; ++i) {
+      nf_block_p block = fl->blocks[i];
+      if (block->status != 0) {
+        msg(log_error, "Failed to load block %d\n", i);
+        goto failure;
+      }
+      if (emit_block(fl, i, block, context) != 0)
+        goto failure;
+      if (block_is_data(block)) {
+        free(block->data);
+        block->data = NULL;
+        budget_release(&block->reserved);
+      }
+    }
+    if (file_drop_cache)
+      _advise(f, 0, position, POSIX_FADV_DONTNEED);
   }
-  msg(log_debug, "Read file header\n");
 
-  bytes_read = fread(&fl->stats, 1, sizeof(fl->stats), f);
-  if (bytes_read != sizeof(fl->stats)) {
-    msg(log_error, "Failed to read file stats\n");
+  if (blocks_read < fl->header.NumBlocks) {
+    msg(log_error, "Missing blocks in file. found %d, expected %d\n", blocks_read, fl->header.NumBlocks);
     goto failure;
   }
+  result = 0;
+failure:
+  if (f)
+    _close(f);
+  file_free(&fl);
+  return result;
+}
 
-  msg(log_debug, "Read file stats\n");
 
-  size_t blocks_size = fl->header.NumBlocks * sizeof(nf_block_p);
-  nf_file_p new_fl = (nf_file_p)realloc(fl, sizeof(nf_file_t) + blocks_size);
-  if (new_fl == NULL) {
-    msg(log_error, "Failed to re-allocate file buffer\n");
+nf_file_p file_scan(const char* filename) {
+  msg(log_debug, "Scanning %s\n", filename);
+
+  nf_file_p fl = NULL;
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    msg(log_error, "Failed to open: %s\n", filename);
     goto failure;
   }
-  fl = new_fl;
-  memset(&fl->blocks, 0, blocks_size);
 
-  compression_t file_compression =
-      fl->header.flags & FLAG_LZO_COMPRESSED ? compressed_lzo :
-      fl->header.flags & FLAG_BZ2_COMPRESSED ? compressed_bz2 :
-      fl->header.flags & FLAG_LZ4_COMPRESSED ? compressed_lz4 :
-      fl->header.flags & FLAG_LZMA_COMPRESSED ? compressed_lzma :
-        compressed_none;
-  msg(log_info, "File compression: %d  flags: %u\n", file_compression, fl->header.flags);
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0) {
+    msg(log_error, "Failed to stat: %s\n", filename);
+    goto failure;
+  }
+
+  fl = _read_file_header(f);
+  if (fl == NULL)
+    goto failure;
+  fl->name = strdup(filename);
 
+  compression_t file_compression = _file_compression(fl);
   int blocks_read = 0;
-  #pragma omp parallel
-  #pragma omp master
+  nf_block_p dictionary = NULL;
   for (;;) {
     nf_block_p block = block_new();
     if (block == NULL) {
       msg(log_error, "Failed to allocate block buffer\n");
       break;
     }
-    if (_read_block(f, block) != 0) {
+    if (_read_block_header(f, block, fl->foreign) != 0) {
       free(block);
       break;
     }
-    int block_idx = blocks_read++;
-    if (blocks_read > fl->header.NumBlocks) {
-      blocks_size = blocks_read * sizeof(nf_block_p);
-      new_fl = (nf_file_p)realloc(fl, sizeof(nf_file_t) + blocks_size);
-      if (new_fl == NULL) {
-        msg(log_error, "Failed to re-allocate file buffer\n");
+    // Skip over the data, but do notice a truncated block. Other blocks
+    // (dictionary, zone maps, ..) are small and read as well.
+    if (!block_is_data(block)) {
+      if (_read_block_data(f, -1, block) != 0) {
+        free(block);
         break;
       }
-      fl = new_fl;
-      msg(log_info, "Fixed block count in header. found %d, header %d\n", blocks_read, fl->header.NumBlocks);
-      fl->header.NumBlocks = blocks_read;
     }
-    fl->blocks[block_idx] = block;
-    // Catalog blocks are not compressed
-    block->compression = block->header.id == CATALOG_BLOCK ? compressed_none : file_compression;
-    block->file_compression = block->compression;
-    size_t size = block->header.size;
-    block->compressed_size = size;
-    block->uncompressed_size = size;
-    if (handle_block != NULL) {
-      #pragma omp task firstprivate(block_idx, block)
-      handle_block(block_idx, block);
+    else if (ftell(f) + block->header.size > st.st_size
+        || fseek(f, block->header.size, SEEK_CUR) != 0) {
+      msg(log_error, "Failed to read block data\n");
+      free(block);
+      break;
+    }
+    if (_add_block(&fl, blocks_read, block, file_compression, &dictionary) != 0) {
+      block_free(&block);
+      break;
     }
+    ++blocks_read;
   }
 
   if (blocks_read < fl->header.NumBlocks) {
     msg(log_error, "Missing blocks in file. found %d, expected %d\n", blocks_read, fl->header.NumBlocks);
     goto failure;
   }
-
-  if (_blocks_status(fl) < 0) {
-    msg(log_error, "One or more blocks failed to load properly\n");
-    goto failure;
-  }
+  _remove_foreign_metadata(fl);
 
   fl->size = ftell(f);
 
-  fclose(f);
+  // Blocks are read from it while the scan is used, also when the file is
+  // replaced in the meantime
+  fl->scanned = f;
   return fl;
 failure:
   if (f)
@@ -144,12 +345,45 @@ void file_free(nf_file_p *file) {
     return;
   nf_file_p fl = *file;
   *file = NULL;
-  file_for_each_block(fl, &_handle_free_block);
+  // Blocks of a truncated file were never read
+  for (int i = 0; i < fl->header.NumBlocks; ++i)
+    block_free(&fl->blocks[i]);
+  if (fl->scanned != NULL)
+    fclose(fl->scanned);
+  free(fl->name);
   free(fl);
 }
 
 
+int file_read_block(const nf_file_p file, nf_block_p block) {
+  // Reads the data of a block found by file_scan, from the file the scan
+  // kept open. Threads can read blocks of the same scan at the same time.
+  if (block->data != NULL)
+    return 0;
+  if (file->scanned == NULL) {
+    msg(log_error, "File wasn't scanned: %s\n", file->name);
+    return -1;
+  }
+  return _read_block_data(file->scanned, block->offset + sizeof(block->header), block);
+}
+
+
+void file_prefetch(const char* filename) {
+  // Starts reading the file in the background, for when it's next
+  if (strcmp(filename, "-") == 0)
+    return;
+  FILE *f = fopen(filename, "rb");
+  if (!f)
+    return;
+  _advise(f, 0, 0, POSIX_FADV_WILLNEED);
+  fclose(f);
+}
+
+
 int file_for_each_block(const nf_file_p file, block_handler_p handle_block) {
+  int nodes = affinity_nodes();
+  if (nodes > 1 && file_for_each_block_on_nodes(file, handle_block, nodes) == 0)
+    return _blocks_status(file);
   #pragma omp parallel for
   for (int i = 0; i < file->header.NumBlocks; ++i) {
     handle_block(i, file->blocks[i]);
@@ -158,6 +392,66 @@ int file_for_each_block(const nf_file_p file, block_handler_p handle_block) {
 }
 
 
+int file_for_each_block_on_nodes(const nf_file_p file, block_handler_p handle_block, const int nodes) {
+  // Blocks are handled on the node that holds their data, by threads bound
+  // to that node. Their output is then first touched there as well. Threads
+  // that run out of blocks of their node help out on the others. After, the
+  // threads are unbound again.
+  int count = file->header.NumBlocks;
+  int* owner = (int*)malloc((count + 1) * sizeof(int));
+  int* order = (int*)malloc((count + 1) * sizeof(int));
+  int* first = (int*)calloc(nodes + 1, sizeof(int));
+  int* next = (int*)calloc(nodes, sizeof(int));
+  if (owner == NULL || order == NULL || first == NULL || next == NULL) {
+    free(owner);
+    free(order);
+    free(first);
+    free(next);
+    return -1;
+  }
+  for (int i = 0; i < count; ++i) {
+    owner[i] = affinity_node_of(file->blocks[i]->data);
+    if (owner[i] < 0 || owner[i] >= nodes)
+      owner[i] = i % nodes;
+    ++first[owner[i] + 1];
+  }
+  for (int node = 0; node < nodes; ++node)
+    first[node + 1] += first[node];
+  for (int i = 0; i < count; ++i)
+    order[first[owner[i]] + next[owner[i]]++] = i;
+  for (int node = 0; node < nodes; ++node)
+    next[node] = 0;
+
+  #pragma omp parallel
+  {
+#ifdef _OPENMP
+    int node = omp_get_thread_num() % nodes;
+#else
+    int node = 0;
+#endif
+    affinity_p placement = affinity_bind(node);
+    for (int n = 0; n < nodes; ++n) {
+      int group = (node + n) % nodes;
+      for (;;) {
+        int k;
+        #pragma omp atomic capture
+        k = next[group]++;
+        if (first[group] + k >= first[group + 1])
+          break;
+        int i = order[first[group] + k];
+        handle_block(i, file->blocks[i]);
+      }
+    }
+    affinity_restore(&placement);
+  }
+  free(owner);
+  free(order);
+  free(first);
+  free(next);
+  return 0;
+}
+
+
 static int _blocks_status(const nf_file_p file) {
   int result = 0;
   for (int i = 0; i < file->header.NumBlocks; ++i) {
@@ -169,84 +463,485 @@ static int _blocks_status(const nf_file_p file) {
 }
 
 
+int file_find_block(const nf_file_p file, const uint16_t id) {
+  for (int i = 0; i < file->header.NumBlocks; ++i) {
+    if (file->blocks[i]->header.id == id)
+      return i;
+  }
+  return -1;
+}
+
+
+int file_insert_block(nf_file_p *file, const int index, nf_block_p block) {
+  nf_file_p fl = *file;
+  size_t blocks_size = (fl->header.NumBlocks + 1) * sizeof(nf_block_p);
+  nf_file_p new_fl = (nf_file_p)realloc(fl, sizeof(nf_file_t) + blocks_size);
+  if (new_fl == NULL) {
+    msg(log_error, "Failed to re-allocate file buffer\n");
+    return -1;
+  }
+  fl = new_fl;
+  memmove(&fl->blocks[index + 1], &fl->blocks[index], (fl->header.NumBlocks - index) * sizeof(nf_block_p));
+  fl->blocks[index] = block;
+  fl->header.NumBlocks++;
+  *file = fl;
+  return 0;
+}
+
+
+nf_block_p file_remove_block(nf_file_p file, const int index) {
+  nf_block_p block = file->blocks[index];
+  file->header.NumBlocks--;
+  memmove(&file->blocks[index], &file->blocks[index + 1], (file->header.NumBlocks - index) * sizeof(nf_block_p));
+  return block;
+}
+
+
+// Data of a re-blocked block grows from this size up to the block size
+#define REBLOCK_MIN_CAPACITY (64 * 1024)
+
+typedef struct {
+  nf_block_p *blocks;
+  int count;
+  int allocated;  // of blocks
+  nf_block_p current;
+  size_t capacity;
+  size_t block_size;
+  uint16_t id;
+  int last_was_map;
+} _reblock_t;
+
+
+static int _reblock_record(const record_header_t* record, void* context) {
+  _reblock_t* rb = (_reblock_t*)context;
+  nf_block_p block = rb->current;
+  // Start a new block when this one is full, but keep extension maps
+  // together with the record following them, as long as a block header
+  // can hold the size
+  if (block == NULL || block->header.id != rb->id
+      || (size_t)block->header.size + record->size > UINT32_MAX
+      || (block->header.size + record->size > rb->block_size && block->header.NumRecords > 0
+          && !rb->last_was_map)) {
+    // Block headers can't be trusted to tell how many records there are
+    if (rb->count == rb->allocated) {
+      int allocated = 2 * rb->allocated + 16;
+      nf_block_p* blocks = (nf_block_p*)realloc(rb->blocks, allocated * sizeof(nf_block_p));
+      if (blocks == NULL) {
+        msg(log_error, "Failed to allocate block list\n");
+        return -1;
+      }
+      rb->blocks = blocks;
+      rb->allocated = allocated;
+    }
+    block = block_new();
+    if (block == NULL) {
+      msg(log_error, "Failed to allocate block buffer\n");
+      return -1;
+    }
+    rb->blocks[rb->count++] = block;
+    rb->current = block;
+    rb->capacity = 0;
+    block->header.id = rb->id;
+  }
+  if (block->header.size + record->size > rb->capacity) {
+    size_t capacity = rb->capacity > 0 ? 2 * rb->capacity
+        : rb->block_size < REBLOCK_MIN_CAPACITY ? rb->block_size : REBLOCK_MIN_CAPACITY;
+    while (block->header.size + record->size > capacity)
+      capacity *= 2;
+    char* data = (char*)realloc(block->data, capacity);
+    if (data == NULL) {
+      msg(log_error, "Failed to allocate block data\n");
+      return -1;
+    }
+    block->data = data;
+    rb->capacity = capacity;
+  }
+  memcpy(block->data + block->header.size, record, record->size);
+  block->header.size += record->size;
+  block->header.NumRecords++;
+  rb->last_was_map = record->type == ExtensionMapType;
+  return 0;
+}
+
+
+int file_reblock(nf_file_p *file, const size_t block_size) {
+  nf_file_p fl = *file;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    if (block->compression != compressed_none) {
+      msg(log_error, "Re-blocking needs decompressed blocks\n");
+      return -1;
+    }
+    // New blocks would pass partly converted records off as native
+    if (block->foreign) {
+      msg(log_error, "Re-blocking needs records in native byte order\n");
+      return -1;
+    }
+  }
+
+  _reblock_t rb = {NULL, 0, 0, NULL, 0, block_size, 0, 0};
+  int result = 0;
+  for (int i = 0; i < fl->header.NumBlocks && result == 0; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    rb.id = block->header.id;
+    result = block_for_each_record(block, &_reblock_record, &rb);
+  }
+  if (result != 0)
+    goto failure;
+
+  int other_blocks = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    if (!block_is_data(fl->blocks[i]))
+      ++other_blocks;
+  }
+  if (other_blocks + rb.count > fl->header.NumBlocks) {
+    size_t blocks_size = (other_blocks + rb.count) * sizeof(nf_block_p);
+    nf_file_p new_fl = (nf_file_p)realloc(fl, sizeof(nf_file_t) + blocks_size);
+    if (new_fl == NULL) {
+      msg(log_error, "Failed to re-allocate file buffer\n");
+      goto failure;
+    }
+    fl = new_fl;
+    *file = fl;
+  }
+  msg(log_info, "Re-blocked %d data blocks into %d\n", fl->header.NumBlocks - other_blocks, rb.count);
+
+  // Other blocks go in front, followed by the new data blocks
+  other_blocks = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (block_is_data(block))
+      block_free(&block);
+    else
+      fl->blocks[other_blocks++] = block;
+  }
+  for (int i = 0; i < rb.count; ++i) {
+    nf_block_p block = rb.blocks[i];
+    // Shrink to size. Failing to do so isn't a problem.
+    char* data = (char*)realloc(block->data, block->header.size);
+    if (data != NULL)
+      block->data = data;
+    block->compressed_size = block->header.size;
+    block->uncompressed_size = block->header.size;
+    block->file_compression = compressed_none;
+    fl->blocks[other_blocks + i] = block;
+  }
+  fl->header.NumBlocks = other_blocks + rb.count;
+  free(rb.blocks);
+  return 0;
+failure:
+  for (int i = 0; i < rb.count; ++i)
+    block_free(&rb.blocks[i]);
+  free(rb.blocks);
+  return -1;
+}
+
+
 int file_save(const nf_file_p file) {
+  if (file->name == NULL) {
+    msg(log_error, "File has no name to save to\n");
+    return -1;
+  }
+  return file_save_as(file, file->name);
 }
 
 
 int file_save_as(nf_file_p file, const char* filename) {
+  return _save(file, filename, NULL);
+}
+
+
+int file_save_handled(nf_file_p file, block_handler_p handle_block) {
+  if (file->name == NULL) {
+    msg(log_error, "File has no name to save to\n");
+    return -1;
+  }
+  return _save(file, file->name, handle_block);
+}
+
+
+static int _save(nf_file_p file, const char* filename, block_handler_p handle_block) {
+  // Written to a temporary file next to the target, which then replaces it.
+  // The original stays intact when anything fails on the way.
   msg(log_info, "Writing %s\n", filename);
 
   if (file->header.NumBlocks == 0) {
-    msg(log_error, "Not saving empty file");
+    msg(log_error, "Not saving empty file\n");
     return -1;
   }
 
-  compression_t file_compression = file->blocks[0]->compression;
+  if (strcmp(filename, "-") == 0) {
+    // Standard output, likely a pipe: nothing to replace or sync, and the
+    // header can't be written after the blocks
+    if (handle_block != NULL && file_for_each_block(file, handle_block) != 0)
+      return -1;
+    _writer_t out = { STDOUT_FILENO };
+    if (_write_file(&out, file, NULL) != 0) {
+      msg(log_error, "Failed to write to standard output\n");
+      return -1;
+    }
+    file->size = _file_size(file);
+    return 0;
+  }
+
+  // Replace what a symbolic link points to, not the link
+  char* target = realpath(filename, NULL);
+  if (target == NULL)
+    target = strdup(filename);
+  char* temporary = NULL;
+  _writer_t writer = { -1 };
+  if (target == NULL || (writer.fd = _open_temporary(target, &temporary)) < 0)
+    goto failure;
+  // Blocks that are still to be handled are expected to get smaller, so
+  // their size now is what the file gets at most
+  size_t size = _file_size(file);
+#ifdef HAVE_FALLOCATE
+  // Have the file system lay out the file in one go. Not all can.
+  if (fallocate(writer.fd, 0, 0, size) != 0)
+    msg(log_debug, "Failed to preallocate %zu bytes: %s\n", size, strerror(errno));
+#endif
+
+  if (_write_file(&writer, file, handle_block) != 0) {
+    msg(log_error, "Failed to write: %s\n", temporary);
+    goto failure;
+  }
+  if (handle_block != NULL) {
+    size = _file_size(file);
+    if (ftruncate(writer.fd, size) != 0) {
+      msg(log_error, "Failed to truncate: %s\n", temporary);
+      goto failure;
+    }
+  }
+  if (fdatasync(writer.fd) != 0) {
+    msg(log_error, "Failed to sync: %s\n", temporary);
+    goto failure;
+  }
+#ifdef HAVE_POSIX_FADVISE
+  // Clean after the sync, so the pages can go
+  if (file_drop_cache)
+    posix_fadvise(writer.fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  int fd = writer.fd;
+  writer.fd = -1;
+  if (close(fd) != 0) {
+    msg(log_error, "Failed to close: %s\n", temporary);
+    goto failure;
+  }
+  if (rename(temporary, target) != 0) {
+    msg(log_error, "Failed to replace: %s\n", target);
+    goto failure;
+  }
+  _sync_directory(target);
+
+  char* name = strdup(filename);
+  free(file->name);
+  file->name = name;
+  file->size = size;
+  free(temporary);
+  free(target);
+  return 0;
+failure:
+  if (writer.fd >= 0)
+    close(writer.fd);
+  if (temporary != NULL)
+    unlink(temporary);
+  free(temporary);
+  free(target);
+  return -1;
+}
+
+
+static void _set_compression(nf_file_p file) {
+  compression_t file_compression = compressed_none;
+  for (int i = 0; i < file->header.NumBlocks; ++i) {
+    if (block_is_data(file->blocks[i])) {
+      file_compression = file->blocks[i]->compression;
+      break;
+    }
+  }
   // Switch of all compression flags
   for (compression_t cmpr = compressed_none; cmpr < compressed_term; ++cmpr) {
     file->header.flags &= ~compression_flags[cmpr];
   }
-  // ... and then select the compression method of the first block as compression type
+  // ... and then select the compression method of the first data block as compression type
   file->header.flags |= compression_flags[file_compression];
   msg(log_info, "File compression: %d  flags: %u\n", file_compression, file->header.flags);
+}
 
-  FILE *f = fopen(filename, "wb");
-  if (!f) {
-    msg(log_error, "Failed to open: %s\n", filename);
-    goto failure;
+
+static size_t _file_size(const nf_file_p file) {
+  size_t size = sizeof(file->header) + sizeof(file->stats);
+  for (int i = 0; i < file->header.NumBlocks; ++i)
+    size += sizeof(file->blocks[i]->header) + file->blocks[i]->header.size;
+  return size;
+}
+
+
+static FILE* _open(const char* filename) {
+  // "-" is standard input, which may well be a pipe
+  if (strcmp(filename, "-") == 0)
+    return stdin;
+  return fopen(filename, "rb");
+}
+
+
+static void _close(FILE* f) {
+  if (f != stdin)
+    fclose(f);
+}
+
+
+static nf_file_p _read_file_header(FILE *f) {
+  nf_file_p fl = file_new();
+  if (fl == NULL) {
+    msg(log_error, "Failed to allocate file buffer\n");
+    return NULL;
   }
-  size_t bytes_written = fwrite(&file->header, 1, sizeof(file->header), f);
-  if (bytes_written != sizeof(file->header)) {
-    msg(log_error, "Failed to write file header\n");
+
+  size_t bytes_read = fread(&fl->header, 1, sizeof(fl->header), f);
+  if (bytes_read != sizeof(fl->header)) {
+    msg(log_error, "Failed to read file header\n");
     goto failure;
   }
-  msg(log_debug, "Written file header\n");
+  msg(log_debug, "Read file header\n");
 
-  bytes_written = fwrite(&file->stats, 1, sizeof(file->stats), f);
-  if (bytes_written != sizeof(file->stats)) {
-    msg(log_error, "Failed to write file stats\n");
+  bytes_read = fread(&fl->stats, 1, sizeof(fl->stats), f);
+  if (bytes_read != sizeof(fl->stats)) {
+    msg(log_error, "Failed to read file stats\n");
     goto failure;
   }
 
-  msg(log_debug, "Written file stats\n");
+  msg(log_debug, "Read file stats\n");
 
-  for (int i = 0; i < file->header.NumBlocks; ++i) {
-    int result = _write_block(f, file->blocks[i]);
-    if (result != 0)
-      goto failure;
+  if (fl->header.magic == __builtin_bswap16(MAGIC)) {
+    msg(log_info, "File is in foreign byte order\n");
+    _swap_file_header(fl);
+    fl->foreign = 1;
+  }
+  else if (fl->header.magic != MAGIC) {
+    msg(log_error, "Not an nfdump file, magic: %04x\n", fl->header.magic);
+    goto failure;
   }
 
-  free(file->name);
-  file->name = strdup(filename);
+  size_t blocks_size = fl->header.NumBlocks * sizeof(nf_block_p);
+  nf_file_p new_fl = (nf_file_p)realloc(fl, sizeof(nf_file_t) + blocks_size);
+  if (new_fl == NULL) {
+    msg(log_error, "Failed to re-allocate file buffer\n");
+    goto failure;
+  }
+  fl = new_fl;
+  memset(&fl->blocks, 0, blocks_size);
+  return fl;
+failure:
+  free(fl);
+  return NULL;
+}
 
-  fclose(f);
+
+static compression_t _file_compression(const nf_file_p file) {
+  return
+      file->header.flags & FLAG_LZO_COMPRESSED ? compressed_lzo :
+      file->header.flags & FLAG_BZ2_COMPRESSED ? compressed_bz2 :
+      file->header.flags & FLAG_LZ4_COMPRESSED ? compressed_lz4 :
+      file->header.flags & FLAG_LZMA_COMPRESSED ? compressed_lzma :
+        compressed_none;
+}
+
+
+static int _add_block(nf_file_p *file, const int index, nf_block_p block,
+                      const compression_t file_compression, nf_block_p *dictionary) {
+  nf_file_p fl = *file;
+  if (index >= fl->header.NumBlocks) {
+    size_t blocks_size = (index + 1) * sizeof(nf_block_p);
+    nf_file_p new_fl = (nf_file_p)realloc(fl, sizeof(nf_file_t) + blocks_size);
+    if (new_fl == NULL) {
+      msg(log_error, "Failed to re-allocate file buffer\n");
+      return -1;
+    }
+    fl = new_fl;
+    *file = fl;
+    msg(log_info, "Fixed block count in header. found %d, header %d\n", index + 1, fl->header.NumBlocks);
+    fl->header.NumBlocks = index + 1;
+    fl->repaired = 1;
+  }
+  fl->blocks[index] = block;
+  block->foreign = fl->foreign && block_is_data(block);
+  // Catalog and dictionary blocks are not compressed
+  block->compression = block_is_data(block) ? file_compression : compressed_none;
+  if (block->header.id == DICTIONARY_BLOCK) {
+    *dictionary = block;
+  }
+  else if (*dictionary != NULL && block_is_data(block)) {
+    block->dictionary = (*dictionary)->data;
+    block->dictionary_size = (*dictionary)->header.size;
+  }
+  block->file_compression = block->compression;
+  size_t size = block->header.size;
+  block->compressed_size = size;
+  block->uncompressed_size = size;
   return 0;
-failure:
-  return -1;
 }
 
 
-static int _read_block(FILE *f, nf_block_t* block) {
+static int _read_block_header(FILE *f, nf_block_t* block, const int foreign) {
+  block->offset = ftell(f);
   size_t bytes_read = fread(&block->header, 1, sizeof(block->header), f);
   if (bytes_read != sizeof(block->header)) {
     // Only whine when not immediately at end of file.
     if (bytes_read != 0)
       msg(log_error, "Failed to read block header\n");
-    goto failure;
+    block->status = -1;
+    return -1;
   }
+  if (foreign) {
+    block->header.NumRecords = __builtin_bswap32(block->header.NumRecords);
+    block->header.size = __builtin_bswap32(block->header.size);
+    block->header.id = __builtin_bswap16(block->header.id);
+    block->header.flags = __builtin_bswap16(block->header.flags);
+  }
+  return 0;
+}
+
+
+static int _read_data(FILE *f, const off_t offset, char* data, const size_t size) {
+  // At the current position, or at the offset when not negative, with
+  // pread, which leaves the position alone for other threads
+  if (offset < 0)
+    return fread(data, 1, size, f) == size ? 0 : -1;
+  size_t done = 0;
+  while (done < size) {
+    ssize_t bytes = pread(fileno(f), data + done, size - done, offset + done);
+    if (bytes < 0 && errno == EINTR)
+      continue;
+    if (bytes <= 0)
+      return -1;
+    done += bytes;
+  }
+  return 0;
+}
+
+
+static int _read_block_data(FILE *f, const off_t offset, nf_block_t* block) {
+  size_t acquired = budget_acquire(block->header.size);
   block->data = (char*)malloc(block->header.size);
   if (block->data == NULL) {
     msg(log_error, "Failed to allocate block data\n");
     goto failure;
   }
-  bytes_read = fread(block->data, 1, block->header.size, f);
-  if (bytes_read != block->header.size) {
+  if (_read_data(f, offset, block->data, block->header.size) != 0) {
     msg(log_error, "Failed to read block data\n");
     goto failure;
   }
+  _throttle(block->header.size);
+  budget_settle(&block->reserved, acquired, block->header.size);
   block->status = 0;
   return 0;
 failure:
+  budget_settle(&block->reserved, acquired, 0);
   free(block->data);
   block->data = NULL;
   block->header.size = 0;
@@ -255,18 +950,69 @@ failure:
 }
 
 
-static int _write_block(FILE *f, nf_block_t* block) {
+static int _read_block(FILE *f, nf_block_t* block, const int foreign) {
+  if (_read_block_header(f, block, foreign) != 0)
+    return -1;
+  return _read_block_data(f, -1, block);
+}
+
+
+static int _write(_writer_t* writer, const void* data, const size_t size) {
+  if (size == 0)
+    return 0;
+  if (writer->count == WRITE_VECTORS && _write_flush(writer) != 0)
+    return -1;
+  writer->vectors[writer->count].iov_base = (void*)data;
+  writer->vectors[writer->count].iov_len = size;
+  ++writer->count;
+  writer->bytes += size;
+  return writer->bytes >= WRITE_BATCH ? _write_flush(writer) : 0;
+}
+
+
+static int _write_flush(_writer_t* writer) {
+  const size_t bytes = writer->bytes;
+  struct iovec* vector = writer->vectors;
+  int count = writer->count;
+  while (count > 0) {
+    ssize_t written = writev(writer->fd, vector, count < IOV_MAX ? count : IOV_MAX);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    // Skip what was written, which may end halfway a vector
+    while (count > 0 && (size_t)written >= vector->iov_len) {
+      written -= vector->iov_len;
+      ++vector;
+      --count;
+    }
+    if (count > 0) {
+      vector->iov_base = (char*)vector->iov_base + written;
+      vector->iov_len -= written;
+    }
+  }
+  writer->count = 0;
+  writer->bytes = 0;
+  _throttle(bytes);
+  return 0;
+}
+
+
+static int _write_block(_writer_t* writer, nf_block_t* block) {
   if (block->status != 0) {
     msg(log_error, "Invalid block\n");
     goto failure;
   }
-  size_t bytes_written = fwrite(&block->header, 1, sizeof(block->header), f);
-  if (bytes_written != sizeof(block->header)) {
+  if (block->foreign) {
+    // Files are written in native byte order only
+    msg(log_error, "Block is not (fully) converted to native byte order\n");
+    goto failure;
+  }
+  if (_write(writer, &block->header, sizeof(block->header)) != 0) {
     msg(log_error, "Failed to write block header\n");
     goto failure;
   }
-  bytes_written = fwrite(block->data, 1, block->header.size, f);
-  if (bytes_written != block->header.size) {
+  if (_write(writer, block->data, block->header.size) != 0) {
     msg(log_error, "Failed to write block data\n");
     goto failure;
   }
@@ -276,7 +1022,157 @@ failure:
 }
 
 
-static void _handle_free_block(int blocknum, nf_block_p block) {
-  block_free(&block);
+static int _write_file(_writer_t* writer, const nf_file_p file, block_handler_p handle_block) {
+  // With a handler, blocks are written in order as soon as they and those
+  // before them are handled. The compression in the file header is only
+  // known then, so the header is written again after.
+  if (handle_block == NULL)
+    _set_compression(file);
+  if (_write(writer, &file->header, sizeof(file->header)) != 0
+      || _write(writer, &file->stats, sizeof(file->stats)) != 0) {
+    msg(log_error, "Failed to write file header\n");
+    return -1;
+  }
+  msg(log_debug, "Written file header\n");
+
+  int result = 0;
+  #pragma omp parallel for ordered schedule(dynamic) if (handle_block != NULL)
+  for (int i = 0; i < file->header.NumBlocks; ++i) {
+    if (handle_block != NULL)
+      handle_block(i, file->blocks[i]);
+    #pragma omp ordered
+    if (result == 0 && _write_block(writer, file->blocks[i]) != 0)
+      result = -1;
+  }
+  if (result != 0 || _write_flush(writer) != 0)
+    return -1;
+  if (handle_block != NULL) {
+    _set_compression(file);
+    if (pwrite(writer->fd, &file->header, sizeof(file->header), 0) != sizeof(file->header)) {
+      msg(log_error, "Failed to write file header\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+static int _open_temporary(const char* filename, char** temporary) {
+  // Same directory, so it can be renamed over the target. Hidden, as
+  // .<name>.tmp.XXXXXX, so that one left by a crash isn't taken for an
+  // nfcapd file. Takes the mode and owner of an existing target.
+  const char* name = strrchr(filename, '/');
+  int directory_length = name != NULL ? name + 1 - filename : 0;
+  name = name != NULL ? name + 1 : filename;
+  size_t length = strlen(filename) + 13;
+  *temporary = (char*)malloc(length);
+  if (*temporary == NULL) {
+    msg(log_error, "Failed to allocate file name\n");
+    return -1;
+  }
+  snprintf(*temporary, length, "%.*s.%s.tmp.XXXXXX", directory_length, filename, name);
+  int fd = mkstemp(*temporary);
+  if (fd < 0) {
+    msg(log_error, "Failed to create: %s\n", *temporary);
+    free(*temporary);
+    *temporary = NULL;
+    return -1;
+  }
+  struct stat st;
+  mode_t mode = 0;
+  if (stat(filename, &st) == 0) {
+    mode = st.st_mode & 07777;
+    if (fchown(fd, st.st_uid, st.st_gid) != 0)
+      msg(log_debug, "Failed to keep owner of: %s\n", filename);
+  }
+  else {
+    // As fopen would have created it
+    mode = umask(0);
+    umask(mode);
+    mode = 0666 & ~mode;
+  }
+  if (fchmod(fd, mode) != 0)
+    msg(log_info, "Failed to set mode of: %s\n", *temporary);
+  return fd;
+}
+
+
+static void _sync_directory(const char* filename) {
+  // Makes the rename itself durable
+  char* copy = strdup(filename);
+  if (copy == NULL)
+    return;
+  int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  free(copy);
+}
+
+
+static void _advise(FILE* f, const off_t offset, const off_t size, const int advice) {
+#ifdef HAVE_POSIX_FADVISE
+  // Only a hint; failing is harmless
+  posix_fadvise(fileno(f), offset, size, advice);
+#endif
 }
 
+
+static void _swap_file_header(nf_file_p file) {
+  file_header_t* header = &file->header;
+  header->magic = __builtin_bswap16(header->magic);
+  header->version = __builtin_bswap16(header->version);
+  header->flags = __builtin_bswap32(header->flags);
+  header->NumBlocks = __builtin_bswap32(header->NumBlocks);
+  stat_record_t* stats = &file->stats;
+  for (uint64_t* counter = &stats->numflows; counter <= &stats->numpackets_other; ++counter)
+    *counter = __builtin_bswap64(*counter);
+  stats->first_seen = __builtin_bswap32(stats->first_seen);
+  stats->last_seen = __builtin_bswap32(stats->last_seen);
+  stats->msec_first = __builtin_bswap16(stats->msec_first);
+  stats->msec_last = __builtin_bswap16(stats->msec_last);
+  stats->sequence_failure = __builtin_bswap32(stats->sequence_failure);
+}
+
+
+static void _remove_foreign_metadata(nf_file_p file) {
+  // Zone maps, bloom filters and checksums of a file of the other byte order
+  // can't be used. nfrecompress adds them again when asked for.
+  if (!file->foreign)
+    return;
+  const uint16_t ids[] = { ZONEMAP_BLOCK, BLOOM_BLOCK, CHECKSUM_BLOCK };
+  for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+    int index = file_find_block(file, ids[i]);
+    if (index < 0)
+      continue;
+    msg(log_info, "Ignoring block in foreign byte order: %u\n", ids[i]);
+    nf_block_p block = file_remove_block(file, index);
+    block_free(&block);
+  }
+}
+
+
+static void _throttle(const size_t bytes) {
+  // Sleeps while more was read and written than file_max_rate allows, a
+  // block or write batch at a time. Of time spent on other things, at most
+  // a second is made up for with a burst.
+  if (file_max_rate == 0)
+    return;
+  static double allowed_until = 0;
+  double pause;
+  #pragma omp critical(file_throttle)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = now.tv_sec + now.tv_nsec * 1e-9;
+    if (allowed_until < seconds - 1)
+      allowed_until = seconds - 1;
+    allowed_until += (double)bytes / file_max_rate;
+    pause = allowed_until - seconds;
+  }
+  if (pause > 0) {
+    struct timespec delay = { (time_t)pause, (long)((pause - (time_t)pause) * 1e9) };
+    nanosleep(&delay, NULL);
+  }
+}
@@ -15,6 +15,8 @@
 #ifndef _FILE_H
 #define _FILE_H
 
+#include <stdio.h>
+
 #include "block.h"
 
 #ifdef __cplusplus
@@ -25,6 +27,9 @@ typedef struct {
   // Meta data
   size_t size;
   char* name;
+  int repaired;  // block count in header was corrected while reading
+  int foreign;  // file is in the other byte order; headers are converted while reading
+  FILE* scanned;  // kept open by file_scan, to read the blocks from
   // Data
   file_header_t header;
   stat_record_t stats;
@@ -32,14 +37,38 @@ typedef struct {
 } nf_file_t;
 typedef nf_file_t* nf_file_p;
 
+// Takes the blocks of a streamed file in order. Returns 0 to carry on.
+typedef int (*stream_handler_p) (const nf_file_p, const int, nf_block_p, void*);
+
+
+// Drop files from the page cache once read or written, for bulk jobs
+// that shouldn't push out the files others are reading
+extern int file_drop_cache;
+// Limit reading and writing files to this many bytes/s, when not 0
+extern size_t file_max_rate;
 
 extern nf_file_p file_new();
 extern nf_file_p file_load(const char* filename, block_handler_p handle_block);
+extern nf_file_p file_scan(const char* filename);
+extern int file_stream(const char* filename, block_handler_p handle_block,
+                       stream_handler_p emit_block, void* context);
+extern int file_read_block(const nf_file_p file, nf_block_p block);
 extern void file_free(nf_file_p *file);
+extern void file_prefetch(const char* filename);
 
 extern int file_save(const nf_file_p file);
 extern int file_save_as(nf_file_p file, const char* filename);
+// Saves as file_save does, handling (compressing, ..) the blocks on the way
+// and writing each as soon as it and those before it are done
+extern int file_save_handled(nf_file_p file, block_handler_p handle_block);
 extern int file_for_each_block(const nf_file_p file, block_handler_p handle_block);
+// As file_for_each_block does on more than one NUMA node
+extern int file_for_each_block_on_nodes(const nf_file_p file, block_handler_p handle_block, const int nodes);
+
+extern int file_find_block(const nf_file_p file, const uint16_t id);
+extern int file_insert_block(nf_file_p *file, const int index, nf_block_p block);
+extern nf_block_p file_remove_block(nf_file_p file, const int index);
+extern int file_reblock(nf_file_p *file, const size_t block_size);
 
 #ifdef __cplusplus
 }  // extern "C"
@@ -0,0 +1,71 @@
+/**
+ * \file found.c
+ * \brief nfcapd files given to the tools or found in directories
+ *
+ * Only the tools that take directories use this, so it isn't part of the
+ * library.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <libgen.h>
+
+#include "found.h"
+
+// The list being searched into, as nftw passes no context
+static __thread found_t* _searching = NULL;
+
+static int _find_file(const char* path, const struct stat* st, int type, struct FTW* ftw);
+
+int add_found(found_t* found, const char *path)
+{
+  char** new_paths = (char**)realloc(found->paths, (found->count + 1) * sizeof(char*));
+  if (new_paths == NULL)
+    return -1;
+  found->paths = new_paths;
+  found->paths[found->count] = strdup(path);
+  if (found->paths[found->count] == NULL)
+    return -1;
+  ++found->count;
+  return 0;
+}
+
+
+int find_files(found_t* found, const char *dir)
+{
+  _searching = found;
+  int result = nftw(dir, &_find_file, 16, FTW_PHYS);
+  _searching = NULL;
+  return result;
+}
+
+
+void free_found(found_t* found)
+{
+  for (int i = 0; i < found->count; ++i)
+    free(found->paths[i]);
+  free(found->paths);
+  found->paths = NULL;
+  found->count = 0;
+}
+
+
+static int _find_file(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+  char* name = basename((char*)path);
+  // Skip the file nfcapd is writing
+  if (type != FTW_F || strncmp(name, "nfcapd.", 7) != 0 || strncmp(name, "nfcapd.current", 14) == 0)
+    return 0;
+  return add_found(_searching, path);
+}
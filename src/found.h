@@ -0,0 +1,37 @@
+/**
+ * \file found.h
+ * \brief nfcapd files given to the tools or found in directories
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _FOUND_H
+#define _FOUND_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Files given or found in directories, in that order, owned by the caller
+typedef struct {
+  char** paths;
+  int count;
+} found_t;
+
+extern int add_found(found_t* found, const char *path);
+// Adds the nfcapd files in a directory tree
+extern int find_files(found_t* found, const char *dir);
+extern void free_found(found_t* found);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
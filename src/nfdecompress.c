@@ -1,20 +1,340 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <getopt.h>
 
 #include "types.h"
 #include "utils.h"
 #include "compress.h"
 #include "file.h"
+#include "zonemap.h"
+#include "export.h"
+#include "budget.h"
+
+const char usage[] =
+    "Usage: nfdecompress [-w <KiB>] [-t <from>-<to>] [-f <fields> [-F <csv|binary>]] [-m <size>] [-v|-q] <nfdump file(s)>\n"
+    "  A file named - is read from standard input, a block at a time.\n"
+    "  -w, --window : stream blocks through an output window of this size,\n"
+    "                 instead of decompressing whole blocks in memory\n"
+    "  -t, --time   : only output blocks that may hold flows seen between these\n"
+    "                 unix times, according to the zone map of the file, and of\n"
+    "                 the other blocks the extension maps, .. the flows refer to\n"
+    "  -f, --fields : output these fields of the flows instead of the raw records:\n"
+    "                 ts,te,srcip,dstip,srcport,dstport,proto,flags,tos,packets,bytes,exporter\n"
+    "                 (times in msec since the epoch)\n"
+    "  -F, --format : csv (default) or binary: fixed width little endian fields,\n"
+    "                 with addresses as 16 bytes IPv6 in network order\n"
+    "  -m, --max-memory : keep the blocks in memory within about this many bytes\n"
+    "                 (k, M, G suffixes), reading and decompressing fewer of\n"
+    "                 them at a time when needed\n"
+    "  -v, --verbose : also log debug messages\n"
+    "  -q, --quiet   : only log errors\n";
+
+static const struct option long_options[] = {
+  {"window", required_argument, NULL, 'w'},
+  {"time", required_argument, NULL, 't'},
+  {"fields", required_argument, NULL, 'f'},
+  {"format", required_argument, NULL, 'F'},
+  {"max-memory", required_argument, NULL, 'm'},
+  {"verbose", no_argument, NULL, 'v'},
+  {"quiet", no_argument, NULL, 'q'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+// Fields to export. None for the raw records.
+static export_t fields;
+
+// Output window, for decompressing blocks bit by bit
+static char* window = NULL;
+static size_t window_size = 0;
+
+// Write the raw records of a decompressed data block. Records left partly
+// in foreign byte order, with extensions that couldn't be swapped, would
+// be read wrongly.
+static int write_raw(const nf_block_p block)
+{
+  if (block->foreign) {
+    msg(log_error, "Block has records left partly in foreign byte order\n");
+    return -1;
+  }
+  return fwrite(block->data, 1, block->header.size, stdout) == block->header.size ? 0 : -1;
+}
+
+// Write the records of a decompressed data block, or the fields of the
+// flows of any data block
+static int write_block(const nf_block_p block)
+{
+  if (fields.count == 0)
+    return write_raw(block);
+  char* buffer = NULL;
+  size_t size = 0;
+  if (export_block(&fields, block, &buffer, &size) != 0)
+    return -1;
+  int result = fwrite(buffer, 1, size, stdout) == size ? 0 : -1;
+  free(buffer);
+  return result;
+}
+
+// Write only the extension maps, exporters, .. of a block left out, which
+// the flows of the blocks written may refer to. The block is decompressed
+// a window at a time, unless in foreign byte order.
+static int write_others(const nf_block_p block)
+{
+  if (fields.count > 0)
+    return 0;
+  if (block->foreign) {
+    msg(log_error, "Block has records left partly in foreign byte order\n");
+    return -1;
+  }
+  char* others = NULL;
+  size_t size = 0;
+  if (zonemap_block_others(block, &others, &size) != 0)
+    return -1;
+  int result = fwrite(others, 1, size, stdout) == size ? 0 : -1;
+  free(others);
+  return result;
+}
+
+// Export the blocks of a file in parallel, but write them in order
+static int write_blocks(const nf_file_p fl)
+{
+  int result = 0;
+  #pragma omp parallel for ordered schedule(dynamic) reduction(|:result)
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    char* buffer = NULL;
+    size_t size = 0;
+    int status = 0;
+    if (!block_is_data(block))
+      status = 1;
+    else if (block->status != 0)
+      status = -1;
+    else if (fields.count > 0)
+      status = export_block(&fields, block, &buffer, &size);
+    #pragma omp ordered
+    if (status == 0) {
+      if (fields.count == 0)
+        status = write_raw(block);
+      else
+        status = fwrite(buffer, 1, size, stdout) == size ? 0 : -1;
+    }
+    free(buffer);
+    if (status < 0)
+      result = -1;
+  }
+  return result;
+}
+
+// Read, decompress and write blocks one by one, each thread holding one
+// at a time, taking turns for the memory budget. With a predicate, only
+// the blocks selected by the zone map are read.
+static int decompress_streamed(const char* filename, const zone_predicate_t* predicate)
+{
+  nf_file_p fl = file_scan(filename);
+  if (fl == NULL)
+    return -1;
+  int* selected = (int*)malloc((fl->header.NumBlocks + 1) * sizeof(int));
+  if (selected == NULL) {
+    file_free(&fl);
+    return -1;
+  }
+  if (predicate != NULL) {
+    int count = zonemap_select(fl, predicate, selected);
+    msg(log_debug, "Selected %d blocks in: %s\n", count, filename);
+  }
+  else {
+    for (int i = 0; i < fl->header.NumBlocks; ++i)
+      selected[i] = block_is_data(fl->blocks[i]);
+  }
+  int result = 0;
+  const long turns = budget_turns();
+  #pragma omp parallel for ordered schedule(dynamic)
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    int status = 0;
+    budget_begin_turn(turns + i);
+    if (selected[i]) {
+      if (file_read_block(fl, block) != 0)
+        status = -1;
+      // Foreign blocks are converted as a whole
+      else if (selected[i] != ZONE_OTHERS || block->foreign)
+        decompressor(i, block);
+    }
+    #pragma omp ordered
+    {
+      if (selected[i] && result == 0) {
+        if (status != 0 || block->status != 0)
+          result = -1;
+        else if ((selected[i] == ZONE_OTHERS ? write_others(block) : write_block(block)) != 0)
+          result = -1;
+      }
+      free(block->data);
+      block->data = NULL;
+      budget_release(&block->reserved);
+      budget_end_turn();
+    }
+  }
+  free(selected);
+  file_free(&fl);
+  return result;
+}
+
+static int write_window(const char* window, const size_t size, void* context)
+{
+  return fwrite(window, 1, size, stdout) == size ? 0 : -1;
+}
+
+// Write the data blocks of a file as it's streamed in
+static int write_streamed(const nf_file_p fl, const int blocknum, nf_block_p block, void* context)
+{
+  if (!block_is_data(block))
+    return 0;
+  int result = window != NULL && fields.count == 0
+      ? decompress_windowed(block, window, window_size, &write_window, NULL)
+      : write_block(block);
+  if (result != 0)
+    msg(log_error, "Failed to write block %d\n", blocknum);
+  return result;
+}
 
 int main(int argc, char* argv[])
 {
-  if (argc < 2) {
-    msg(log_error, "Usage: nfdecompress <nfdump file(s)>\n");
+  zone_predicate_t predicate;
+  zonemap_predicate_init(&predicate);
+  int use_zonemap = 0;
+  size_t max_memory = 0;
+  fields.count = 0;
+  fields.format = export_csv;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hw:t:f:F:m:vq", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'w':
+        window_size = strtoul(optarg, NULL, 10) * 1024;
+        if (window_size == 0) {
+          msg(log_error, "Unexpected argument to -w: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 't': {
+        unsigned long long from, to;
+        if (sscanf(optarg, "%llu-%llu", &from, &to) != 2 || to < from) {
+          msg(log_error, "Unexpected argument to -t: %s\n", optarg);
+          return -1;
+        }
+        predicate.first = from * 1000;
+        predicate.last = to * 1000 + 999;
+        use_zonemap = 1;
+        break;
+      }
+
+      case 'f':
+        if (export_parse_fields(optarg, &fields) != 0) {
+          msg(log_error, "Unexpected argument to -f: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'F':
+        if (strcmp(optarg, "csv") == 0)
+          fields.format = export_csv;
+        else if (strcmp(optarg, "binary") == 0)
+          fields.format = export_binary;
+        else {
+          msg(log_error, "Unexpected argument to -F: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'm':
+        max_memory = parse_size(optarg);
+        if (max_memory == 0) {
+          msg(log_error, "Unexpected argument to -m: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'v':
+        log_level = log_debug;
+        break;
+
+      case 'q':
+        log_level = log_error;
+        break;
+
+      case 'h':
+        printf(usage);
+        return 0;
+
+      default:
+        printf(usage);
+        return -1;
+    }
+  }
+
+  if (optind >= argc) {
+    msg(log_error, usage);
     return -1;
   }
 
-  for (int i = 1; i < argc; ++i) {
+  budget_set(max_memory);
+
+  if (fields.count > 0 && fields.format == export_csv) {
+    char header[MAX_FIELDS * 16];
+    export_header(&fields, header, sizeof(header));
+    fputs(header, stdout);
+  }
+
+  if (window_size > 0) {
+    window = (char*)malloc(window_size);
+    if (window == NULL) {
+      msg(log_error, "Failed to allocate output window\n");
+      return -1;
+    }
+  }
+
+  for (int i = optind; i < argc; ++i) {
     char *filename = argv[i];
+    if (strcmp(filename, "-") == 0) {
+      // Can't be read twice, nor skipped through for a zone map
+      if (use_zonemap) {
+        msg(log_error, "Can't select blocks in time of standard input\n");
+        return -1;
+      }
+      if (file_stream(filename, window != NULL ? NULL : &decompressor, &write_streamed, NULL) != 0) {
+        msg(log_error, "Failed to decompress: %s\n", filename);
+        return -1;
+      }
+      continue;
+    }
+    if (use_zonemap || max_memory > 0) {
+      if (decompress_streamed(filename, use_zonemap ? &predicate : NULL) != 0) {
+        msg(log_error, "Failed to decompress: %s\n", filename);
+        return -1;
+      }
+      continue;
+    }
+    if (window != NULL) {
+      // Bounded memory: keep blocks compressed and decompress them one by one
+      nf_file_t* fl = file_load(filename, NULL);
+      if (fl == NULL) {
+        msg(log_error, "Failed to load file: %s\n", filename);
+        return -1;
+      }
+      for (int j = 0; j < fl->header.NumBlocks; ++j) {
+        if (!block_is_data(fl->blocks[j]))
+          continue;
+        // Fields are exported from windows of the default size
+        if ((fields.count > 0 ? write_block(fl->blocks[j])
+             : decompress_windowed(fl->blocks[j], window, window_size, &write_window, NULL)) != 0) {
+          msg(log_error, "Failed to decompress block %d in: %s\n", j, filename);
+          return -1;
+        }
+      }
+      file_free(&fl);
+      continue;
+    }
 #ifdef _OPENMP
     nf_file_t* fl = file_load(filename, &decompressor);
 #else
@@ -33,10 +353,15 @@ int main(int argc, char* argv[])
       return -1;
     }
 #endif
-    for (int j = 0; j < fl->header.NumBlocks; ++j) {
-      fwrite(fl->blocks[j]->data, 1, fl->blocks[j]->header.size, stdout);
+    // Only the records, not the dictionary, zone map, ..
+    if (write_blocks(fl) != 0) {
+      msg(log_error, "Failed to write records of: %s\n", filename);
+      return -1;
     }
+    file_free(&fl);
   }
+  free(window);
+  msg(log_debug, "Peak of memory budget: %zu bytes\n", budget_peak());
   msg(log_debug, "Done\n");
   return 0;
 }
@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "utils.h"
+#include "compress.h"
+#include "file.h"
+#include "found.h"
+
+#define DEFAULT_FRACTION 0.05
+#define BATCH_SIZE (256 * 1024 * 1024)
+// Two sided 95% confidence
+#define Z_95 1.96
+
+const char usage[] =
+    "Usage: nfestimate [-s <fraction>] [-c <methods>] [-S <seed>] [-v|-q] <nfdump files or directories>\n"
+    "  -s, --sample  : fraction of the data blocks to try (0.05 by default)\n"
+    "  -c, --methods : comma separated methods to try, of lzo, bz2, lz4 and lzma\n"
+    "                  (all by default), each at all of its levels\n"
+    "  -S, --seed    : seed of the block sampling\n"
+    "  -v, --verbose : also log debug messages\n"
+    "  -q, --quiet   : only log errors\n"
+    "Compresses a random sample of the blocks with each method and level and\n"
+    "estimates the size of all data blocks, the CPU time to compress them and\n"
+    "the speed of decompression, with 95%% confidence intervals. Directories are\n"
+    "searched for nfcapd.* files.\n";
+
+static const struct option long_options[] = {
+  {"sample", required_argument, NULL, 's'},
+  {"methods", required_argument, NULL, 'c'},
+  {"seed", required_argument, NULL, 'S'},
+  {"verbose", no_argument, NULL, 'v'},
+  {"quiet", no_argument, NULL, 'q'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+// A method at a level, with the measurements of each sampled block
+typedef struct {
+  compression_t compression;
+  int preset;
+  int failed;
+  double* size;
+  double* compress_time;
+  double* decompress_time;
+} config_t;
+
+// Decompressed block from the sample
+typedef struct {
+  char* data;
+  size_t size;
+} sample_t;
+
+static config_t* configs = NULL;
+static int config_count = 0;
+// Per sampled block
+static double* records = NULL;
+static double* raw_size = NULL;
+static int sample_count = 0;
+static int sample_capacity = 0;
+// Of all data blocks
+static double total_blocks = 0;
+static double total_records = 0;
+static double total_stored = 0;
+static int file_count = 0;
+static int unreadable_count = 0;
+
+static int add_configs(const compression_t compression)
+{
+  int first = 0, last = 0;
+  if (compression == compressed_bz2) {
+    first = 1;
+    last = 9;
+  }
+  else if (compression == compressed_lzma) {
+    last = 9;
+  }
+  for (int preset = first; preset <= last; ++preset) {
+    config_t* new_configs = (config_t*)realloc(configs, (config_count + 1) * sizeof(config_t));
+    if (new_configs == NULL)
+      return -1;
+    configs = new_configs;
+    config_t* config = &configs[config_count++];
+    memset(config, 0, sizeof(config_t));
+    config->compression = compression;
+    config->preset = last > 0 ? preset : -1;
+  }
+  return 0;
+}
+
+static int parse_methods(const char* text)
+{
+  char* methods = strdup(text);
+  char* save = NULL;
+  int result = 0;
+  for (char* method = strtok_r(methods, ",", &save); method != NULL && result == 0;
+       method = strtok_r(NULL, ",", &save)) {
+    if (strcmp(method, "lzo") == 0)
+      result = add_configs(compressed_lzo);
+    else if (strcmp(method, "bz2") == 0)
+      result = add_configs(compressed_bz2);
+    else if (strcmp(method, "lz4") == 0)
+      result = add_configs(compressed_lz4);
+    else if (strcmp(method, "lzma") == 0)
+      result = add_configs(compressed_lzma);
+    else
+      result = -1;
+  }
+  free(methods);
+  return result;
+}
+
+static int grow_samples(const int count)
+{
+  if (count <= sample_capacity)
+    return 0;
+  int capacity = sample_capacity > 0 ? 2 * sample_capacity : 1024;
+  while (capacity < count)
+    capacity *= 2;
+  double** arrays[] = { &records, &raw_size };
+  for (int i = 0; i < 2; ++i) {
+    double* array = (double*)realloc(*arrays[i], capacity * sizeof(double));
+    if (array == NULL)
+      return -1;
+    *arrays[i] = array;
+  }
+  for (int i = 0; i < config_count; ++i) {
+    double** measures[] = { &configs[i].size, &configs[i].compress_time, &configs[i].decompress_time };
+    for (int j = 0; j < 3; ++j) {
+      double* array = (double*)realloc(*measures[j], capacity * sizeof(double));
+      if (array == NULL)
+        return -1;
+      *measures[j] = array;
+    }
+  }
+  sample_capacity = capacity;
+  return 0;
+}
+
+static double thread_seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Try all configurations on a batch of samples, numbered from first
+static void measure_batch(sample_t* batch, const int count, const int first)
+{
+  for (int c = 0; c < config_count; ++c) {
+    config_t* config = &configs[c];
+    if (config->failed)
+      continue;
+    // The levels are process wide, so each gets its own parallel run
+    if (config->compression == compressed_bz2)
+      bz2_preset = config->preset;
+    if (config->compression == compressed_lzma)
+      lzma_preset = config->preset;
+    int failed = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(|:failed)
+    for (int i = 0; i < count; ++i) {
+      char* compressed = NULL;
+      size_t compressed_size = 0;
+      char* decompressed = NULL;
+      size_t decompressed_size = 0;
+      double start = thread_seconds();
+      if (compress_buffer(config->compression, batch[i].data, batch[i].size,
+                          &compressed, &compressed_size) != 0) {
+        failed = 1;
+        continue;
+      }
+      double compressed_at = thread_seconds();
+      if (decompress_buffer(config->compression, compressed, compressed_size,
+                            &decompressed, &decompressed_size) != 0
+          || decompressed_size != batch[i].size)
+        failed = 1;
+      double decompressed_at = thread_seconds();
+      config->size[first + i] = compressed_size;
+      config->compress_time[first + i] = compressed_at - start;
+      config->decompress_time[first + i] = decompressed_at - compressed_at;
+      free(compressed);
+      free(decompressed);
+    }
+    if (failed) {
+      msg(log_error, "%s failed, leaving it out\n", compress_funs_list[config->compression].name);
+      config->failed = 1;
+    }
+  }
+  bz2_preset = DEFAULT_BZ2_PRESET;
+  lzma_preset = DEFAULT_LZMA_PRESET;
+}
+
+static void flush_batch(sample_t* batch, int* batch_count, size_t* batch_size);
+
+static int sample_file(const char* filename, const double fraction, unsigned int* seed,
+                       sample_t** batch, int* batch_count, size_t* batch_size)
+{
+  // A file that can't be scanned is skipped, and counted
+  nf_file_p scan = file_scan(filename);
+  if (scan == NULL) {
+    msg(log_error, "Failed to load file, skipping: %s\n", filename);
+    ++unreadable_count;
+    return 0;
+  }
+  ++file_count;
+  int result = 0;
+  for (int i = 0; i < scan->header.NumBlocks && result == 0; ++i) {
+    nf_block_p block = scan->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    total_blocks += 1;
+    total_records += block->header.NumRecords;
+    total_stored += block->header.size;
+    if (rand_r(seed) >= fraction * ((double)RAND_MAX + 1))
+      continue;
+    if (file_read_block(scan, block) != 0) {
+      result = -1;
+      break;
+    }
+    decompressor(i, block);
+    if (block->status != 0 || grow_samples(sample_count + *batch_count + 1) != 0) {
+      msg(log_error, "Failed to decompress block %d of: %s\n", i, filename);
+      result = -1;
+      break;
+    }
+    int index = sample_count + *batch_count;
+    records[index] = block->header.NumRecords;
+    raw_size[index] = block->header.size;
+    sample_t* new_batch = (sample_t*)realloc(*batch, (*batch_count + 1) * sizeof(sample_t));
+    if (new_batch == NULL) {
+      result = -1;
+      break;
+    }
+    *batch = new_batch;
+    (*batch)[*batch_count].data = block->data;
+    (*batch)[*batch_count].size = block->header.size;
+    block->data = NULL;
+    ++*batch_count;
+    *batch_size += block->header.size;
+    // Also within a file, as a single one may hold more than a batch
+    if (*batch_size >= BATCH_SIZE)
+      flush_batch(*batch, batch_count, batch_size);
+  }
+  file_free(&scan);
+  return result;
+}
+
+static void flush_batch(sample_t* batch, int* batch_count, size_t* batch_size)
+{
+  measure_batch(batch, *batch_count, sample_count);
+  for (int i = 0; i < *batch_count; ++i)
+    free(batch[i].data);
+  sample_count += *batch_count;
+  *batch_count = 0;
+  *batch_size = 0;
+}
+
+// Ratio of the totals of y and x over the sample, with its standard error
+static void ratio_estimate(const double* y, const double* x, double* ratio, double* error)
+{
+  double sum_y = 0, sum_x = 0;
+  for (int i = 0; i < sample_count; ++i) {
+    sum_y += y[i];
+    sum_x += x[i];
+  }
+  *ratio = sum_x > 0 ? sum_y / sum_x : 0;
+  // Nothing is left to estimate when all blocks were sampled
+  *error = sample_count == total_blocks ? 0 : NAN;
+  if (sample_count < 2 || sum_x == 0 || *error == 0)
+    return;
+  double residuals = 0;
+  for (int i = 0; i < sample_count; ++i) {
+    double residual = y[i] - *ratio * x[i];
+    residuals += residual * residual;
+  }
+  double mean_x = sum_x / sample_count;
+  // Without replacement, so with the finite population correction
+  double correction = 1.0 - sample_count / total_blocks;
+  *error = sqrt(correction * residuals / (sample_count - 1) / sample_count) / mean_x;
+}
+
+static void print_interval(const char* format, const double error)
+{
+  if (isnan(error))
+    printf(" %*s", atoi(format + 2), "-");
+  else
+    printf(format, error);
+}
+
+static void report(void)
+{
+  printf("Sampled %d of %.0f data blocks in %d files, %.0f records, %.0f bytes stored\n",
+         sample_count, total_blocks, file_count, total_records, total_stored);
+  if (unreadable_count > 0)
+    printf("Skipped %d unreadable files\n", unreadable_count);
+  printf("%-6s %5s %16s %16s %7s %12s %12s %12s %12s\n", "method", "level", "size",
+         "+/-", "ratio", "compress h", "+/- h", "decomp MB/s", "+/- MB/s");
+  for (int c = 0; c < config_count; ++c) {
+    config_t* config = &configs[c];
+    if (config->failed)
+      continue;
+    double ratio, error;
+    printf("%-6s ", compress_funs_list[config->compression].name);
+    if (config->preset >= 0)
+      printf("%5d ", config->preset);
+    else
+      printf("%5s ", "-");
+    // Sizes and compression times scale with the records of all blocks
+    ratio_estimate(config->size, records, &ratio, &error);
+    double size = ratio * total_records;
+    printf("%16.0f", size);
+    print_interval(" %16.0f", Z_95 * error * total_records);
+    double raw_ratio, raw_error;
+    ratio_estimate(raw_size, records, &raw_ratio, &raw_error);
+    printf(" %7.2f", size > 0 ? raw_ratio * total_records / size : 0);
+    ratio_estimate(config->compress_time, records, &ratio, &error);
+    printf(" %12.4f", ratio * total_records / 3600);
+    print_interval(" %12.4f", Z_95 * error * total_records / 3600);
+    // Decompression speed per core, from seconds per byte
+    ratio_estimate(config->decompress_time, raw_size, &ratio, &error);
+    double speed = ratio > 0 ? 1 / ratio / 1e6 : 0;
+    printf(" %12.1f", speed);
+    if (!isnan(error) && ratio > Z_95 * error) {
+      // Half the width of the interval, which is asymmetric after inverting
+      double low = 1 / (ratio + Z_95 * error) / 1e6;
+      double high = 1 / (ratio - Z_95 * error) / 1e6;
+      printf(" %12.1f", (high - low) / 2);
+    }
+    else {
+      print_interval(" %12.1f", NAN);
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  double fraction = DEFAULT_FRACTION;
+  unsigned int seed = 1;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hs:c:S:vq", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 's':
+        fraction = atof(optarg);
+        if (fraction <= 0 || fraction > 1) {
+          msg(log_error, "Unexpected argument to -s: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'c':
+        if (parse_methods(optarg) != 0) {
+          msg(log_error, "Unexpected argument to -c: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'S':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'v':
+        log_level = log_debug;
+        break;
+
+      case 'q':
+        log_level = log_error;
+        break;
+
+      case 'h':
+        printf(usage);
+        return 0;
+
+      default:
+        printf(usage);
+        return -1;
+    }
+  }
+
+  if (optind >= argc) {
+    printf(usage);
+    return -1;
+  }
+  if (config_count == 0 && parse_methods("lzo,bz2,lz4,lzma") != 0) {
+    msg(log_error, "Failed to allocate methods\n");
+    return -1;
+  }
+  // One thread per block, so the CPU time of each is measured whole
+  mt_threshold = SIZE_MAX;
+
+  found_t found = { NULL, 0 };
+  for (int i = optind; i < argc; ++i) {
+    struct stat st;
+    if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      if (find_files(&found, argv[i]) != 0) {
+        msg(log_error, "Failed to search directory: %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if (add_found(&found, argv[i]) != 0) {
+      return -1;
+    }
+  }
+
+  // Decompressed samples are tried in batches, to bound memory use
+  sample_t* batch = NULL;
+  int batch_count = 0;
+  size_t batch_size = 0;
+  for (int i = 0; i < found.count; ++i) {
+    if (sample_file(found.paths[i], fraction, &seed, &batch, &batch_count, &batch_size) != 0)
+      return -1;
+  }
+  flush_batch(batch, &batch_count, &batch_size);
+  free(batch);
+  free_found(&found);
+
+  if (sample_count == 0) {
+    msg(log_error, "No blocks sampled, try a larger fraction\n");
+    return -1;
+  }
+  report();
+  return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "types.h"
+#include "utils.h"
+#include "compress.h"
+#include "file.h"
+#include "record.h"
+#include "bloom.h"
+
+const char usage[] =
+    "Usage: nfgrep --ip <address> [-l] [-v|-q] <nfdump files>\n"
+    "  -i, --ip                 : IPv4 or IPv6 address to look for\n"
+    "  -l, --files-with-matches : only list the files with flows of the address\n"
+    "  -v, --verbose            : also log debug messages\n"
+    "  -q, --quiet              : only log errors\n"
+    "Blocks are skipped using the bloom filters added by nfrecompress -f.\n";
+
+static const struct option long_options[] = {
+  {"ip", required_argument, NULL, 'i'},
+  {"files-with-matches", no_argument, NULL, 'l'},
+  {"verbose", no_argument, NULL, 'v'},
+  {"quiet", no_argument, NULL, 'q'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+typedef struct {
+  const char* filename;
+  const uint64_t* addr;
+  int list_only;
+  int matches;
+} grep_t;
+
+static void print_flow(const char* filename, const nf_flow_t* flow)
+{
+  char src[64], dst[64], when[32];
+  time_t first = flow->first / 1000;
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&first));
+  record_format_address(flow->srcaddr, src, sizeof(src));
+  record_format_address(flow->dstaddr, dst, sizeof(dst));
+  printf("%s: %s.%03u %u %s:%u -> %s:%u %llu %llu\n", filename, when,
+         (unsigned)(flow->first % 1000), flow->protocol, src, flow->srcport,
+         dst, flow->dstport, (unsigned long long)flow->packets,
+         (unsigned long long)flow->bytes);
+}
+
+static int grep_record(const record_header_t* record, void* context)
+{
+  grep_t* grep = (grep_t*)context;
+  nf_flow_t flow;
+  if (record_decode(record, &flow) != 0)
+    return 0;
+  if (memcmp(flow.srcaddr, grep->addr, sizeof(flow.srcaddr)) != 0
+      && memcmp(flow.dstaddr, grep->addr, sizeof(flow.dstaddr)) != 0)
+    return 0;
+  ++grep->matches;
+  if (!grep->list_only)
+    print_flow(grep->filename, &flow);
+  return 0;
+}
+
+static int grep_file(const char* filename, const uint64_t addr[2], const int list_only)
+{
+  // Returns the number of matching flows, or -1 on failure
+  nf_file_p fl = file_scan(filename);
+  if (fl == NULL)
+    return -1;
+  int* selected = (int*)malloc(fl->header.NumBlocks * sizeof(int));
+  if (selected == NULL) {
+    file_free(&fl);
+    return -1;
+  }
+  int count = bloom_select(fl, addr, selected);
+  msg(log_debug, "Selected %d of %d blocks in: %s\n", count, fl->header.NumBlocks, filename);
+  grep_t grep = { filename, addr, list_only, 0 };
+  int result = 0;
+  for (int i = 0; i < fl->header.NumBlocks && result == 0; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (!selected[i])
+      continue;
+    // Decompressed a window at a time
+    if (file_read_block(fl, block) != 0 || decompress_for_each_record(block, &grep_record, &grep) != 0)
+      result = -1;
+    free(block->data);
+    block->data = NULL;
+  }
+  free(selected);
+  file_free(&fl);
+  if (result == 0 && list_only && grep.matches > 0)
+    printf("%s\n", filename);
+  return result == 0 ? grep.matches : -1;
+}
+
+int main(int argc, char* argv[])
+{
+  uint64_t addr[2];
+  int have_addr = 0;
+  int list_only = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hi:lvq", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'i':
+        if (record_parse_address(optarg, addr) != 0) {
+          msg(log_error, "Unexpected argument to -i: %s\n", optarg);
+          return -1;
+        }
+        have_addr = 1;
+        break;
+
+      case 'l':
+        list_only = 1;
+        break;
+
+      case 'v':
+        log_level = log_debug;
+        break;
+
+      case 'q':
+        log_level = log_error;
+        break;
+
+      case 'h':
+        printf(usage);
+        return 0;
+
+      default:
+        printf(usage);
+        return -1;
+    }
+  }
+
+  if (!have_addr || optind >= argc) {
+    printf(usage);
+    return -1;
+  }
+
+  // Like grep: 0 when found, 1 when not
+  int found = 0;
+  for (int i = optind; i < argc; ++i) {
+    int matches = grep_file(argv[i], addr, list_only);
+    if (matches < 0) {
+      msg(log_error, "Failed to search file: %s\n", argv[i]);
+      return -1;
+    }
+    found |= matches > 0;
+  }
+  return found ? 0 : 1;
+}
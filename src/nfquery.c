@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utils.h"
+
+#define MAX_REPLY 256
+
+const char usage[] =
+    "Usage: nfquery -s <socket> [-v|-q] <from>-<to> [<ip address>]\n"
+    "  -s, --socket : UNIX socket of nfserve\n"
+    "  -v, --verbose : also log debug messages\n"
+    "  -q, --quiet   : only log errors\n"
+    "Writes the records nfserve answers with to stdout.\n";
+
+static const struct option long_options[] = {
+  {"socket", required_argument, NULL, 's'},
+  {"verbose", no_argument, NULL, 'v'},
+  {"quiet", no_argument, NULL, 'q'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char* argv[])
+{
+  const char* socket_path = NULL;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hs:vq", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 's':
+        socket_path = optarg;
+        break;
+
+      case 'v':
+        log_level = log_debug;
+        break;
+
+      case 'q':
+        log_level = log_error;
+        break;
+
+      case 'h':
+        printf(usage);
+        return 0;
+
+      default:
+        printf(usage);
+        return -1;
+    }
+  }
+
+  if (socket_path == NULL || optind >= argc || argc - optind > 2) {
+    printf(usage);
+    return -1;
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    msg(log_error, "Socket path too long: %s\n", socket_path);
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    msg(log_error, "Failed to connect to: %s\n", socket_path);
+    return -1;
+  }
+
+  char request[MAX_REPLY];
+  snprintf(request, sizeof(request), "%s%s%s\n", argv[optind],
+           argc - optind > 1 ? " " : "", argc - optind > 1 ? argv[optind + 1] : "");
+  if (write(fd, request, strlen(request)) != (ssize_t)strlen(request)) {
+    msg(log_error, "Failed to send request\n");
+    return -1;
+  }
+  shutdown(fd, SHUT_WR);
+
+  FILE* in = fdopen(fd, "r");
+  char reply[MAX_REPLY];
+  if (in == NULL || fgets(reply, sizeof(reply), in) == NULL) {
+    msg(log_error, "No reply from: %s\n", socket_path);
+    return -1;
+  }
+  unsigned long long size;
+  if (sscanf(reply, "OK %llu", &size) != 1) {
+    msg(log_error, "%s", reply);
+    return 1;
+  }
+  char buffer[64 * 1024];
+  while (size > 0) {
+    size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+    size_t bytes_read = fread(buffer, 1, chunk, in);
+    if (bytes_read == 0 || fwrite(buffer, 1, bytes_read, stdout) != bytes_read) {
+      msg(log_error, "Failed to read reply\n");
+      return -1;
+    }
+    size -= bytes_read;
+  }
+  fclose(in);
+  return 0;
+}
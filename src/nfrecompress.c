@@ -1,25 +1,450 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "types.h"
 #include "utils.h"
 #include "compress.h"
 #include "file.h"
+#include "dictionary.h"
+#include "zonemap.h"
+#include "bloom.h"
+#include "columnar.h"
+#include "checksum.h"
+#include "budget.h"
+#include "sort.h"
+#include "found.h"
 
 const char usage[] = 
-    "Usage: nfrecompress -c <none|lzo|bz2|lz4|lzma> [-l <0-9>] <nfdump files>\n"
-    "  -c : compression method\n"
-    "  -l : compression level (for bz2 and lzma)\n";
+    "Usage: nfrecompress -c <none|lzo|bz2|lz4|lzma> [-l <0-9>] [-d] [-b <size>] [-s] [-z] [-f] [-C] [-k] [-v|-q] <nfdump files>\n"
+    "       nfrecompress -P <policy> [-r <rate>] [-u <percent>] [options] <nfdump files or directories>\n"
+    "  -c, --compression : compression method\n"
+    "  -l, --level       : compression level (for bz2 and lzma)\n"
+    "  -d, --dictionary  : prime compression with a dictionary sampled from the file (for lz4)\n"
+    "  -b, --block-size  : repack records into blocks of this uncompressed size (k, M, G suffixes)\n"
+    "  -s, --sort        : sort the records by first seen time, so that each block\n"
+    "                      holds the flows seen after those of the block before it\n"
+    "  -z, --zone-maps   : store time, port, protocol and exporter ranges per block\n"
+    "  -f, --bloom-filter: store a filter on the IP addresses per block, for nfgrep\n"
+    "  -C, --columnar    : store the records per field, each compressed on its own\n"
+    "                      (without it, columnar files are converted back)\n"
+    "  -k, --checksums   : store a CRC32C of every block, for nfverify\n"
+    "  -P, --policy      : compression by age, as <age>:<method>[:<level>],... with\n"
+    "                      s, m, h, d or w suffixes, e.g. 0:lz4,7d:lzma:9. The age is\n"
+    "                      that of the last flow in the file. Directories are searched\n"
+    "                      for nfcapd.* files.\n"
+    "  -r, --rate        : limit reading and writing to this many bytes/s (k, M, G suffixes)\n"
+    "  -u, --cpu         : limit CPU use to this percentage of all cores\n"
+    "  -m, --max-memory  : keep the work on blocks within about this many bytes (k, M,\n"
+    "                      G suffixes), compressing fewer of them at a time when\n"
+    "                      needed. Whole files are still loaded first, so this doesn't\n"
+    "                      keep a file larger than memory from running out of it\n"
+    "  -n, --drop-cache  : keep files out of the page cache and read ahead the next\n"
+    "                      one, for bulk jobs next to other users of the disk\n"
+    "  -v, --verbose     : also log debug messages\n"
+    "  -q, --quiet       : only log errors\n"
+    "Files and blocks that already use the method (and level, when given) are left as is.\n"
+    "A file named - is read from standard input and written to standard output.\n";
+
+static const struct option long_options[] = {
+  {"compression", required_argument, NULL, 'c'},
+  {"level", required_argument, NULL, 'l'},
+  {"dictionary", no_argument, NULL, 'd'},
+  {"block-size", required_argument, NULL, 'b'},
+  {"sort", no_argument, NULL, 's'},
+  {"zone-maps", no_argument, NULL, 'z'},
+  {"bloom-filter", no_argument, NULL, 'f'},
+  {"columnar", no_argument, NULL, 'C'},
+  {"checksums", no_argument, NULL, 'k'},
+  {"policy", required_argument, NULL, 'P'},
+  {"rate", required_argument, NULL, 'r'},
+  {"cpu", required_argument, NULL, 'u'},
+  {"max-memory", required_argument, NULL, 'm'},
+  {"drop-cache", no_argument, NULL, 'n'},
+  {"verbose", no_argument, NULL, 'v'},
+  {"quiet", no_argument, NULL, 'q'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static compression_t target_compression = compressed_none;
+static int target_preset = -1;
+static int target_columnar = 0;
+static int passthrough = 0;
+static int use_dictionary = 0;
+static size_t block_size = 0;
+static int use_sort = 0;
+static int use_zonemap = 0;
+static int use_bloom = 0;
+static int use_checksum = 0;
+
+#define MAX_RULES 16
+
+// Compression of files of at least this age
+typedef struct {
+  time_t age;
+  compression_t compression;
+  int preset;
+} rule_t;
+
+static rule_t rules[MAX_RULES];
+static int rule_count = 0;
+static int max_cpu = 0;  // percent
+// Since the file being archived was started, for the CPU limit
+static double wall_start = 0;
+static double cpu_start = 0;
+static block_handler_p throttled_compressor = NULL;
+
+static double seconds(const clockid_t clock)
+{
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Sleep while the CPU used on the file is above max_cpu percent of all
+// cores, checked after every block
+static void throttle_cpu(void)
+{
+  if (max_cpu == 0)
+    return;
+  double pause = (seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_start)
+      / (sysconf(_SC_NPROCESSORS_ONLN) * max_cpu / 100.0) - (seconds(CLOCK_MONOTONIC) - wall_start);
+  if (pause > 0) {
+    struct timespec delay = { (time_t)pause, (long)((pause - (time_t)pause) * 1e9) };
+    nanosleep(&delay, NULL);
+  }
+}
+
+// Whether the block is already stored as requested
+static int is_target(const nf_block_p block)
+{
+  // Blocks of the other byte order are converted, so never kept
+  return compress_matches(block, target_compression, target_preset)
+      && (block->header.id == COLUMNAR_BLOCK) == target_columnar && !block->foreign;
+}
+
+// Decompress blocks, except those that are already compressed as requested
+static void passthrough_decompressor(const int blocknum, nf_block_p block)
+{
+  if (passthrough && is_target(block)) {
+    msg(log_debug, "Passing through block: %d\n", blocknum);
+    return;
+  }
+  decompressor(blocknum, block);
+  throttle_cpu();
+}
+
+static void compressor_throttled(const int blocknum, nf_block_p block)
+{
+  throttled_compressor(blocknum, block);
+  throttle_cpu();
+}
+
+// Header only check whether the file is already compressed as requested
+static int is_converted(const nf_file_p scan)
+{
+  if (!passthrough || scan->repaired)
+    return 0;
+  for (int i = 0; i < scan->header.NumBlocks; ++i) {
+    nf_block_p block = scan->blocks[i];
+    if (block_is_data(block) && !is_target(block))
+      return 0;
+  }
+  return 1;
+}
+
+static int parse_compression(const char* text, compression_t* compression)
+{
+  const char* names[] = { "none", "lzo", "bz2", "lz4", "lzma" };
+  const compression_t methods[] = {
+    compressed_none, compressed_lzo, compressed_bz2, compressed_lz4, compressed_lzma
+  };
+  for (int i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    if (strcmp(text, names[i]) == 0) {
+      *compression = methods[i];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Levels are 1 to 9 for bz2 and 0 to 9 for lzma; other methods have none
+static int parse_level(const char* text, const compression_t compression, int* preset)
+{
+  char* end = NULL;
+  long level = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || level > 9
+      || level < (compression == compressed_bz2 ? 1 : 0)
+      || (compression != compressed_bz2 && compression != compressed_lzma))
+    return -1;
+  *preset = level;
+  return 0;
+}
+
+static void set_target(const compression_t compression, const int preset)
+{
+  target_compression = compression;
+  target_preset = -1;
+  if ((compression == compressed_bz2 && preset > 0)
+      || (compression == compressed_lzma && preset >= 0))
+    target_preset = preset;
+  bz2_preset = compression == compressed_bz2 && preset > 0 ? preset : DEFAULT_BZ2_PRESET;
+  lzma_preset = compression == compressed_lzma && preset >= 0 ? preset : DEFAULT_LZMA_PRESET;
+}
+
+// Parse <age>:<method>[:<level>],... into rules, ordered by age
+static int parse_policy(const char* text)
+{
+  char* policy = strdup(text);
+  char* save = NULL;
+  for (char* rule = strtok_r(policy, ",", &save); rule != NULL; rule = strtok_r(NULL, ",", &save)) {
+    char* method = strchr(rule, ':');
+    if (method == NULL || rule_count == MAX_RULES)
+      goto failure;
+    *method++ = '\0';
+    char* level = strchr(method, ':');
+    if (level != NULL)
+      *level++ = '\0';
+    char* end = NULL;
+    long age = strtol(rule, &end, 10);
+    const char* units = "smhdw";
+    const long unit_seconds[] = { 1, 60, 3600, 86400, 604800 };
+    const char* unit = *end != '\0' ? strchr(units, *end) : units;
+    if (end == rule || age < 0 || unit == NULL || (*end != '\0' && end[1] != '\0'))
+      goto failure;
+    rule_t* next = &rules[rule_count++];
+    next->age = age * unit_seconds[unit - units];
+    next->preset = -1;
+    if (parse_compression(method, &next->compression) != 0)
+      goto failure;
+    if (level != NULL && parse_level(level, next->compression, &next->preset) != 0)
+      goto failure;
+    // Keep ordered by age
+    for (rule_t* r = next; r > rules && r->age < (r - 1)->age; --r) {
+      rule_t swap = *r;
+      *r = *(r - 1);
+      *(r - 1) = swap;
+    }
+  }
+  free(policy);
+  return rule_count > 0 ? 0 : -1;
+failure:
+  free(policy);
+  return -1;
+}
+
+// Recompress a file as the target, unless it's already converted. Takes
+// the scan of the file when it was scanned before, or NULL.
+static int recompress_file(const char* filename, nf_file_p scan)
+{
+  int result = -1;
+  // Standard input can only be read once, so isn't scanned first. All of
+  // it is read before the blocks are decompressed.
+  int piped = strcmp(filename, "-") == 0;
+  nf_file_p fl = piped ? file_load(filename, NULL) : NULL;
+  if (piped)
+    scan = fl;
+  else if (scan == NULL)
+    scan = file_scan(filename);
+  if (scan == NULL) {
+    msg(log_error, "Failed to load file: %s\n", filename);
+    return -1;
+  }
+  // Blocks can only be passed through when they don't change dictionary
+  // and when the blocks themselves stay the same. A new zone map needs
+  // all blocks decompressed, as do a new bloom filter and new checksums.
+  int has_dictionary = file_find_block(scan, DICTIONARY_BLOCK) >= 0;
+  int has_zonemap = file_find_block(scan, ZONEMAP_BLOCK) >= 0;
+  int has_bloom = file_find_block(scan, BLOOM_BLOCK) >= 0;
+  int has_checksum = file_find_block(scan, CHECKSUM_BLOCK) >= 0;
+  passthrough = has_dictionary == use_dictionary && block_size == 0 && !use_sort
+      && (has_zonemap || !use_zonemap) && (has_bloom || !use_bloom)
+      && (has_checksum || !use_checksum);
+  if (piped) {
+    // Still written out, even when already converted
+    if (file_for_each_block(fl, &passthrough_decompressor) < 0) {
+      msg(log_error, "Failed to decompress block in: %s\n", filename);
+      goto failure;
+    }
+  }
+  else {
+    int converted = is_converted(scan);
+    file_free(&scan);
+    if (converted) {
+      // Rewriting in place would only give the same file again
+      msg(log_info, "Already converted, skipping: %s\n", filename);
+      return 0;
+    }
+#ifndef _OPENMP
+    // For the single core case it's faster to first read the file...
+    fl = file_load(filename, NULL);
+#else
+    // , but for the multicore case: start decompressing while reading
+    fl = file_load(filename, &passthrough_decompressor);
+#endif
+    if (fl == NULL) {
+      msg(log_error, "Failed to load file: %s\n", filename);
+      goto failure;
+    }
+#ifndef _OPENMP
+    // ... and than decompress
+    if (for_each_block(fl, &passthrough_decompressor) < 0) {
+      msg(log_error, "Failed to decompress block in: %s\n", filename);
+      goto failure;
+    }
+#endif
+  }
+  if (use_sort) {
+    if (sort_records(&fl, block_size) != 0) {
+      msg(log_error, "Failed to sort records of: %s\n", filename);
+      goto failure;
+    }
+  }
+  else if (block_size > 0 && file_reblock(&fl, block_size) != 0) {
+    msg(log_error, "Failed to re-block: %s\n", filename);
+    goto failure;
+  }
+  // Zone maps, bloom filters and checksums are built from the decompressed
+  // blocks. Present ones are kept, unless the blocks were changed. Checksums
+  // are then built again, as they were asked for before.
+  if (block_size > 0 || use_sort) {
+    zonemap_remove(fl);
+    bloom_remove(fl);
+    checksum_remove(fl);
+  }
+  if (use_zonemap && file_find_block(fl, ZONEMAP_BLOCK) < 0) {
+    if (zonemap_build(&fl) != 0) {
+      msg(log_error, "Failed to build zone map for: %s\n", filename);
+      goto failure;
+    }
+  }
+  if (use_bloom && file_find_block(fl, BLOOM_BLOCK) < 0) {
+    if (bloom_build(&fl) != 0) {
+      msg(log_error, "Failed to build bloom filter for: %s\n", filename);
+      goto failure;
+    }
+  }
+  if ((use_checksum || has_checksum) && file_find_block(fl, CHECKSUM_BLOCK) < 0) {
+    if (checksum_build(&fl) != 0) {
+      msg(log_error, "Failed to build checksums for: %s\n", filename);
+      goto failure;
+    }
+  }
+  // Blocks have been decompressed, so the old dictionary is no longer needed.
+  // With passthrough, it still belongs to the blocks that were kept.
+  if (use_dictionary && !(has_dictionary && passthrough)) {
+    if (dictionary_build(&fl, DEFAULT_DICTIONARY_SIZE) != 0) {
+      msg(log_error, "Failed to build dictionary for: %s\n", filename);
+      goto failure;
+    }
+  }
+  else if (!use_dictionary) {
+    dictionary_remove(fl);
+  }
+  block_handler_p compressor = NULL;
+  if (target_columnar) {
+    columnar_compression = target_compression;
+    compressor = &columnar_compressor;
+  }
+  else switch(target_compression) {
+    case compressed_none:
+      break;
+    case compressed_lzo:
+      compressor = &lzo_compressor;
+      break;
+    case compressed_lz4:
+      compressor = &lz4_compressor;
+      break;
+    case compressed_bz2:
+      compressor = &bz2_compressor;
+      break;
+    case compressed_lzma:
+      compressor = &lzma_compressor;
+      break;
+    default:
+      msg(log_error, "Unexpected compression method");
+      goto failure;
+  }
+  if (max_cpu > 0 && compressor != NULL) {
+    throttled_compressor = compressor;
+    compressor = &compressor_throttled;
+  }
+  // Blocks are written as they're compressed, unless checksums of them go
+  // in front
+  if (file_find_block(fl, CHECKSUM_BLOCK) < 0) {
+    if (file_save_handled(fl, compressor) != 0) {
+      msg(log_error, "Failed to save file: %s\n", filename);
+      goto failure;
+    }
+  }
+  else if (compressor != NULL && file_for_each_block(fl, compressor) < 0) {
+    msg(log_error, "Compression failed\n");
+    goto failure;
+  }
+  else if (checksum_update(&fl) != 0) {
+    msg(log_error, "Failed to update checksums for: %s\n", filename);
+    goto failure;
+  }
+  else if (file_save(fl) != 0) {
+    msg(log_error, "Failed to save file: %s\n", filename);
+    goto failure;
+  }
+  result = 0;
+failure:
+  file_free(&fl);
+  return result;
+}
+
+// Recompress a file as the policy says for its age. Reading and writing
+// are kept within the rate, and the blocks within the CPU limit, a block
+// at a time.
+static int archive_file(const char* filename)
+{
+  nf_file_p scan = file_scan(filename);
+  if (scan == NULL) {
+    msg(log_error, "Failed to load file: %s\n", filename);
+    return -1;
+  }
+  time_t last = scan->stats.last_seen;
+  struct stat st;
+  if (last == 0 && stat(filename, &st) == 0)
+    last = st.st_mtime;
+  time_t age = time(NULL) - last;
+  const rule_t* rule = NULL;
+  for (int i = 0; i < rule_count && rules[i].age <= age; ++i)
+    rule = &rules[i];
+  if (rule == NULL) {
+    msg(log_debug, "No policy for age %ld: %s\n", (long)age, filename);
+    file_free(&scan);
+    return 0;
+  }
+  set_target(rule->compression, rule->preset);
+
+  wall_start = seconds(CLOCK_MONOTONIC);
+  cpu_start = seconds(CLOCK_PROCESS_CPUTIME_ID);
+  int result = recompress_file(filename, scan);
+  // What's left over from the work in between blocks
+  throttle_cpu();
+  return result;
+}
 
 int main(int argc, char* argv[])
 {
   compression_t compression;
-  char opt = '\0';
+  int opt = '\0';
   char* arg = NULL;
+  const char* level = NULL;
   int preset = -1;
-  while ((opt = getopt(argc, argv, "hc:l:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "hc:l:db:szfCkP:r:u:m:nvq", long_options, NULL)) != -1) {
     switch (opt) {
       case 'c':
         arg = optarg;
@@ -27,25 +452,96 @@ int main(int argc, char* argv[])
           msg(log_error, "Expected argument to -c\n");
           return -1;
         }
-        else if (strcmp(arg, "none") == 0) {
-          compression = compressed_none;
+        else if (parse_compression(arg, &compression) != 0) {
+          msg(log_error, "Unexpected argument to -c: %s\n", optarg);
+          return -1;
         }
-        else if(strcmp(arg, "lzo") == 0) {
-          compression = compressed_lzo;
+        break;
+
+      case 'd':
+        use_dictionary = 1;
+        break;
+
+      case 'b':
+        block_size = parse_size(optarg);
+        // Block headers hold 32 bits of size
+        if (block_size == 0 || block_size > UINT32_MAX) {
+          msg(log_error, "Unexpected argument to -b: %s\n", optarg);
+          return -1;
         }
-        else if(strcmp(arg, "lz4") == 0) {
-          compression = compressed_lz4;
+        break;
+
+      case 's':
+        use_sort = 1;
+        break;
+
+      case 'z':
+        use_zonemap = 1;
+        break;
+
+      case 'f':
+        use_bloom = 1;
+        break;
+
+      case 'C':
+        target_columnar = 1;
+        break;
+
+      case 'k':
+        use_checksum = 1;
+        break;
+
+      case 'P':
+        if (parse_policy(optarg) != 0) {
+          msg(log_error, "Unexpected argument to -P: %s\n", optarg);
+          return -1;
         }
-        else if(strcmp(arg, "bz2") == 0) {
-          compression = compressed_bz2;
+        break;
+
+      case 'r':
+        file_max_rate = parse_size(optarg);
+        if (file_max_rate == 0) {
+          msg(log_error, "Unexpected argument to -r: %s\n", optarg);
+          return -1;
         }
-        else if(strcmp(arg, "lzma") == 0) {
-          compression = compressed_lzma;
+        break;
+
+      case 'u': {
+        max_cpu = atoi(optarg);
+        if (max_cpu <= 0 || max_cpu > 100) {
+          msg(log_error, "Unexpected argument to -u: %s\n", optarg);
+          return -1;
         }
-        else {
-          msg(log_error, "Unexpected argument to -c: %s\n", optarg);
+#ifdef _OPENMP
+        // Fewer threads, so sleeping between blocks doesn't leave all cores
+        // idle in turns
+        int threads = (omp_get_num_procs() * max_cpu + 99) / 100;
+        if (threads < omp_get_max_threads())
+          omp_set_num_threads(threads);
+#endif
+        break;
+      }
+
+      case 'm': {
+        size_t max_memory = parse_size(optarg);
+        if (max_memory == 0) {
+          msg(log_error, "Unexpected argument to -m: %s\n", optarg);
           return -1;
         }
+        budget_set(max_memory);
+        break;
+      }
+
+      case 'n':
+        file_drop_cache = 1;
+        break;
+
+      case 'v':
+        log_level = log_debug;
+        break;
+
+      case 'q':
+        log_level = log_error;
         break;
 
       case 'h':
@@ -53,20 +549,8 @@ int main(int argc, char* argv[])
         return 0;
 
       case 'l':
-        if (optarg == NULL) {
-          msg(log_error, "Expected argument to -l\n");
-          return -1;
-        }
-        if (strcmp(optarg, "0") == 0) {
-          preset = 0;
-        }
-        else {
-          preset = atoi(optarg);
-          if (preset == 0) {
-            msg(log_error, "Unexpected argument to -l: %s\n", optarg);
-            return -1;
-          }
-        }
+        // Checked against the method once known
+        level = optarg;
         break;
 
       default:
@@ -76,66 +560,69 @@ int main(int argc, char* argv[])
     }
   }
 
-  if (arg == NULL) {
+  if ((arg == NULL) == (rule_count == 0)) {
     printf(usage);
     return -1;
   }
 
+  if (level != NULL && (arg == NULL || parse_level(level, compression, &preset) != 0)) {
+    msg(log_error, "Unexpected argument to -l: %s\n", level);
+    return -1;
+  }
+
+  int lz4_only = arg == NULL || compression == compressed_lz4;
+  for (int i = 0; i < rule_count; ++i)
+    lz4_only &= rules[i].compression == compressed_lz4;
+  if (use_dictionary && !lz4_only) {
+    msg(log_error, "Dictionary compression is only available for lz4\n");
+    return -1;
+  }
+
+  if (use_dictionary && target_columnar) {
+    msg(log_error, "Dictionary compression is not available for columnar blocks\n");
+    return -1;
+  }
+
   int result = 0;
-  for (int i = optind; i < argc; ++i) {
-    char *filename = argv[i];
-#ifndef _OPENMP
-    // For the single core case it's faster to first read the file...
-    nf_file_p fl = file_load(filename, NULL);
-#else
-    // , but for the multicore case: start decompressing while reading
-    nf_file_p fl = file_load(filename, &decompressor);
-#endif
-    if (fl == NULL) {
-      msg(log_error, "Failed to load file: %s\n", filename);
-      return -1;
+  if (rule_count == 0) {
+    set_target(compression, preset);
+    for (int i = optind; i < argc && result == 0; ++i) {
+      if (file_drop_cache && i + 1 < argc)
+        file_prefetch(argv[i + 1]);
+      result = recompress_file(argv[i], NULL);
     }
-#ifndef _OPENMP
-    // ... and than decompress
-    result = for_each_block(fl, &decompressor);
-    if (result < 0) {
-      msg(log_error, "Failed to decompress block in: %s\n", filename);
-      return result;
+    msg(log_debug, "Peak of memory budget: %zu bytes\n", budget_peak());
+    msg(log_info, "Done\n");
+    return result;
+  }
+
+  // Archive mode: carry on with the other files on failure
+  found_t found = { NULL, 0 };
+  for (int i = optind; i < argc; ++i) {
+    struct stat st;
+    if (strcmp(argv[i], "-") == 0) {
+      // Has no age, nor a place to be rewritten
+      msg(log_error, "Standard input can't be archived\n");
+      result = -1;
     }
-#endif
-    switch(compression) {
-      case compressed_none:
-        break;
-      case compressed_lzo:
-        result = file_for_each_block(fl, &lzo_compressor);
-        break;
-      case compressed_lz4:
-        result = file_for_each_block(fl, &lz4_compressor);
-        break;
-      case compressed_bz2:
-        if (preset > 0)
-          bz2_preset = preset;
-        result = file_for_each_block(fl, &bz2_compressor);
-        break;
-      case compressed_lzma:
-        if (preset >= 0)
-          lzma_preset = preset;
-        result = file_for_each_block(fl, &lzma_compressor);
-        break;
-      default:
-        msg(log_error, "Unexpected compression method");
+    else if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      if (find_files(&found, argv[i]) != 0) {
+        msg(log_error, "Failed to search directory: %s\n", argv[i]);
         result = -1;
+      }
     }
-    if (result < 0) {
-      msg(log_error, "Compression failed\n");
+    else if (add_found(&found, argv[i]) != 0) {
       result = -1;
     }
-    else if (file_save_as(fl, filename) != 0) {
-      msg(log_error, "Failed to save file: %s\n", filename);
+  }
+  for (int i = 0; i < found.count; ++i) {
+    if (file_drop_cache && i + 1 < found.count)
+      file_prefetch(found.paths[i + 1]);
+    if (archive_file(found.paths[i]) != 0)
       result = -1;
-    }
-    file_free(&fl);
   }
+  free_found(&found);
+  msg(log_debug, "Peak of memory budget: %zu bytes\n", budget_peak());
   msg(log_info, "Done\n");
   return result;
 }
@@ -0,0 +1,539 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "types.h"
+#include "utils.h"
+#include "compress.h"
+#include "file.h"
+#include "record.h"
+#include "zonemap.h"
+#include "bloom.h"
+#include "cache.h"
+
+#define DEFAULT_CACHE_SIZE (256 * 1024 * 1024)
+#define DEFAULT_MAX_CLIENTS 64
+#define MAX_REQUEST 256
+// Seconds between checks whether the files changed
+#define CHANGE_INTERVAL 1
+// Blocks fetched of a job before the next job in line gets a turn
+#define JOB_SLICE 32
+
+const char usage[] =
+    "Usage: nfserve -s <socket> [-m <size>] [-c <clients>] [-v|-q] <nfdump files>\n"
+    "  -s, --socket : UNIX socket to listen on\n"
+    "  -m, --cache  : keep this many bytes of decompressed blocks (k, M, G suffixes,\n"
+    "                 256M by default)\n"
+    "  -c, --clients : serve this many clients at a time (64 by default); others\n"
+    "                 wait to be accepted\n"
+    "  -v, --verbose : also log debug messages\n"
+    "  -q, --quiet   : only log errors\n"
+    "Requests are lines of \"<from>-<to> [<ip address>]\", in unix times. Each is\n"
+    "answered with \"OK <size>\" and the records of the blocks that may hold flows\n"
+    "of that time (and address), according to zone maps and bloom filters,\n"
+    "preceded by the extension maps, .. of the other blocks, or with\n"
+    "\"ERROR <reason>\". Files that change are read again, checked at most once a\n"
+    "second. See nfquery.\n";
+
+static const struct option long_options[] = {
+  {"socket", required_argument, NULL, 's'},
+  {"cache", required_argument, NULL, 'm'},
+  {"clients", required_argument, NULL, 'c'},
+  {"verbose", no_argument, NULL, 'v'},
+  {"quiet", no_argument, NULL, 'q'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+// Headers and metadata blocks of a file, kept between requests
+typedef struct {
+  const char* name;
+  cache_key_t key;
+  nf_file_p scan;
+} served_file_t;
+
+typedef struct {
+  served_file_t* file;
+  int block;
+  int others_only;  // just the records that aren't flows
+  cache_entry_p entry;
+  char* others;
+  size_t size;
+} part_t;
+
+// Blocks of a request, waiting for the decoding team
+typedef struct job_s {
+  part_t* parts;
+  int count;
+  int fetched;  // parts, in slices of JOB_SLICE
+  int failed;
+  int done;
+  struct job_s* next;
+} job_t;
+
+static served_file_t* files = NULL;
+static int file_count = 0;
+static pthread_rwlock_t files_lock = PTHREAD_RWLOCK_INITIALIZER;
+static const char* socket_path = NULL;
+// When the files were last checked for changes
+static time_t checked = 0;
+static pthread_mutex_t checked_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// All requests share one OpenMP team, on the decoding thread. Jobs take
+// turns a slice at a time, so small ones don't wait for large ones.
+static job_t* jobs = NULL;
+static job_t* last_job = NULL;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+static int max_clients = DEFAULT_MAX_CLIENTS;
+static int clients = 0;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_left = PTHREAD_COND_INITIALIZER;
+
+// Whether the file changed since it was scanned
+static int is_stale(const served_file_t* file)
+{
+  cache_key_t key;
+  return file->scan == NULL || cache_key_init(&key, file->name) != 0
+      || !cache_key_equal(&key, &file->key);
+}
+
+// Whether any file changed, checked by one request every CHANGE_INTERVAL
+// and otherwise taken as not. The files are looked at before taking the
+// lock, which then only covers comparing them with their scans.
+static int files_changed(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&checked_lock);
+  int due = checked == 0 || now.tv_sec - checked >= CHANGE_INTERVAL;
+  if (due)
+    checked = now.tv_sec;
+  pthread_mutex_unlock(&checked_lock);
+  if (!due)
+    return 0;
+  cache_key_t* keys = (cache_key_t*)calloc(file_count, sizeof(cache_key_t));
+  int* missing = (int*)calloc(file_count, sizeof(int));
+  if (keys == NULL || missing == NULL) {
+    free(keys);
+    free(missing);
+    return 1;
+  }
+  for (int i = 0; i < file_count; ++i)
+    missing[i] = cache_key_init(&keys[i], files[i].name) != 0;
+  pthread_rwlock_rdlock(&files_lock);
+  int stale = 0;
+  for (int i = 0; i < file_count && !stale; ++i)
+    stale = files[i].scan == NULL || missing[i] || !cache_key_equal(&keys[i], &files[i].key);
+  pthread_rwlock_unlock(&files_lock);
+  free(keys);
+  free(missing);
+  return stale;
+}
+
+// Scan the files that changed. Called with the write lock held.
+static void refresh_files(void)
+{
+  for (int i = 0; i < file_count; ++i) {
+    served_file_t* file = &files[i];
+    if (!is_stale(file))
+      continue;
+    file_free(&file->scan);
+    if (cache_key_init(&file->key, file->name) != 0)
+      continue;
+    msg(log_debug, "Scanning: %s\n", file->name);
+    file->scan = file_scan(file->name);
+    if (file->scan == NULL)
+      msg(log_error, "Failed to scan: %s\n", file->name);
+  }
+}
+
+// Decompressed block from the cache, or read and decompressed into it
+static cache_entry_p fetch_block(const served_file_t* file, const int index)
+{
+  nf_block_p block = file->scan->blocks[index];
+  cache_key_t key = file->key;
+  key.offset = block->offset;
+  cache_entry_p entry = cache_get(&key);
+  if (entry != NULL)
+    return entry;
+  nf_block_t copy = *block;
+  copy.data = NULL;
+  if (file_read_block(file->scan, &copy) != 0)
+    return NULL;
+  decompressor(index, &copy);
+  if (copy.status != 0 || (entry = cache_put(&key, &copy)) == NULL) {
+    free(copy.data);
+    return NULL;
+  }
+  return entry;
+}
+
+// Records of a block that aren't flows, from the cache when it's there.
+// Otherwise the block is decompressed a window at a time, and not cached.
+static int fetch_others(part_t* part)
+{
+  nf_block_p block = part->file->scan->blocks[part->block];
+  cache_key_t key = part->file->key;
+  key.offset = block->offset;
+  cache_entry_p entry = cache_get(&key);
+  if (entry != NULL) {
+    part->others = (char*)malloc(entry->size + 1);
+    if (part->others != NULL)
+      part->size = zonemap_other_records(entry->data, entry->size, part->others);
+    cache_release(&entry);
+    return part->others != NULL ? 0 : -1;
+  }
+  nf_block_t copy = *block;
+  copy.data = NULL;
+  int result = file_read_block(part->file->scan, &copy) == 0
+      && zonemap_block_others(&copy, &part->others, &part->size) == 0 ? 0 : -1;
+  free(copy.data);
+  return result;
+}
+
+static int write_all(const int fd, const char* data, size_t size)
+{
+  while (size > 0) {
+    ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+    if (written <= 0)
+      return -1;
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+static int reply_error(const int fd, const char* reason)
+{
+  char reply[MAX_REQUEST];
+  snprintf(reply, sizeof(reply), "ERROR %s\n", reason);
+  return write_all(fd, reply, strlen(reply));
+}
+
+// Select the blocks of all files for the request
+static int select_parts(const zone_predicate_t* predicate, const uint64_t* addr, part_t** parts)
+{
+  int max_parts = 0;
+  for (int i = 0; i < file_count; ++i)
+    max_parts += files[i].scan != NULL ? files[i].scan->header.NumBlocks : 0;
+  *parts = (part_t*)calloc(max_parts + 1, sizeof(part_t));
+  if (*parts == NULL)
+    return -1;
+  int count = 0;
+  for (int i = 0; i < file_count; ++i) {
+    nf_file_p scan = files[i].scan;
+    if (scan == NULL)
+      continue;
+    int* selected = (int*)malloc((scan->header.NumBlocks + 1) * sizeof(int));
+    int* matches = (int*)malloc((scan->header.NumBlocks + 1) * sizeof(int));
+    int* others = (int*)malloc((scan->header.NumBlocks + 1) * sizeof(int));
+    if (selected == NULL || matches == NULL || others == NULL) {
+      free(selected);
+      free(matches);
+      free(others);
+      free(*parts);
+      return -1;
+    }
+    zonemap_select(scan, predicate, selected);
+    if (addr != NULL) {
+      bloom_select(scan, addr, matches);
+      // Blocks without the address still give their extension maps, ..
+      zonemap_select(scan, NULL, others);
+    }
+    for (int j = 0; j < scan->header.NumBlocks; ++j) {
+      int part = selected[j];
+      if (part == ZONE_SELECTED && addr != NULL && !matches[j])
+        part = others[j];
+      if (part != ZONE_SKIPPED) {
+        (*parts)[count].file = &files[i];
+        (*parts)[count].block = j;
+        (*parts)[count].others_only = part == ZONE_OTHERS;
+        ++count;
+      }
+    }
+    free(selected);
+    free(matches);
+    free(others);
+  }
+  return count;
+}
+
+// Fetch the blocks of the parts, and the other records of those that
+// only need them. Returns non-zero on failure.
+static int fetch_parts(part_t* parts, const int count)
+{
+  int failed = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(|:failed)
+  for (int i = 0; i < count; ++i) {
+    part_t* part = &parts[i];
+    if (part->others_only) {
+      if (fetch_others(part) != 0)
+        failed = 1;
+      continue;
+    }
+    part->entry = fetch_block(part->file, part->block);
+    if (part->entry == NULL)
+      failed = 1;
+    else
+      part->size = part->entry->size;
+  }
+  return failed;
+}
+
+static void queue_job(job_t* job)
+{
+  // Called with the jobs lock held
+  job->next = NULL;
+  if (last_job != NULL)
+    last_job->next = job;
+  else
+    jobs = job;
+  last_job = job;
+}
+
+// The decoding thread: takes the jobs in turn, a slice of each, and puts
+// those with parts left at the back of the line
+static void* decode_jobs(void* arg)
+{
+  for (;;) {
+    pthread_mutex_lock(&jobs_lock);
+    while (jobs == NULL)
+      pthread_cond_wait(&job_queued, &jobs_lock);
+    job_t* job = jobs;
+    jobs = job->next;
+    if (jobs == NULL)
+      last_job = NULL;
+    pthread_mutex_unlock(&jobs_lock);
+
+    int slice = job->count - job->fetched < JOB_SLICE ? job->count - job->fetched : JOB_SLICE;
+    int failed = fetch_parts(job->parts + job->fetched, slice);
+    job->fetched += slice;
+
+    pthread_mutex_lock(&jobs_lock);
+    if (failed || job->fetched == job->count) {
+      job->failed = failed;
+      job->done = 1;
+      pthread_cond_broadcast(&job_done);
+    }
+    else {
+      queue_job(job);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+  }
+  return NULL;
+}
+
+// Have the decoding thread fetch the parts, and wait for it
+static int decode_parts(part_t* parts, const int count)
+{
+  job_t job = { parts, count, 0, 0, 0, NULL };
+  pthread_mutex_lock(&jobs_lock);
+  queue_job(&job);
+  pthread_cond_signal(&job_queued);
+  while (!job.done)
+    pthread_cond_wait(&job_done, &jobs_lock);
+  pthread_mutex_unlock(&jobs_lock);
+  return job.failed;
+}
+
+// Answer a request. Returns -1 only when the client can't be written to.
+static int answer(const int fd, const char* request)
+{
+  unsigned long long from, to;
+  char address[MAX_REQUEST];
+  int fields = sscanf(request, "%llu-%llu %255s", &from, &to, address);
+  if (fields < 2 || to < from)
+    return reply_error(fd, "Expected <from>-<to> [<ip address>]");
+  uint64_t addr[2];
+  if (fields == 3 && record_parse_address(address, addr) != 0)
+    return reply_error(fd, "Invalid address");
+  zone_predicate_t predicate;
+  zonemap_predicate_init(&predicate);
+  predicate.first = from * 1000;
+  predicate.last = to * 1000 + 999;
+
+  if (files_changed()) {
+    pthread_rwlock_wrlock(&files_lock);
+    refresh_files();
+    pthread_rwlock_unlock(&files_lock);
+  }
+  pthread_rwlock_rdlock(&files_lock);
+  part_t* parts = NULL;
+  int count = select_parts(&predicate, fields == 3 ? addr : NULL, &parts);
+  int failed = count < 0 || (count > 0 && decode_parts(parts, count) != 0);
+  // The entries stay valid when files are scanned again
+  pthread_rwlock_unlock(&files_lock);
+
+  int result = 0;
+  if (failed) {
+    result = reply_error(fd, "Failed to read blocks");
+  }
+  else {
+    unsigned long long size = 0;
+    for (int i = 0; i < count; ++i)
+      size += parts[i].size;
+    msg(log_debug, "Request %s: %d blocks, %llu bytes\n", request, count, size);
+    char reply[MAX_REQUEST];
+    snprintf(reply, sizeof(reply), "OK %llu\n", size);
+    result = write_all(fd, reply, strlen(reply));
+    for (int i = 0; i < count && result == 0; ++i)
+      result = write_all(fd, parts[i].others_only ? parts[i].others : parts[i].entry->data, parts[i].size);
+  }
+  for (int i = 0; i < count; ++i) {
+    cache_release(&parts[i].entry);
+    free(parts[i].others);
+  }
+  free(parts);
+  return result;
+}
+
+static void* serve_connection(void* arg)
+{
+  int fd = (int)(intptr_t)arg;
+  FILE* in = fdopen(dup(fd), "r");
+  char request[MAX_REQUEST];
+  while (in != NULL && fgets(request, sizeof(request), in) != NULL) {
+    request[strcspn(request, "\r\n")] = '\0';
+    if (answer(fd, request) != 0)
+      break;
+  }
+  if (in != NULL)
+    fclose(in);
+  close(fd);
+  pthread_mutex_lock(&clients_lock);
+  --clients;
+  pthread_cond_signal(&client_left);
+  pthread_mutex_unlock(&clients_lock);
+  return NULL;
+}
+
+static void stop(int signum)
+{
+  unlink(socket_path);
+  _exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+  size_t cache_size = DEFAULT_CACHE_SIZE;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hs:m:c:vq", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 's':
+        socket_path = optarg;
+        break;
+
+      case 'm':
+        cache_size = parse_size(optarg);
+        if (cache_size == 0 && strcmp(optarg, "0") != 0) {
+          msg(log_error, "Unexpected argument to -m: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'c':
+        max_clients = atoi(optarg);
+        if (max_clients <= 0) {
+          msg(log_error, "Unexpected argument to -c: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'v':
+        log_level = log_debug;
+        break;
+
+      case 'q':
+        log_level = log_error;
+        break;
+
+      case 'h':
+        printf(usage);
+        return 0;
+
+      default:
+        printf(usage);
+        return -1;
+    }
+  }
+
+  if (socket_path == NULL || optind >= argc) {
+    printf(usage);
+    return -1;
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    msg(log_error, "Socket path too long: %s\n", socket_path);
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  cache_set_size(cache_size);
+  file_count = argc - optind;
+  files = (served_file_t*)calloc(file_count, sizeof(served_file_t));
+  if (files == NULL) {
+    msg(log_error, "Failed to allocate files\n");
+    return -1;
+  }
+  for (int i = 0; i < file_count; ++i)
+    files[i].name = argv[optind + i];
+  refresh_files();
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path);
+  if (server < 0 || bind(server, (struct sockaddr*)&address, sizeof(address)) != 0
+      || listen(server, SOMAXCONN) != 0) {
+    msg(log_error, "Failed to listen on: %s\n", socket_path);
+    return -1;
+  }
+  signal(SIGINT, &stop);
+  signal(SIGTERM, &stop);
+  signal(SIGPIPE, SIG_IGN);
+  msg(log_info, "Serving %d files on: %s\n", file_count, socket_path);
+
+  pthread_t decoder;
+  if (pthread_create(&decoder, NULL, &decode_jobs, NULL) != 0) {
+    msg(log_error, "Failed to start decoding thread\n");
+    return -1;
+  }
+
+  // A thread per client, up to max_clients, which only parses requests and
+  // writes replies. Further clients wait in the listen backlog.
+  for (;;) {
+    pthread_mutex_lock(&clients_lock);
+    while (clients >= max_clients)
+      pthread_cond_wait(&client_left, &clients_lock);
+    pthread_mutex_unlock(&clients_lock);
+    int client = accept(server, NULL, NULL);
+    if (client < 0)
+      continue;
+    pthread_mutex_lock(&clients_lock);
+    ++clients;
+    pthread_mutex_unlock(&clients_lock);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &serve_connection, (void*)(intptr_t)client) != 0) {
+      msg(log_error, "Failed to start client thread\n");
+      close(client);
+      pthread_mutex_lock(&clients_lock);
+      --clients;
+      pthread_mutex_unlock(&clients_lock);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return 0;
+}
@@ -0,0 +1,253 @@
+/**
+ * \file nftools.c
+ * \brief Public C API of libnftools
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "utils.h"
+#include "compress.h"
+#include "file.h"
+#include "record.h"
+#include "checksum.h"
+#include "cache.h"
+#include "nftools.h"
+
+struct nft_file_s {
+  nf_file_p file;
+  int count;
+  int* blocks;  // file block index of each data block
+  cache_key_t key;
+  cache_entry_p* entries;  // decompressed data blocks held from the cache
+};
+
+static int _index_blocks(nft_file_t* file);
+static int _cache_block(nft_file_t* file, const int index);
+
+
+const char* nft_version(void) {
+  return PACKAGE_VERSION;
+}
+
+
+void nft_set_log_level(const int level) {
+  log_level = level <= 0 ? log_debug : level == 1 ? log_info : log_error;
+}
+
+
+void nft_set_cache_size(const size_t bytes) {
+  cache_set_size(bytes);
+}
+
+
+void nft_cache_stats(nft_cache_stats_t* stats) {
+  cache_stats_t cache;
+  cache_stats(&cache);
+  stats->hits = cache.hits;
+  stats->misses = cache.misses;
+  stats->entries = cache.entries;
+  stats->bytes = cache.bytes;
+}
+
+
+nft_file_t* nft_open(const char* filename) {
+  nft_file_t* file = (nft_file_t*)calloc(1, sizeof(nft_file_t));
+  if (file == NULL) {
+    msg(log_error, "Failed to allocate file\n");
+    return NULL;
+  }
+  file->file = file_load(filename, NULL);
+  if (file->file == NULL || _index_blocks(file) != 0 || cache_key_init(&file->key, filename) != 0) {
+    nft_close(file);
+    return NULL;
+  }
+  file->entries = (cache_entry_p*)calloc(file->count + 1, sizeof(cache_entry_p));
+  if (file->entries == NULL) {
+    msg(log_error, "Failed to allocate cache entries\n");
+    nft_close(file);
+    return NULL;
+  }
+  return file;
+}
+
+
+void nft_close(nft_file_t* file) {
+  if (file == NULL)
+    return;
+  if (file->file != NULL)
+    file_free(&file->file);
+  if (file->entries != NULL) {
+    for (int i = 0; i < file->count; ++i)
+      cache_release(&file->entries[i]);
+  }
+  free(file->entries);
+  free(file->blocks);
+  free(file);
+}
+
+
+int nft_block_count(const nft_file_t* file) {
+  return file->count;
+}
+
+
+int nft_decompress(nft_file_t* file) {
+  int result = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(|:result)
+  for (int i = 0; i < file->count; ++i) {
+    nft_block_view_t view;
+    if (nft_block(file, i, &view) != 0)
+      result = -1;
+  }
+  return result;
+}
+
+
+int nft_block(nft_file_t* file, const int index, nft_block_view_t* view) {
+  if (index < 0 || index >= file->count)
+    return -1;
+  nf_block_p block = file->file->blocks[file->blocks[index]];
+  if (block->compression == compressed_none && block->header.id != COLUMNAR_BLOCK && block->foreign != 1) {
+    view->id = block->header.id;
+    view->records = block->header.NumRecords;
+    view->data = block->data;
+    view->size = block->header.size;
+    return 0;
+  }
+  if (file->entries[index] == NULL && _cache_block(file, index) != 0)
+    return -1;
+  cache_entry_p entry = file->entries[index];
+  view->id = entry->id;
+  view->records = entry->records;
+  view->data = entry->data;
+  view->size = entry->size;
+  return 0;
+}
+
+
+void nft_records(nft_file_t* file, nft_iterator_t* iterator) {
+  iterator->file = file;
+  iterator->block = 0;
+  iterator->offset = 0;
+}
+
+
+int nft_next(nft_iterator_t* iterator, const record_header_t** record) {
+  nft_block_view_t view;
+  while (iterator->block < iterator->file->count) {
+    if (nft_block(iterator->file, iterator->block, &view) != 0)
+      return -1;
+    if (iterator->offset + sizeof(record_header_t) <= view.size) {
+      const record_header_t* next = (const record_header_t*)(view.data + iterator->offset);
+      if (next->size < sizeof(record_header_t) || iterator->offset + next->size > view.size) {
+        msg(log_error, "Invalid record size: %u at offset %lu\n", next->size, iterator->offset);
+        return -1;
+      }
+      iterator->offset += next->size;
+      *record = next;
+      return 1;
+    }
+    ++iterator->block;
+    iterator->offset = 0;
+  }
+  return 0;
+}
+
+
+int nft_decode(const record_header_t* record, nft_flow_t* flow) {
+  nf_flow_t decoded;
+  if (record_decode(record, &decoded) != 0)
+    return -1;
+  flow->first = decoded.first;
+  flow->last = decoded.last;
+  flow->srcaddr[0] = decoded.srcaddr[0];
+  flow->srcaddr[1] = decoded.srcaddr[1];
+  flow->dstaddr[0] = decoded.dstaddr[0];
+  flow->dstaddr[1] = decoded.dstaddr[1];
+  flow->packets = decoded.packets;
+  flow->bytes = decoded.bytes;
+  flow->srcport = decoded.srcport;
+  flow->dstport = decoded.dstport;
+  flow->exporter = decoded.exporter;
+  flow->protocol = decoded.protocol;
+  flow->tcp_flags = decoded.tcp_flags;
+  flow->tos = decoded.tos;
+  flow->ipv6 = decoded.ipv6;
+  return 0;
+}
+
+
+int nft_save(nft_file_t* file, const char* filename, const compression_t compression) {
+  if (compression < compressed_none || compression >= compressed_term) {
+    msg(log_error, "Unknown compression method: %d\n", compression);
+    return -1;
+  }
+  nf_file_p fl = file->file;
+  int result = 0;
+  #pragma omp parallel for reduction(|:result)
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (block->compression == compression && block->header.id != COLUMNAR_BLOCK && !block->foreign)
+      continue;
+    if (decompress(block) != 0 || compress(block, compression) != 0)
+      result = -1;
+  }
+  // Checksums present are kept valid; this can move blocks around
+  if (result != 0 || checksum_update(&file->file) != 0 || _index_blocks(file) != 0)
+    return -1;
+  return file_save_as(file->file, filename);
+}
+
+
+static int _cache_block(nft_file_t* file, const int index) {
+  // Takes the decompressed block from the cache, or decompresses a copy of
+  // it into the cache. The compressed block stays, for saving.
+  nf_block_p block = file->file->blocks[file->blocks[index]];
+  cache_key_t key = file->key;
+  key.offset = block->offset;
+  cache_entry_p entry = cache_get(&key);
+  if (entry == NULL) {
+    nf_block_t copy = *block;
+    copy.data = (char*)malloc(block->header.size + 1);
+    if (copy.data == NULL) {
+      msg(log_error, "Failed to allocate block copy\n");
+      return -1;
+    }
+    memcpy(copy.data, block->data, block->header.size);
+    if (decompress(&copy) != 0 || block_validate(&copy) != 0
+        || (entry = cache_put(&key, &copy)) == NULL) {
+      free(copy.data);
+      return -1;
+    }
+  }
+  file->entries[index] = entry;
+  return 0;
+}
+
+
+static int _index_blocks(nft_file_t* file) {
+  nf_file_p fl = file->file;
+  free(file->blocks);
+  file->blocks = (int*)malloc((fl->header.NumBlocks + 1) * sizeof(int));
+  if (file->blocks == NULL) {
+    msg(log_error, "Failed to allocate block index\n");
+    return -1;
+  }
+  file->count = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    if (block_is_data(fl->blocks[i]))
+      file->blocks[file->count++] = i;
+  }
+  return 0;
+}
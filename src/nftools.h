@@ -0,0 +1,105 @@
+/**
+ * \file nftools.h
+ * \brief Public C API of libnftools
+ *
+ * Reads and writes nfdump files in process. Records are handed out as
+ * pointers into the decompressed blocks, which stay valid until the file
+ * is saved or closed. A file handle should be used by one thread at a
+ * time; blocks are (de)compressed in parallel on the OpenMP threads.
+ *
+ * Only what is declared here is part of the stable interface.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _NFTOOLS_H
+#define _NFTOOLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct nft_file_s nft_file_t;
+
+// A decompressed data block
+typedef struct {
+  uint16_t id;
+  uint32_t records;
+  const char* data;
+  size_t size;
+} nft_block_view_t;
+
+typedef struct {
+  size_t hits;
+  size_t misses;
+  size_t entries;
+  size_t bytes;
+} nft_cache_stats_t;
+
+// Walks the records of all data blocks of a file
+typedef struct {
+  nft_file_t* file;
+  int block;
+  size_t offset;
+} nft_iterator_t;
+
+// Fields of a flow record, with IPv4 addresses mapped into IPv6
+typedef struct {
+  uint64_t first;  // msec
+  uint64_t last;   // msec
+  uint64_t srcaddr[2];
+  uint64_t dstaddr[2];
+  uint64_t packets;
+  uint64_t bytes;
+  uint16_t srcport;
+  uint16_t dstport;
+  uint16_t exporter;
+  uint8_t protocol;
+  uint8_t tcp_flags;
+  uint8_t tos;
+  uint8_t ipv6;
+} nft_flow_t;
+
+extern const char* nft_version(void);
+// 0: debug, 1: info (default), 2: errors only. Messages go to stderr.
+extern void nft_set_log_level(const int level);
+// Decompressed blocks are kept in a process wide cache of this many bytes,
+// shared by all open files. Zero, the default, disables it.
+extern void nft_set_cache_size(const size_t bytes);
+extern void nft_cache_stats(nft_cache_stats_t* stats);
+
+// Reads a file. Blocks are decompressed when first used, or all at once
+// with nft_decompress.
+extern nft_file_t* nft_open(const char* filename);
+extern void nft_close(nft_file_t* file);
+
+extern int nft_block_count(const nft_file_t* file);
+extern int nft_decompress(nft_file_t* file);
+extern int nft_block(nft_file_t* file, const int index, nft_block_view_t* view);
+
+// nft_next returns 1 with the next record, 0 at the end and -1 on failure
+extern void nft_records(nft_file_t* file, nft_iterator_t* iterator);
+extern int nft_next(nft_iterator_t* iterator, const record_header_t** record);
+// Returns -1 for records that are not flows
+extern int nft_decode(const record_header_t* record, nft_flow_t* flow);
+
+// Writes the file with all data blocks compressed as given
+extern int nft_save(nft_file_t* file, const char* filename, const compression_t compression);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * \file nftools.hpp
+ * \brief C++ wrapper of the libnftools C API
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _NFTOOLS_HPP
+#define _NFTOOLS_HPP
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "nftools.h"
+
+namespace nftools {
+
+class Error : public std::runtime_error
+{
+public:
+  explicit Error(const std::string& what) : std::runtime_error(what) {}
+};
+
+// Owns an open nfdump file. Record pointers handed out are valid until the
+// file is saved or destroyed.
+class File
+{
+public:
+  explicit File(const std::string& filename) : file_(nft_open(filename.c_str())) {
+    if (file_ == nullptr)
+      throw Error("Failed to open: " + filename);
+  }
+  ~File() { nft_close(file_); }
+
+  File(const File&) = delete;
+  File& operator=(const File&) = delete;
+  File(File&& other) noexcept : file_(other.file_) { other.file_ = nullptr; }
+  File& operator=(File&& other) noexcept {
+    std::swap(file_, other.file_);
+    return *this;
+  }
+
+  int blocks() const { return nft_block_count(file_); }
+
+  void decompress() {
+    if (nft_decompress(file_) != 0)
+      throw Error("Failed to decompress blocks");
+  }
+
+  nft_block_view_t block(const int index) {
+    nft_block_view_t view;
+    if (nft_block(file_, index, &view) != 0)
+      throw Error("Failed to read block: " + std::to_string(index));
+    return view;
+  }
+
+  // Calls handler with each const record_header_t* in the file
+  template <typename Handler>
+  void for_each_record(Handler handler) {
+    nft_iterator_t iterator;
+    nft_records(file_, &iterator);
+    const record_header_t* record = nullptr;
+    int result;
+    while ((result = nft_next(&iterator, &record)) > 0)
+      handler(record);
+    if (result < 0)
+      throw Error("Failed to read records");
+  }
+
+  // Calls handler with each decoded nft_flow_t in the file
+  template <typename Handler>
+  void for_each_flow(Handler handler) {
+    nft_flow_t flow;
+    for_each_record([&](const record_header_t* record) {
+      if (nft_decode(record, &flow) == 0)
+        handler(flow);
+    });
+  }
+
+  void save(const std::string& filename, const compression_t compression) {
+    if (nft_save(file_, filename.c_str(), compression) != 0)
+      throw Error("Failed to save: " + filename);
+  }
+
+  nft_file_t* get() const { return file_; }
+
+private:
+  nft_file_t* file_;
+};
+
+}  // namespace nftools
+
+#endif
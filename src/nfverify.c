@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+
+#include "types.h"
+#include "utils.h"
+#include "file.h"
+#include "checksum.h"
+
+const char usage[] =
+    "Usage: nfverify [-c] [-v|-q] <nfdump files>\n"
+    "  -c, --content : also decompress the data blocks and check the records\n"
+    "  -v, --verbose : also log debug messages\n"
+    "  -q, --quiet   : only log errors\n"
+    "Checks the block checksums added by nfrecompress -k.\n";
+
+static const struct option long_options[] = {
+  {"content", no_argument, NULL, 'c'},
+  {"verbose", no_argument, NULL, 'v'},
+  {"quiet", no_argument, NULL, 'q'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char* argv[])
+{
+  int check_content = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hcvq", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+        check_content = 1;
+        break;
+
+      case 'v':
+        log_level = log_debug;
+        break;
+
+      case 'q':
+        log_level = log_error;
+        break;
+
+      case 'h':
+        printf(usage);
+        return 0;
+
+      default:
+        printf(usage);
+        return -1;
+    }
+  }
+
+  if (optind >= argc) {
+    printf(usage);
+    return -1;
+  }
+
+  // 0 when all files check out, 1 when any is unreadable, has bad blocks
+  // or no checksums. The other files are still checked.
+  int result = 0;
+  for (int i = optind; i < argc; ++i) {
+    char* filename = argv[i];
+    nf_file_p fl = file_load(filename, NULL);
+    if (fl == NULL) {
+      printf("%s: unreadable\n", filename);
+      result = 1;
+      continue;
+    }
+    int bad = checksum_verify(fl, check_content);
+    if (bad < 0)
+      printf("%s: no checksums\n", filename);
+    else if (bad > 0)
+      printf("%s: %d bad blocks\n", filename, bad);
+    else
+      printf("%s: OK\n", filename);
+    if (bad != 0)
+      result = 1;
+    file_free(&fl);
+  }
+  return result;
+}
@@ -13,10 +13,310 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "block.h"
 
+#define IPV4_MAPPED 0xffff00000000ULL
+
+// Records are only 32 bit aligned, so swap through a copy
+static void _swap16(void* value) {
+  uint16_t v;
+  memcpy(&v, value, sizeof(v));
+  v = __builtin_bswap16(v);
+  memcpy(value, &v, sizeof(v));
+}
+
+static void _swap32(void* value) {
+  uint32_t v;
+  memcpy(&v, value, sizeof(v));
+  v = __builtin_bswap32(v);
+  memcpy(value, &v, sizeof(v));
+}
+
+static void _swap64(void* value) {
+  uint64_t v;
+  memcpy(&v, value, sizeof(v));
+  v = __builtin_bswap64(v);
+  memcpy(value, &v, sizeof(v));
+}
+
+// Sizes of the elements of the optional extensions of nfdump flows, by id.
+// Ids 1 to 3 are the addresses, packets and bytes every flow has; the NSEL
+// and NEL extensions from 37 on aren't known here.
+static const char* _extension_layouts[] = {
+  NULL, NULL, NULL, NULL,
+  "22",          // 4: input and output SNMP interface
+  "44",          // 5: .. 32 bit
+  "22",          // 6: source and destination AS
+  "44",          // 7: .. 32 bit
+  "1111",        // 8: destination tos, direction, source and destination mask
+  "4",           // 9: next hop IPv4
+  "88",          // 10: next hop IPv6
+  "4",           // 11: BGP next hop IPv4
+  "88",          // 12: BGP next hop IPv6
+  "22",          // 13: source and destination VLAN
+  "4",           // 14: output packets
+  "8",           // 15: .. 64 bit
+  "4",           // 16: output bytes
+  "8",           // 17: .. 64 bit
+  "4",           // 18: aggregated flows
+  "8",           // 19: .. 64 bit
+  "88",          // 20: input source and output destination MAC
+  "88",          // 21: input destination and output source MAC
+  "4444444444",  // 22: MPLS labels
+  "4",           // 23: router IPv4
+  "88",          // 24: router IPv6
+  "211",         // 25: router engine type and id
+  "44",          // 26: next and previous adjacent AS
+  "8",           // 27: time received
+};
+#define EXTENSION_LAYOUTS (sizeof(_extension_layouts) / sizeof(_extension_layouts[0]))
+
+static void _add_map(record_maps_t* maps, const char* record, const uint16_t size) {
+  // From a map in native order: its id, the extension size and the ids of
+  // the extensions, up to a 0. A map with a known id replaces it.
+  uint16_t id;
+  memcpy(&id, record + sizeof(record_header_t), sizeof(id));
+  record_map_t* map = NULL;
+  for (int i = 0; i < maps->count && map == NULL; ++i) {
+    if (maps->maps[i].id == id)
+      map = &maps->maps[i];
+  }
+  if (map == NULL) {
+    if (maps->count == RECORD_MAX_MAPS)
+      return;
+    map = &maps->maps[maps->count++];
+  }
+  map->id = id;
+  map->count = 0;
+  for (size_t offset = sizeof(record_header_t) + 2 * sizeof(uint16_t); offset + sizeof(uint16_t) <= size;
+       offset += sizeof(uint16_t)) {
+    uint16_t extension;
+    memcpy(&extension, record + offset, sizeof(extension));
+    if (extension == 0)
+      break;
+    if (map->count == RECORD_MAX_EXTENSIONS) {
+      // Too many to keep; flows of this map are left
+      map->count = UINT16_MAX;
+      return;
+    }
+    map->extensions[map->count++] = extension;
+  }
+}
+
+static int _swap_extensions(char* data, const size_t size, const uint16_t ext_map, const record_maps_t* maps) {
+  // Swaps the extensions of a flow as laid out by its map. Returns 1, and
+  // leaves them, when the map or any of its extensions is unknown or they
+  // don't fill the rest of the record.
+  const record_map_t* map = NULL;
+  for (int i = 0; maps != NULL && i < maps->count && map == NULL; ++i) {
+    if (maps->maps[i].id == ext_map)
+      map = &maps->maps[i];
+  }
+  if (map == NULL || map->count > RECORD_MAX_EXTENSIONS)
+    return 1;
+  size_t total = 0;
+  for (int i = 0; i < map->count; ++i) {
+    uint16_t id = map->extensions[i];
+    if (id >= EXTENSION_LAYOUTS || _extension_layouts[id] == NULL)
+      return 1;
+    for (const char* element = _extension_layouts[id]; *element; ++element)
+      total += *element - '0';
+  }
+  if (total != size)
+    return 1;
+  for (int i = 0; i < map->count; ++i) {
+    for (const char* element = _extension_layouts[map->extensions[i]]; *element; ++element) {
+      switch (*element) {
+        case '2': _swap16(data); break;
+        case '4': _swap32(data); break;
+        case '8': _swap64(data); break;
+      }
+      data += *element - '0';
+    }
+  }
+  return 0;
+}
+
+int record_decode(const record_header_t* record, nf_flow_t* flow)
+{
+  // Only CommonRecordType records are flows. Returns -1 for other records.
+  if (record->type != CommonRecordType)
+    return -1;
+  const common_record_t* common = (const common_record_t*)record;
+  int ipv6 = (common->flags & FLAG_IPV6_ADDR) != 0;
+  size_t size = offsetof(common_record_t, data)
+      + (ipv6 ? 4 * sizeof(uint64_t) : 2 * sizeof(uint32_t))
+      + (common->flags & FLAG_PKG_64 ? sizeof(uint64_t) : sizeof(uint32_t))
+      + (common->flags & FLAG_BYTES_64 ? sizeof(uint64_t) : sizeof(uint32_t));
+  if (record->size < size)
+    return -1;
+
+  flow->first = (uint64_t)common->first * 1000 + common->msec_first;
+  flow->last = (uint64_t)common->last * 1000 + common->msec_last;
+  flow->srcport = common->srcport;
+  flow->dstport = common->dstport;
+  flow->exporter = common->exporter_sysid;
+  flow->protocol = common->prot;
+  flow->tcp_flags = common->tcp_flags;
+  flow->tos = common->tos;
+  flow->ipv6 = ipv6;
+
+  // Records are only 32 bit aligned, hence the memcpy for 64 bit values
+  const char* data = (const char*)common->data;
+  if (ipv6) {
+    memcpy(flow->srcaddr, data, 2 * sizeof(uint64_t));
+    memcpy(flow->dstaddr, data + 2 * sizeof(uint64_t), 2 * sizeof(uint64_t));
+    data += 4 * sizeof(uint64_t);
+  }
+  else {
+    uint32_t addr[2];
+    memcpy(addr, data, sizeof(addr));
+    flow->srcaddr[0] = 0;
+    flow->srcaddr[1] = IPV4_MAPPED | addr[0];
+    flow->dstaddr[0] = 0;
+    flow->dstaddr[1] = IPV4_MAPPED | addr[1];
+    data += sizeof(addr);
+  }
+  if (common->flags & FLAG_PKG_64) {
+    memcpy(&flow->packets, data, sizeof(uint64_t));
+    data += sizeof(uint64_t);
+  }
+  else {
+    uint32_t packets;
+    memcpy(&packets, data, sizeof(packets));
+    flow->packets = packets;
+    data += sizeof(uint32_t);
+  }
+  if (common->flags & FLAG_BYTES_64) {
+    memcpy(&flow->bytes, data, sizeof(uint64_t));
+  }
+  else {
+    uint32_t bytes;
+    memcpy(&bytes, data, sizeof(bytes));
+    flow->bytes = bytes;
+  }
+  return 0;
+}
+
+int record_swap(record_header_t* record, const size_t available, const int to_native,
+                record_maps_t* maps)
+{
+  // Swaps the byte order of a record, from foreign to native order or back.
+  // Only the layouts decoded here are known: flows, with the extensions up
+  // to id 27 of a map among maps, and extension maps, which are added to
+  // maps. Of other records just the header is swapped. Returns 1 when the
+  // record was only partly converted, -1 on an invalid size.
+  uint16_t type = record->type;
+  uint16_t size = record->size;
+  if (to_native) {
+    type = __builtin_bswap16(type);
+    size = __builtin_bswap16(size);
+  }
+  if (size < sizeof(record_header_t) || size > available)
+    return -1;
+  _swap16(&record->type);
+  _swap16(&record->size);
+
+  char* data = (char*)record;
+  switch (type) {
+    case CommonRecordType: {
+      common_record_t* common = (common_record_t*)record;
+      uint16_t flags = to_native ? __builtin_bswap16(common->flags) : common->flags;
+      uint16_t ext_map = to_native ? __builtin_bswap16(common->ext_map) : common->ext_map;
+      int ipv6 = (flags & FLAG_IPV6_ADDR) != 0;
+      size_t addresses = ipv6 ? 4 * sizeof(uint64_t) : 2 * sizeof(uint32_t);
+      size_t packets = flags & FLAG_PKG_64 ? sizeof(uint64_t) : sizeof(uint32_t);
+      size_t bytes = flags & FLAG_BYTES_64 ? sizeof(uint64_t) : sizeof(uint32_t);
+      size_t flow_size = offsetof(common_record_t, data) + addresses + packets + bytes;
+      if (size < flow_size)
+        return 1;
+      _swap16(&common->flags);
+      _swap16(&common->ext_map);
+      _swap16(&common->msec_first);
+      _swap16(&common->msec_last);
+      _swap32(&common->first);
+      _swap32(&common->last);
+      _swap16(&common->srcport);
+      _swap16(&common->dstport);
+      _swap16(&common->exporter_sysid);
+      _swap16(&common->reserved);
+      data = (char*)common->data;
+      if (ipv6) {
+        for (int i = 0; i < 4; ++i, data += sizeof(uint64_t))
+          _swap64(data);
+      }
+      else {
+        _swap32(data);
+        _swap32(data + sizeof(uint32_t));
+        data += addresses;
+      }
+      if (packets == sizeof(uint64_t))
+        _swap64(data);
+      else
+        _swap32(data);
+      data += packets;
+      if (bytes == sizeof(uint64_t))
+        _swap64(data);
+      else
+        _swap32(data);
+      data += bytes;
+      if (size == flow_size)
+        return 0;
+      return _swap_extensions(data, size - flow_size, ext_map, maps);
+    }
+    case ExtensionMapType:
+      // Map id, extension size and the extension ids, all 16 bit
+      if (maps != NULL && !to_native)
+        _add_map(maps, data, size);
+      for (size_t offset = sizeof(record_header_t); offset + sizeof(uint16_t) <= size; offset += sizeof(uint16_t))
+        _swap16(data + offset);
+      if (maps != NULL && to_native)
+        _add_map(maps, data, size);
+      return 0;
+    default:
+      return 1;
+  }
+}
+
+int record_parse_address(const char* text, uint64_t addr[2])
+{
+  // IPv4 or IPv6 text address into the nf_flow_t layout. Returns -1 when invalid.
+  struct in_addr v4;
+  unsigned char v6[16];
+  if (inet_pton(AF_INET, text, &v4) == 1) {
+    addr[0] = 0;
+    addr[1] = IPV4_MAPPED | ntohl(v4.s_addr);
+    return 0;
+  }
+  if (inet_pton(AF_INET6, text, v6) != 1)
+    return -1;
+  addr[0] = addr[1] = 0;
+  for (int i = 0; i < 8; ++i) {
+    addr[0] = (addr[0] << 8) | v6[i];
+    addr[1] = (addr[1] << 8) | v6[i + 8];
+  }
+  return 0;
+}
+
+const char* record_format_address(const uint64_t addr[2], char* text, const size_t size)
+{
+  if (addr[0] == 0 && (addr[1] >> 32) == 0xffff) {
+    struct in_addr v4;
+    v4.s_addr = htonl((uint32_t)addr[1]);
+    return inet_ntop(AF_INET, &v4, text, size);
+  }
+  unsigned char v6[16];
+  for (int i = 0; i < 8; ++i) {
+    v6[i] = addr[0] >> (56 - 8 * i);
+    v6[i + 8] = addr[1] >> (56 - 8 * i);
+  }
+  return inet_ntop(AF_INET6, v6, text, size);
+}
+
 nf_record_p record_new(const size_t size)
 {
   return (nf_record_p)calloc(1, sizeof(nf_record_t));
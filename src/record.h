@@ -33,6 +33,43 @@ typedef struct {
 } nf_record_t;
 typedef nf_record_t* nf_record_p;
 
+// Fields of a flow record, with IPv4 addresses mapped into IPv6
+typedef struct {
+  uint64_t first;  // msec
+  uint64_t last;   // msec
+  uint64_t srcaddr[2];
+  uint64_t dstaddr[2];
+  uint64_t packets;
+  uint64_t bytes;
+  uint16_t srcport;
+  uint16_t dstport;
+  uint16_t exporter;
+  uint8_t protocol;
+  uint8_t tcp_flags;
+  uint8_t tos;
+  uint8_t ipv6;
+} nf_flow_t;
+
+// Extension maps seen while swapping the records of a block, for the layout
+// of the extensions of the flows that refer to them
+#define RECORD_MAX_MAPS 64
+#define RECORD_MAX_EXTENSIONS 64
+typedef struct {
+  uint16_t id;
+  uint16_t count;
+  uint16_t extensions[RECORD_MAX_EXTENSIONS];
+} record_map_t;
+typedef struct {
+  int count;
+  record_map_t maps[RECORD_MAX_MAPS];
+} record_maps_t;
+
+extern int record_decode(const record_header_t* record, nf_flow_t* flow);
+extern int record_swap(record_header_t* record, const size_t available, const int to_native,
+                       record_maps_t* maps);
+extern int record_parse_address(const char* text, uint64_t addr[2]);
+extern const char* record_format_address(const uint64_t addr[2], char* text, const size_t size);
+
 extern nf_record_p record_new(const size_t size);
 extern nf_record_p record_copy(const nf_record_p record);
 extern void record_free(nf_record_p *record);
@@ -0,0 +1,351 @@
+/**
+ * \file sort.c
+ * \brief Sorting the records of a file by first seen time
+ *
+ * nfcapd writes flows as they end, so first seen times are interleaved
+ * within and across blocks. Sorted, each block covers a range of time
+ * after that of the block before it, which lets zone maps select fewer
+ * blocks, and the records compress better. The flows are sorted with a
+ * parallel radix sort over an index of the records, which is stable, so
+ * flows seen at the same time stay in the order they were.
+ *
+ * Other records (extension maps, exporters, ..) go in front of the flows,
+ * as the flows refer to them. Extension maps that are repeated are only
+ * kept once. A file in which a map is redefined can't be sorted, as the
+ * flows would no longer come after the right definition.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "utils.h"
+#include "compress.h"
+#include "record.h"
+#include "sort.h"
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+// Other records the index starts with room for
+#define MIN_OTHERS 16
+
+typedef struct {
+  uint64_t key;  // first seen in msec
+  const record_header_t* record;
+} _entry_t;
+
+typedef struct {
+  _entry_t* flows;
+  size_t flow_count;
+  size_t flow_capacity;
+  const record_header_t** others;
+  size_t other_count;
+  size_t other_capacity;
+  size_t size;  // of the records kept
+} _index_t;
+
+static void* _grow(void* array, size_t* capacity, const size_t item_size);
+static int _index_record(const record_header_t* record, void* context);
+static const record_header_t* _sorted_record(const _index_t* index, const size_t k);
+static nf_block_p _cut_block(const _index_t* index, size_t* next, const uint16_t id, const size_t limit);
+static int _known_map(const _index_t* index, const record_header_t* map);
+static int _radix_sort(_entry_t* entries, const size_t count);
+
+
+int sort_records(nf_file_p *file, const size_t block_size) {
+  // Sorts the records of the decompressed data blocks into new blocks of
+  // block_size, or of the size of the largest data block when 0. These
+  // replace the data blocks, after the other blocks.
+  nf_file_p fl = *file;
+  int first_data = -1;
+  size_t records = 0;
+  size_t largest = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    if (block->compression != compressed_none || block->header.id == COLUMNAR_BLOCK) {
+      msg(log_error, "Sorting needs decompressed blocks\n");
+      return -1;
+    }
+    if (block->foreign) {
+      msg(log_error, "Sorting needs records in native byte order\n");
+      return -1;
+    }
+    if (first_data < 0)
+      first_data = i;
+    else if (block->header.id != fl->blocks[first_data]->header.id) {
+      msg(log_error, "Can't sort records of different block types\n");
+      return -1;
+    }
+    records += block->header.NumRecords;
+    if (block->header.size > largest)
+      largest = block->header.size;
+  }
+  if (first_data < 0)
+    return 0;
+
+  // The block headers only give a first guess of the records; the index
+  // grows when there are more. Most are flows.
+  _index_t index = {NULL, 0, records, NULL, 0, MIN_OTHERS, 0};
+  nf_block_p* sorted = NULL;
+  int count = 0;
+  int capacity = 0;
+  index.flows = (_entry_t*)malloc(index.flow_capacity * sizeof(_entry_t) + 1);
+  index.others = (const record_header_t**)malloc(index.other_capacity * sizeof(record_header_t*));
+  if (index.flows == NULL || index.others == NULL) {
+    msg(log_error, "Failed to allocate record index\n");
+    goto failure;
+  }
+  for (int i = first_data; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (block_is_data(block) && block_for_each_record(block, &_index_record, &index) != 0)
+      goto failure;
+  }
+  if (_radix_sort(index.flows, index.flow_count) != 0)
+    goto failure;
+
+  // Blocks are cut from the index, while the records are still held by
+  // the blocks they came from
+  const uint16_t id = fl->blocks[first_data]->header.id;
+  const size_t limit = block_size > 0 ? block_size : largest;
+  size_t total = index.other_count + index.flow_count;
+  for (size_t next = 0; next < total; ++count) {
+    if (count == capacity) {
+      capacity = 2 * capacity + 16;
+      nf_block_p* grown = (nf_block_p*)realloc(sorted, capacity * sizeof(nf_block_p));
+      if (grown == NULL) {
+        msg(log_error, "Failed to allocate block list\n");
+        goto failure;
+      }
+      sorted = grown;
+    }
+    sorted[count] = _cut_block(&index, &next, id, limit);
+    if (sorted[count] == NULL)
+      goto failure;
+  }
+  msg(log_info, "Sorted %zu flows, after %zu other records, into %d blocks\n",
+      index.flow_count, index.other_count, count);
+  free(index.flows);
+  free(index.others);
+
+  for (int i = fl->header.NumBlocks - 1; i >= first_data; --i) {
+    if (block_is_data(fl->blocks[i])) {
+      nf_block_p block = file_remove_block(fl, i);
+      block_free(&block);
+    }
+  }
+  int i = 0;
+  for (; i < count; ++i) {
+    if (file_insert_block(file, (*file)->header.NumBlocks, sorted[i]) != 0)
+      break;
+  }
+  for (int j = i; j < count; ++j)
+    block_free(&sorted[j]);
+  free(sorted);
+  return i < count ? -1 : 0;
+failure:
+  free(index.flows);
+  free(index.others);
+  for (int i = 0; i < count; ++i)
+    block_free(&sorted[i]);
+  free(sorted);
+  return -1;
+}
+
+
+static const record_header_t* _sorted_record(const _index_t* index, const size_t k) {
+  // Other records first, then the flows
+  return k < index->other_count ? index->others[k] : index->flows[k - index->other_count].record;
+}
+
+
+static nf_block_p _cut_block(const _index_t* index, size_t* next, const uint16_t id, const size_t limit) {
+  // A block of the records from next on, up to limit bytes and at most
+  // what a block header can hold. Like file_reblock, keeps extension maps
+  // together with the record following them.
+  size_t total = index->other_count + index->flow_count;
+  size_t first = *next;
+  size_t size = 0;
+  for (; *next < total; ++*next) {
+    size_t record_size = _sorted_record(index, *next)->size;
+    if (size + record_size > UINT32_MAX)
+      break;
+    if (*next > first && size + record_size > limit
+        && _sorted_record(index, *next - 1)->type != ExtensionMapType)
+      break;
+    size += record_size;
+  }
+  nf_block_p block = block_new();
+  if (block == NULL || (block->data = (char*)malloc(size + 1)) == NULL) {
+    msg(log_error, "Failed to allocate block data\n");
+    block_free(&block);
+    return NULL;
+  }
+  char* data = block->data;
+  for (size_t k = first; k < *next; ++k) {
+    const record_header_t* record = _sorted_record(index, k);
+    memcpy(data, record, record->size);
+    data += record->size;
+  }
+  block->header.id = id;
+  block->header.size = size;
+  block->header.NumRecords = *next - first;
+  block->compressed_size = size;
+  block->uncompressed_size = size;
+  return block;
+}
+
+
+static void* _grow(void* array, size_t* capacity, const size_t item_size) {
+  // Doubles the room of an index array. Returns NULL, leaving it, on failure.
+  size_t grown_capacity = 2 * *capacity + MIN_OTHERS;
+  void* grown = realloc(array, grown_capacity * item_size);
+  if (grown == NULL) {
+    msg(log_error, "Failed to grow record index\n");
+    return NULL;
+  }
+  *capacity = grown_capacity;
+  return grown;
+}
+
+
+static int _index_record(const record_header_t* record, void* context) {
+  _index_t* index = (_index_t*)context;
+  nf_flow_t flow;
+  if (record_decode(record, &flow) == 0) {
+    if (index->flow_count == index->flow_capacity) {
+      _entry_t* grown = (_entry_t*)_grow(index->flows, &index->flow_capacity, sizeof(_entry_t));
+      if (grown == NULL)
+        return -1;
+      index->flows = grown;
+    }
+    index->flows[index->flow_count].key = flow.first;
+    index->flows[index->flow_count].record = record;
+    ++index->flow_count;
+  }
+  else {
+    if (record->type == ExtensionMapType) {
+      int known = _known_map(index, record);
+      if (known < 0)
+        return -1;
+      if (known)
+        return 0;
+    }
+    if (index->other_count == index->other_capacity) {
+      const record_header_t** grown = (const record_header_t**)_grow(
+          index->others, &index->other_capacity, sizeof(record_header_t*));
+      if (grown == NULL)
+        return -1;
+      index->others = grown;
+    }
+    index->others[index->other_count++] = record;
+  }
+  index->size += record->size;
+  return 0;
+}
+
+
+static int _known_map(const _index_t* index, const record_header_t* map) {
+  // Whether the same map was indexed before. Fails when it was defined
+  // differently.
+  uint16_t id;
+  if (map->size < sizeof(record_header_t) + sizeof(id)) {
+    msg(log_error, "Invalid extension map size: %u\n", map->size);
+    return -1;
+  }
+  memcpy(&id, map + 1, sizeof(id));
+  for (size_t i = 0; i < index->other_count; ++i) {
+    const record_header_t* other = index->others[i];
+    uint16_t other_id;
+    if (other->type != ExtensionMapType)
+      continue;
+    memcpy(&other_id, other + 1, sizeof(other_id));
+    if (other_id != id)
+      continue;
+    if (other->size == map->size && memcmp(other, map, map->size) == 0)
+      return 1;
+    msg(log_error, "Extension map %u is redefined, can't sort\n", id);
+    return -1;
+  }
+  return 0;
+}
+
+
+static int _radix_sort(_entry_t* entries, const size_t count) {
+  // Least significant byte first. Every pass counts the keys per bucket in
+  // a chunk of the entries for each thread, and then moves the entries to
+  // their bucket, the chunks in order. Only the bytes in which the keys
+  // differ from the smallest are sorted on.
+  if (count < 2)
+    return 0;
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+  #pragma omp parallel for reduction(min:min) reduction(max:max)
+  for (size_t i = 0; i < count; ++i) {
+    if (entries[i].key < min)
+      min = entries[i].key;
+    if (entries[i].key > max)
+      max = entries[i].key;
+  }
+#ifdef _OPENMP
+  const int chunks = omp_get_max_threads();
+#else
+  const int chunks = 1;
+#endif
+  _entry_t* buffer = (_entry_t*)malloc(count * sizeof(_entry_t));
+  size_t (*offsets)[RADIX_BUCKETS] = calloc(chunks, sizeof(*offsets));
+  if (buffer == NULL || offsets == NULL) {
+    msg(log_error, "Failed to allocate sort buffer\n");
+    free(buffer);
+    free(offsets);
+    return -1;
+  }
+
+  _entry_t* from = entries;
+  _entry_t* to = buffer;
+  for (int shift = 0; shift < 64 && (max - min) >> shift != 0; shift += RADIX_BITS) {
+    memset(offsets, 0, chunks * sizeof(*offsets));
+    #pragma omp parallel for
+    for (int c = 0; c < chunks; ++c) {
+      size_t end = count * (c + 1) / chunks;
+      for (size_t i = count * c / chunks; i < end; ++i)
+        ++offsets[c][((from[i].key - min) >> shift) & (RADIX_BUCKETS - 1)];
+    }
+    size_t offset = 0;
+    for (int b = 0; b < RADIX_BUCKETS; ++b) {
+      for (int c = 0; c < chunks; ++c) {
+        size_t bucket_count = offsets[c][b];
+        offsets[c][b] = offset;
+        offset += bucket_count;
+      }
+    }
+    #pragma omp parallel for
+    for (int c = 0; c < chunks; ++c) {
+      size_t end = count * (c + 1) / chunks;
+      for (size_t i = count * c / chunks; i < end; ++i)
+        to[offsets[c][((from[i].key - min) >> shift) & (RADIX_BUCKETS - 1)]++] = from[i];
+    }
+    _entry_t* swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != entries)
+    memcpy(entries, from, count * sizeof(_entry_t));
+  free(buffer);
+  free(offsets);
+  return 0;
+}
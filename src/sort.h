@@ -0,0 +1,30 @@
+/**
+ * \file sort.h
+ * \brief Sorting the records of a file by first seen time
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _SORT_H
+#define _SORT_H
+
+#include "file.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int sort_records(nf_file_p *file, const size_t block_size);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
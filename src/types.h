@@ -81,6 +81,12 @@ typedef struct data_block_header_s {
 #define DATA_BLOCK_TYPE_2       2
 #define Large_BLOCK_Type        3
 #define CATALOG_BLOCK           4
+// New block types introduced
+#define DICTIONARY_BLOCK        5	// compression dictionary for the data blocks after it
+#define ZONEMAP_BLOCK           6	// zone_map_t for each data block
+#define BLOOM_BLOCK             7	// bloom_filter_t, then an address filter for each data block
+#define COLUMNAR_BLOCK          8	// data block with the records stored per field
+#define CHECKSUM_BLOCK          9	// checksum_t for each block after it
 	uint16_t	flags;			// 0 - compatibility
 								// 1 - block uncompressed
 								// 2 - block compressed
@@ -106,8 +112,93 @@ typedef struct L_record_header_s {
     uint32_t    size;
 } L_record_header_t;
 
+// Header of the records in data blocks. Types as for L_record_header_t.
+typedef struct record_header_s {
+	uint16_t	type;
+	uint16_t	size;
+} record_header_t;
+
 // *** end of nffile.h defines and types
 
+// ** Defines and types from nfx.h
+typedef struct common_record_s {
+	// record head
+	uint16_t	type;
+	uint16_t	size;
+
+	// record meta data
+	uint16_t	flags;
+#define FLAG_IPV6_ADDR	1
+#define FLAG_PKG_64		2
+#define FLAG_BYTES_64	4
+	uint16_t	ext_map;
+
+	// netflow common record
+	uint16_t	msec_first;
+	uint16_t	msec_last;
+	uint32_t	first;
+	uint32_t	last;
+
+	uint8_t		fwd_status;
+	uint8_t		tcp_flags;
+	uint8_t		prot;
+	uint8_t		tos;
+	uint16_t	srcport;
+	uint16_t	dstport;
+
+	uint16_t	exporter_sysid;
+	uint16_t	reserved;
+
+	// link to extensions: IP addresses, packets and bytes, then the
+	// extensions of ext_map
+	uint32_t	data[1];
+} common_record_t;
+
+// *** end of nfx.h defines and types
+
+// Per data block summary, stored in a ZONEMAP_BLOCK
+typedef struct zone_map_s {
+	uint64_t	first;				// earliest first seen in msec
+	uint64_t	last;				// latest last seen in msec
+	uint16_t	srcport_min;
+	uint16_t	srcport_max;
+	uint16_t	dstport_min;
+	uint16_t	dstport_max;
+	uint16_t	exporter_min;
+	uint16_t	exporter_max;
+	uint32_t	flows;				// number of flow records
+	uint32_t	others;				// number of other records (extension maps, exporters, ..)
+	uint32_t	fill;
+	uint8_t		protocols[32];		// bitmap of protocols
+} zone_map_t;
+
+// Header of a BLOOM_BLOCK. The filters of all data blocks have the same size.
+typedef struct bloom_filter_s {
+	uint32_t	bits;				// per filter, a power of 2
+	uint32_t	hashes;				// bits set per address
+} bloom_filter_t;
+
+// Header of a COLUMNAR_BLOCK. It's followed by a column_header_t for each
+// column, and then by the (compressed) columns themselves.
+typedef struct columnar_header_s {
+	uint16_t	id;					// of the block the records came from
+	uint16_t	columns;
+	uint32_t	flows;				// number of records in the flow columns
+} columnar_header_t;
+
+typedef struct column_header_s {
+	uint32_t	size;				// stored
+	uint32_t	uncompressed_size;
+} column_header_t;
+
+// Entry of a CHECKSUM_BLOCK
+typedef struct checksum_s {
+	uint32_t	stored;				// CRC32C of the block header and data as stored
+	uint32_t	content;			// CRC32C of the decompressed records (data blocks)
+	uint16_t	id;					// of the block
+	uint16_t	fill;
+} checksum_t;
+
 typedef enum {
   compressed_none, 
   compressed_lzo,
@@ -9,35 +9,62 @@
  * terms of the BSD license. See the LICENSE file for details.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "types.h"
 #include "utils.h"
 
-void msg(log_level_t log_level, const char *message, ...)
+log_level_t log_level = log_info;
+
+void log_message(log_level_t level, const char *message, ...)
 {
+  // Formatted per thread and written with a single write, so threads
+  // neither wait for each other nor get their lines mixed up.
+  static __thread char text[MAX_LOG_MESSAGE];
   va_list args;
   va_start(args, message);
-  switch (log_level) {
-    case (log_debug):
-#ifdef DEBUG
-      #pragma omp critical
-      vfprintf(stderr, message, args);
-#endif
-      break;
-    case (log_info):
-      #pragma omp critical
-      vfprintf(stderr, message, args);
-      break;
-    case (log_error):
-      #pragma omp critical
-      vfprintf(stderr, message, args);
-      break;
-     default:
-      #pragma omp critical
-      fprintf(stderr, "Unknown loglevel\n");
-  }
+  int len = vsnprintf(text, sizeof(text), message, args);
   va_end(args);
+  if (len < 0)
+    return;
+  if (len >= (int)sizeof(text))
+    len = sizeof(text) - 1;
+  const char* data = text;
+  while (len > 0) {
+    ssize_t written = write(STDERR_FILENO, data, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    data += written;
+    len -= written;
+  }
 }
 
+
+size_t parse_size(const char *text)
+{
+  // Number of bytes with an optional k, M or G suffix. Returns 0 when invalid.
+  char *end = NULL;
+  size_t size = strtoul(text, &end, 10);
+  switch (*end) {
+    case 'G': case 'g':
+      size *= 1024;
+      // fall through
+    case 'M': case 'm':
+      size *= 1024;
+      // fall through
+    case 'K': case 'k':
+      size *= 1024;
+      ++end;
+      break;
+  }
+  return end == text || *end != '\0' ? 0 : size;
+}
@@ -12,13 +12,28 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef enum { log_debug, log_info, log_error } log_level_t;
 
-extern void msg(log_level_t log_level, const char *message, ...);
+// Messages below this level are dropped before their arguments are evaluated
+extern log_level_t log_level;
+
+#define msg(level, ...) \
+  do { \
+    if ((level) >= log_level) \
+      log_message((level), __VA_ARGS__); \
+  } while (0)
+
+// Longer messages are truncated
+#define MAX_LOG_MESSAGE 4096
+
+extern void log_message(log_level_t level, const char *message, ...);
+extern size_t parse_size(const char *text);
 
 #ifdef __cplusplus
 }  // extern "C"
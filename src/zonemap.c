@@ -0,0 +1,301 @@
+/**
+ * \file zonemap.c
+ * \brief Per block zone map functions
+ *
+ * A ZONEMAP_BLOCK in front of the data blocks holds a zone_map_t for each
+ * data block, in the order of the data blocks. It summarizes the flow
+ * records in the block, so readers can skip blocks that can't match a
+ * predicate without reading or decompressing them.
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "record.h"
+#include "compress.h"
+#include "zonemap.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+static void _zone_init(zone_map_t* zone);
+static void _zone_widen(zone_map_t* zone);
+static int _zone_add_record(const record_header_t* record, void* context);
+static int _is_flow(const record_header_t* record);
+static int _add_other(const record_header_t* record, void* context);
+
+typedef struct {
+  char* data;
+  size_t size;
+  size_t capacity;
+} _others_t;
+
+
+void zonemap_predicate_init(zone_predicate_t* predicate) {
+  predicate->first = 0;
+  predicate->last = UINT64_MAX;
+  predicate->protocol = -1;
+  predicate->port = -1;
+  predicate->srcport = -1;
+  predicate->dstport = -1;
+  predicate->exporter = -1;
+}
+
+
+int zonemap_build(nf_file_p *file) {
+  nf_file_p fl = *file;
+  zonemap_remove(fl);
+
+  int data_blocks = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    nf_block_p block = fl->blocks[i];
+    if (!block_is_data(block))
+      continue;
+    if (block->compression != compressed_none) {
+      msg(log_error, "Zone maps need decompressed blocks\n");
+      return -1;
+    }
+    ++data_blocks;
+  }
+
+  nf_block_p zonemap = block_new();
+  size_t size = data_blocks * sizeof(zone_map_t);
+  if (zonemap == NULL || (zonemap->data = (char*)malloc(size)) == NULL) {
+    msg(log_error, "Failed to allocate zone map\n");
+    block_free(&zonemap);
+    return -1;
+  }
+
+  nf_block_p* blocks = (nf_block_p*)malloc(data_blocks * sizeof(nf_block_p));
+  if (blocks == NULL) {
+    msg(log_error, "Failed to allocate zone map\n");
+    block_free(&zonemap);
+    return -1;
+  }
+  int data_block = 0;
+  for (int i = 0; i < fl->header.NumBlocks; ++i) {
+    if (block_is_data(fl->blocks[i]))
+      blocks[data_block++] = fl->blocks[i];
+  }
+
+  zone_map_t* zones = (zone_map_t*)zonemap->data;
+  int result = 0;
+  #pragma omp parallel for reduction(|:result)
+  for (int i = 0; i < data_blocks; ++i) {
+    _zone_init(&zones[i]);
+    if (block_for_each_record(blocks[i], &_zone_add_record, &zones[i]) != 0)
+      result = -1;
+  }
+  free(blocks);
+  if (result != 0) {
+    msg(log_error, "Failed to build zone map\n");
+    block_free(&zonemap);
+    return -1;
+  }
+
+  zonemap->header.id = ZONEMAP_BLOCK;
+  zonemap->header.NumRecords = data_blocks;
+  zonemap->header.size = size;
+  zonemap->compressed_size = size;
+  zonemap->uncompressed_size = size;
+  if (file_insert_block(file, 0, zonemap) != 0) {
+    block_free(&zonemap);
+    return -1;
+  }
+  msg(log_debug, "Built zone map for %d blocks\n", data_blocks);
+  return 0;
+}
+
+
+void zonemap_remove(nf_file_p file) {
+  int index = file_find_block(file, ZONEMAP_BLOCK);
+  if (index < 0)
+    return;
+  nf_block_p zonemap = file_remove_block(file, index);
+  block_free(&zonemap);
+}
+
+
+int zonemap_match(const zone_map_t* zone, const zone_predicate_t* predicate) {
+  if (zone->flows == 0)
+    return 0;
+  if (zone->last < predicate->first || zone->first > predicate->last)
+    return 0;
+  if (predicate->protocol >= 0
+      && !(zone->protocols[(predicate->protocol & 0xff) >> 3] & (1 << (predicate->protocol & 7))))
+    return 0;
+  if (predicate->srcport >= 0
+      && (predicate->srcport < zone->srcport_min || predicate->srcport > zone->srcport_max))
+    return 0;
+  if (predicate->dstport >= 0
+      && (predicate->dstport < zone->dstport_min || predicate->dstport > zone->dstport_max))
+    return 0;
+  if (predicate->port >= 0
+      && (predicate->port < zone->srcport_min || predicate->port > zone->srcport_max)
+      && (predicate->port < zone->dstport_min || predicate->port > zone->dstport_max))
+    return 0;
+  if (predicate->exporter >= 0
+      && (predicate->exporter < zone->exporter_min || predicate->exporter > zone->exporter_max))
+    return 0;
+  return 1;
+}
+
+
+int zonemap_select(const nf_file_p file, const zone_predicate_t* predicate, int* selected) {
+  // Mark the blocks of file that may hold matching records. Without a zone
+  // map, or when it doesn't fit the blocks, all data blocks are selected.
+  // Other blocks still give their records that aren't flows, as selected
+  // flows may refer to them. A NULL predicate matches no flows.
+  int index = file_find_block(file, ZONEMAP_BLOCK);
+  const zone_map_t* zones = NULL;
+  int zone_count = 0;
+  if (index >= 0 && file->blocks[index]->data != NULL) {
+    zones = (const zone_map_t*)file->blocks[index]->data;
+    zone_count = file->blocks[index]->header.size / sizeof(zone_map_t);
+  }
+  int data_blocks = 0;
+  for (int i = 0; i < file->header.NumBlocks; ++i) {
+    if (block_is_data(file->blocks[i]))
+      ++data_blocks;
+  }
+  if (zone_count != data_blocks) {
+    if (zones != NULL)
+      msg(log_info, "Zone map doesn't match data blocks, ignoring it\n");
+    zones = NULL;
+  }
+
+  int count = 0;
+  int data_block = 0;
+  for (int i = 0; i < file->header.NumBlocks; ++i) {
+    selected[i] = 0;
+    if (!block_is_data(file->blocks[i]))
+      continue;
+    if (predicate != NULL && (zones == NULL || zonemap_match(&zones[data_block], predicate)))
+      selected[i] = ZONE_SELECTED;
+    else if (zones == NULL || zones[data_block].others > 0)
+      selected[i] = ZONE_OTHERS;
+    if (selected[i] != ZONE_SKIPPED)
+      ++count;
+    ++data_block;
+  }
+  return count;
+}
+
+
+size_t zonemap_other_records(const char* data, const size_t size, char* others) {
+  // Copies the records of decompressed block data that aren't flows, and
+  // returns their size. others has to fit size bytes.
+  size_t offset = 0;
+  size_t others_size = 0;
+  while (offset + sizeof(record_header_t) <= size) {
+    const record_header_t* record = (const record_header_t*)(data + offset);
+    if (record->size < sizeof(record_header_t) || offset + record->size > size)
+      break;
+    if (!_is_flow(record)) {
+      memcpy(others + others_size, record, record->size);
+      others_size += record->size;
+    }
+    offset += record->size;
+  }
+  return others_size;
+}
+
+
+int zonemap_block_others(const nf_block_p block, char** others, size_t* size) {
+  // Copies the records of a data block that aren't flows into a newly
+  // allocated buffer, decompressing the block a window at a time
+  _others_t collected = { NULL, 0, 0 };
+  if (decompress_for_each_record(block, &_add_other, &collected) != 0) {
+    free(collected.data);
+    return -1;
+  }
+  *others = collected.data;
+  *size = collected.size;
+  return 0;
+}
+
+
+static int _add_other(const record_header_t* record, void* context) {
+  _others_t* others = (_others_t*)context;
+  if (_is_flow(record))
+    return 0;
+  if (others->size + record->size > others->capacity) {
+    size_t capacity = 2 * others->capacity + record->size;
+    char* data = (char*)realloc(others->data, capacity);
+    if (data == NULL) {
+      msg(log_error, "Failed to allocate other records\n");
+      return -1;
+    }
+    others->data = data;
+    others->capacity = capacity;
+  }
+  memcpy(others->data + others->size, record, record->size);
+  others->size += record->size;
+  return 0;
+}
+
+
+static void _zone_init(zone_map_t* zone) {
+  memset(zone, 0, sizeof(zone_map_t));
+  zone->first = UINT64_MAX;
+  zone->srcport_min = UINT16_MAX;
+  zone->dstport_min = UINT16_MAX;
+  zone->exporter_min = UINT16_MAX;
+}
+
+
+static void _zone_widen(zone_map_t* zone) {
+  // For flows that can't be decoded: the zone has to match anything
+  zone->first = 0;
+  zone->last = UINT64_MAX;
+  zone->srcport_min = 0;
+  zone->srcport_max = UINT16_MAX;
+  zone->dstport_min = 0;
+  zone->dstport_max = UINT16_MAX;
+  zone->exporter_min = 0;
+  zone->exporter_max = UINT16_MAX;
+  memset(zone->protocols, 0xff, sizeof(zone->protocols));
+}
+
+
+static int _is_flow(const record_header_t* record) {
+  // As counted in the zone map
+  nf_flow_t flow;
+  return record->type == CommonRecordV0Type || record_decode(record, &flow) == 0;
+}
+
+
+static int _zone_add_record(const record_header_t* record, void* context) {
+  zone_map_t* zone = (zone_map_t*)context;
+  nf_flow_t flow;
+  if (record->type == CommonRecordV0Type) {
+    _zone_widen(zone);
+    ++zone->flows;
+    return 0;
+  }
+  if (record_decode(record, &flow) != 0) {
+    ++zone->others;
+    return 0;
+  }
+  ++zone->flows;
+  zone->first = min(zone->first, flow.first);
+  zone->last = max(zone->last, flow.last);
+  zone->srcport_min = min(zone->srcport_min, flow.srcport);
+  zone->srcport_max = max(zone->srcport_max, flow.srcport);
+  zone->dstport_min = min(zone->dstport_min, flow.dstport);
+  zone->dstport_max = max(zone->dstport_max, flow.dstport);
+  zone->exporter_min = min(zone->exporter_min, flow.exporter);
+  zone->exporter_max = max(zone->exporter_max, flow.exporter);
+  zone->protocols[flow.protocol >> 3] |= 1 << (flow.protocol & 7);
+  return 0;
+}
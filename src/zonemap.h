@@ -0,0 +1,53 @@
+/**
+ * \file zonemap.h
+ * \brief Per block zone map functions
+ *
+ * \author J.R.Versteegh <j.r.versteegh@orca-st.com>
+ *
+ * \copyright
+ * (C) 2017 Jaap Versteegh. All rights reserved.
+ * (C) 2017 SURFnet. All rights reserved.
+ * \license
+ * This software may be modified and distributed under the
+ * terms of the BSD license. See the LICENSE file for details.
+ */
+
+#ifndef _ZONEMAP_H
+#define _ZONEMAP_H
+
+#include "file.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Predicate on flow records. Ports, protocol and exporter of -1 match any.
+typedef struct {
+  uint64_t first;  // msec
+  uint64_t last;   // msec
+  int protocol;
+  int port;        // either source or destination port
+  int srcport;
+  int dstport;
+  int exporter;
+} zone_predicate_t;
+
+// Selection of a data block by zonemap_select
+#define ZONE_SKIPPED 0
+#define ZONE_SELECTED 1
+#define ZONE_OTHERS 2  // only its extension maps, exporters, .., which flows refer to
+
+extern void zonemap_predicate_init(zone_predicate_t* predicate);
+
+extern int zonemap_build(nf_file_p *file);
+extern void zonemap_remove(nf_file_p file);
+extern int zonemap_match(const zone_map_t* zone, const zone_predicate_t* predicate);
+extern int zonemap_select(const nf_file_p file, const zone_predicate_t* predicate, int* selected);
+extern size_t zonemap_other_records(const char* data, const size_t size, char* others);
+extern int zonemap_block_others(const nf_block_p block, char** others, size_t* size);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
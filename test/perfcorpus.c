@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "file.h"
+#include "compress.h"
+#include "utils.h"
+
+// Writes copies of the records of an nfdump file to a new file, in blocks
+// of 4 MB or the size given. Every copy has its flows one second later, and
+// their addresses one higher, than the copy before it, so that the corpus
+// doesn't compress far better than real flows do.
+
+#define CORPUS_BLOCK_SIZE (4 * 1024 * 1024)
+
+static int shift_record(const record_header_t* record, void* context)
+{
+  const uint32_t shift = *(const uint32_t*)context;
+  if (record->type != CommonRecordType)
+    return 0;
+  common_record_t* common = (common_record_t*)record;
+  common->first += shift;
+  common->last += shift;
+  char* data = (char*)common->data;
+  if (common->flags & FLAG_IPV6_ADDR) {
+    for (int i = 0; i < 2; ++i) {
+      uint64_t addr;
+      memcpy(&addr, data + (2 * i + 1) * sizeof(uint64_t), sizeof(addr));
+      addr += shift;
+      memcpy(data + (2 * i + 1) * sizeof(uint64_t), &addr, sizeof(addr));
+    }
+  }
+  else {
+    uint32_t addr[2];
+    memcpy(addr, data, sizeof(addr));
+    addr[0] += shift;
+    addr[1] += shift;
+    memcpy(data, addr, sizeof(addr));
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  size_t block_size = argc == 5 ? parse_size(argv[4]) : CORPUS_BLOCK_SIZE;
+  if (argc < 4 || argc > 5 || atoi(argv[3]) < 1 || block_size == 0) {
+    fprintf(stderr, "Usage: perfcorpus <nfdump file> <corpus file> <copies> [<block size>]\n");
+    return -1;
+  }
+  const int copies = atoi(argv[3]);
+  log_level = log_error;
+  nf_file_p fl = file_load(argv[1], &decompressor);
+  if (fl == NULL)
+    return -1;
+  const int blocks = fl->header.NumBlocks;
+  for (uint32_t shift = 1; shift < (uint32_t)copies; ++shift) {
+    for (int i = 0; i < blocks; ++i) {
+      nf_block_p block = fl->blocks[i];
+      if (!block_is_data(block))
+        continue;
+      nf_block_p copy = block_new();
+      if (copy == NULL || (copy->data = (char*)malloc(block->header.size)) == NULL) {
+        fprintf(stderr, "Failed to allocate copy of block\n");
+        return -1;
+      }
+      copy->header = block->header;
+      copy->compressed_size = block->header.size;
+      copy->uncompressed_size = block->header.size;
+      memcpy(copy->data, block->data, block->header.size);
+      if (block_for_each_record(copy, &shift_record, &shift) != 0
+          || file_insert_block(&fl, fl->header.NumBlocks, copy) != 0)
+        return -1;
+    }
+  }
+  fl->stats.last_seen += copies - 1;
+  int result = file_reblock(&fl, block_size) == 0 && file_save_as(fl, argv[2]) == 0 ? 0 : -1;
+  file_free(&fl);
+  return result;
+}
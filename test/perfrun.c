@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+// Runs a command and appends its wall clock seconds and peak RSS in KiB to
+// a file. Exits with the status of the command.
+int main(int argc, char* argv[])
+{
+  if (argc < 3) {
+    fprintf(stderr, "Usage: perfrun <measurements file> <command> [<arguments>]\n");
+    return -1;
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    execvp(argv[2], &argv[2]);
+    perror(argv[2]);
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid) {
+    perror("wait4");
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  FILE* f = fopen(argv[1], "a");
+  if (f == NULL) {
+    perror(argv[1]);
+    return -1;
+  }
+  fprintf(f, "%.6f %ld\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9,
+          usage.ru_maxrss);
+  fclose(f);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -1,4 +1,14 @@
 #include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+#include <cstddef>
+#include <cstring>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <cppunit/TestCase.h>
 #include <cppunit/extensions/HelperMacros.h>
@@ -6,9 +16,24 @@
 
 #include <file.h>
 #include <compress.h>
+#include <checksum.h>
+#include <sort.h>
+#include <nftools.hpp>
 
 const char *test_data_dir = NULL;
 
+// Times each block was handled
+static int handled[64];
+static void count_block(const int blocknum, nf_block_p block) {
+  #pragma omp atomic
+  ++handled[blocknum];
+}
+
+static int count_record(const record_header_t* record, void* context) {
+  ++*(size_t*)context;
+  return 0;
+}
+
 class FileTest : public CppUnit::TestCase
 {
   void test_file_open() {
@@ -20,6 +45,185 @@ class FileTest : public CppUnit::TestCase
     CPPUNIT_ASSERT(file);
     file_free(&file);
   }
+  void test_validate_records() {
+    std::string filename = test_data_dir;
+    filename += "/";
+    filename += "nfcapd.test2";
+
+    nf_file_t *file = file_load(filename.c_str(), &decompressor);
+    CPPUNIT_ASSERT(file);
+    nf_block_p block = file->blocks[0];
+    CPPUNIT_ASSERT(block->status == 0);
+    CPPUNIT_ASSERT(block_validate(block) == 0);
+    block->header.NumRecords++;
+    CPPUNIT_ASSERT(block_validate(block) != 0);
+    block->header.NumRecords--;
+    record_header_t* record = (record_header_t*)block->data;
+    record->size += 4;
+    CPPUNIT_ASSERT(block_validate(block) != 0);
+    record->size = 0;
+    CPPUNIT_ASSERT(block_validate(block) != 0);
+    file_free(&file);
+  }
+  // Writes the file as a machine of the other byte order would
+  void write_foreign(const nf_file_t* file, const char* filename) {
+    FILE* f = fopen(filename, "wb");
+    CPPUNIT_ASSERT(f);
+    file_header_t header = file->header;
+    header.magic = __builtin_bswap16(header.magic);
+    header.version = __builtin_bswap16(header.version);
+    header.flags = __builtin_bswap32(header.flags);
+    header.NumBlocks = __builtin_bswap32(header.NumBlocks);
+    stat_record_t stats = file->stats;
+    for (uint64_t* counter = &stats.numflows; counter <= &stats.numpackets_other; ++counter)
+      *counter = __builtin_bswap64(*counter);
+    stats.first_seen = __builtin_bswap32(stats.first_seen);
+    stats.last_seen = __builtin_bswap32(stats.last_seen);
+    stats.msec_first = __builtin_bswap16(stats.msec_first);
+    stats.msec_last = __builtin_bswap16(stats.msec_last);
+    stats.sequence_failure = __builtin_bswap32(stats.sequence_failure);
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(&stats, sizeof(stats), 1, f);
+    for (int i = 0; i < file->header.NumBlocks; ++i) {
+      nf_block_t block = *file->blocks[i];
+      block.data = (char*)malloc(block.header.size);
+      memcpy(block.data, file->blocks[i]->data, block.header.size);
+      CPPUNIT_ASSERT(block_swap_records(&block, 0) == 0);
+      block.header.NumRecords = __builtin_bswap32(block.header.NumRecords);
+      block.header.size = __builtin_bswap32(block.header.size);
+      block.header.id = __builtin_bswap16(block.header.id);
+      block.header.flags = __builtin_bswap16(block.header.flags);
+      fwrite(&block.header, sizeof(block.header), 1, f);
+      fwrite(block.data, file->blocks[i]->header.size, 1, f);
+      free(block.data);
+    }
+    fclose(f);
+  }
+  void test_foreign_byte_order() {
+    std::string filename = test_data_dir;
+    filename += "/";
+    filename += "nfcapd.test2";
+
+    nf_file_t *file = file_load(filename.c_str(), &decompressor);
+    CPPUNIT_ASSERT(file);
+    write_foreign(file, "test.temp.foreign");
+    nf_file_t *foreign = file_load("test.temp.foreign", &decompressor);
+    CPPUNIT_ASSERT(foreign);
+    CPPUNIT_ASSERT(foreign->foreign);
+    CPPUNIT_ASSERT(foreign->header.NumBlocks == file->header.NumBlocks);
+    nf_block_p block = foreign->blocks[0];
+    CPPUNIT_ASSERT(block->foreign == 0);
+    CPPUNIT_ASSERT(block->header.size == file->blocks[0]->header.size);
+    CPPUNIT_ASSERT(memcmp(block->data, file->blocks[0]->data, block->header.size) == 0);
+    // Saved in native order, the original comes back
+    CPPUNIT_ASSERT(file_save_as(foreign, "test.temp.native") == 0);
+    file_free(&foreign);
+    std::ifstream original(filename.c_str(), std::ios::binary);
+    std::ifstream native("test.temp.native", std::ios::binary);
+    std::string original_data((std::istreambuf_iterator<char>(original)), std::istreambuf_iterator<char>());
+    std::string native_data((std::istreambuf_iterator<char>(native)), std::istreambuf_iterator<char>());
+    CPPUNIT_ASSERT(original_data == native_data);
+    file_free(&file);
+  }
+  void test_foreign_reblock() {
+    std::string filename = test_data_dir;
+    filename += "/";
+    filename += "nfcapd.test2";
+
+    nf_file_t *file = file_load(filename.c_str(), &decompressor);
+    CPPUNIT_ASSERT(file);
+    write_foreign(file, "test.temp.foreign");
+    file_free(&file);
+    // Fully converted records can be re-blocked, ..
+    nf_file_t *foreign = file_load("test.temp.foreign", &decompressor);
+    CPPUNIT_ASSERT(foreign);
+    CPPUNIT_ASSERT(file_reblock(&foreign, 1024) == 0);
+    CPPUNIT_ASSERT(foreign->header.NumBlocks > 1);
+    file_free(&foreign);
+    // .. partly converted ones not
+    foreign = file_load("test.temp.foreign", &decompressor);
+    CPPUNIT_ASSERT(foreign);
+    foreign->blocks[0]->foreign = 2;
+    CPPUNIT_ASSERT(file_reblock(&foreign, 1024) != 0);
+    CPPUNIT_ASSERT(sort_records(&foreign, 0) != 0);
+    file_free(&foreign);
+  }
+  void test_foreign_extensions() {
+    // A map of the SNMP 2 and next hop IPv4 extensions, a flow of that map
+    // and one of an unknown map
+    const size_t flow_size = offsetof(common_record_t, data) + 4 * sizeof(uint32_t) + 8;
+    const size_t size = 16 + 2 * flow_size;
+    std::vector<char> data(size);
+    uint16_t map[] = { ExtensionMapType, 16, 3, 8, 4, 9, 0, 0 };
+    memcpy(&data[0], map, sizeof(map));
+    for (int i = 0; i < 2; ++i) {
+      common_record_t* flow = (common_record_t*)&data[16 + i * flow_size];
+      flow->type = CommonRecordType;
+      flow->size = flow_size;
+      flow->ext_map = i == 0 ? 3 : 7;
+      uint16_t snmp[] = { 0x0102, 0x0304 };
+      uint32_t next_hop = 0x05060708;
+      memcpy((char*)flow->data + 4 * sizeof(uint32_t), snmp, sizeof(snmp));
+      memcpy((char*)flow->data + 5 * sizeof(uint32_t), &next_hop, sizeof(next_hop));
+    }
+    nf_block_t block;
+    memset(&block, 0, sizeof(block));
+    block.header.size = size;
+    block.data = &data[0];
+    std::vector<char> original(data);
+    CPPUNIT_ASSERT(block_swap_records(&block, 0) == 1);
+    const size_t extensions = 16 + offsetof(common_record_t, data) + 4 * sizeof(uint32_t);
+    uint16_t input;
+    memcpy(&input, &data[extensions], sizeof(input));
+    CPPUNIT_ASSERT(input == 0x0201);
+    uint32_t next_hop;
+    memcpy(&next_hop, &data[extensions + 4], sizeof(next_hop));
+    CPPUNIT_ASSERT(next_hop == 0x08070605);
+    // The flow of the unknown map keeps its extensions as they were
+    CPPUNIT_ASSERT(memcmp(&data[extensions + flow_size], &original[extensions + flow_size], 8) == 0);
+    CPPUNIT_ASSERT(block_swap_records(&block, 1) == 1);
+    CPPUNIT_ASSERT(data == original);
+  }
+  void test_sort_more_records() {
+    // Blocks can hold more records than their headers say
+    std::string filename = test_data_dir;
+    filename += "/";
+    filename += "nfcapd.test2";
+
+    nf_file_t *file = file_load(filename.c_str(), &decompressor);
+    CPPUNIT_ASSERT(file);
+    CPPUNIT_ASSERT(file_reblock(&file, 1024) == 0);
+    size_t records = 0;
+    for (int i = 0; i < file->header.NumBlocks; ++i) {
+      if (!block_is_data(file->blocks[i]))
+        continue;
+      records += file->blocks[i]->header.NumRecords;
+      file->blocks[i]->header.NumRecords = 1;
+    }
+    CPPUNIT_ASSERT(sort_records(&file, 0) == 0);
+    size_t sorted = 0;
+    for (int i = 0; i < file->header.NumBlocks; ++i) {
+      if (block_is_data(file->blocks[i]))
+        sorted += file->blocks[i]->header.NumRecords;
+    }
+    CPPUNIT_ASSERT(sorted == records);
+    file_free(&file);
+  }
+  void test_blocks_on_nodes() {
+    std::string filename = test_data_dir;
+    filename += "/";
+    filename += "nfcapd.test2";
+
+    nf_file_t *file = file_load(filename.c_str(), &decompressor);
+    CPPUNIT_ASSERT(file);
+    CPPUNIT_ASSERT(file_reblock(&file, 1024) == 0);
+    CPPUNIT_ASSERT(file->header.NumBlocks > 2 && file->header.NumBlocks <= 64);
+    memset(handled, 0, sizeof(handled));
+    CPPUNIT_ASSERT(file_for_each_block_on_nodes(file, &count_block, 2) == 0);
+    for (int i = 0; i < file->header.NumBlocks; ++i)
+      CPPUNIT_ASSERT(handled[i] == 1);
+    file_free(&file);
+  }
   void test_decompress_lzo() {
     std::string filename = test_data_dir; 
     filename += "/"; 
@@ -34,11 +238,222 @@ class FileTest : public CppUnit::TestCase
 public:
   CPPUNIT_TEST_SUITE(FileTest);
   CPPUNIT_TEST(test_file_open);
+  CPPUNIT_TEST(test_validate_records);
+  CPPUNIT_TEST(test_foreign_byte_order);
+  CPPUNIT_TEST(test_foreign_reblock);
+  CPPUNIT_TEST(test_foreign_extensions);
+  CPPUNIT_TEST(test_sort_more_records);
+  CPPUNIT_TEST(test_blocks_on_nodes);
   CPPUNIT_TEST(test_decompress_lzo);
   CPPUNIT_TEST_SUITE_END();
 };
 
 
+class CompressTest : public CppUnit::TestCase
+{
+  nf_block_p make_block(const size_t size) {
+    nf_block_p block = block_new();
+    block->header.id = DATA_BLOCK_TYPE_2;
+    block->header.size = size;
+    block->uncompressed_size = size;
+    block->data = (char*)malloc(size);
+    srand(size);
+    for (size_t i = 0; i < size; ++i)
+      block->data[i] = (char)(rand() % 16);
+    return block;
+  }
+
+  void roundtrip(const compression_t compression) {
+    const size_t size = 3 * 1024 * 1024;
+    nf_block_p block = make_block(size);
+    nf_block_p original = make_block(size);
+    CPPUNIT_ASSERT(compress(block, compression) == 0);
+    CPPUNIT_ASSERT(block->compression == compression);
+    CPPUNIT_ASSERT(decompress(block) == 0);
+    CPPUNIT_ASSERT(block->header.size == size);
+    CPPUNIT_ASSERT(memcmp(block->data, original->data, size) == 0);
+    block_free(&block);
+    block_free(&original);
+  }
+
+  void test_compress_mt() {
+    // Split up for 4 threads, whatever OMP_NUM_THREADS says
+    size_t threshold = mt_threshold;
+    mt_threshold = 1024 * 1024;
+#ifdef _OPENMP
+    int threads = omp_get_max_threads();
+    omp_set_num_threads(4);
+    nf_block_p block = make_block(3 * 1024 * 1024);
+    CPPUNIT_ASSERT(compress(block, compressed_bz2) == 0);
+    // Stream header and block magic
+    const char stream[] = "BZh9\x31\x41\x59\x26\x53\x59";
+    int streams = 0;
+    for (size_t i = 0; i + sizeof(stream) - 1 <= block->header.size; ++i)
+      streams += memcmp(block->data + i, stream, sizeof(stream) - 1) == 0;
+    CPPUNIT_ASSERT(streams > 1);
+    block_free(&block);
+#endif
+    roundtrip(compressed_bz2);
+    roundtrip(compressed_lzma);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    mt_threshold = threshold;
+  }
+
+  void test_decompress_high_ratio() {
+    // Runs of 1 KiB of the same byte go beyond the 256x that LZ4 and LZO
+    // blocks decompress to, but not beyond the 1024x of BZ2 and LZMA
+    const size_t size = 4 * 1024 * 1024;
+    const compression_t compressions[] = { compressed_bz2, compressed_lzma };
+    for (int c = 0; c < 2; ++c) {
+      nf_block_p block = make_block(size);
+      srand(size);
+      for (size_t i = 0; i < size; i += 1024)
+        memset(block->data + i, rand() % 256, 1024);
+      CPPUNIT_ASSERT(compress(block, compressions[c]) == 0);
+      CPPUNIT_ASSERT(block->header.size * 256 < size);
+      CPPUNIT_ASSERT(decompress(block) == 0);
+      CPPUNIT_ASSERT(block->header.size == size);
+      block_free(&block);
+    }
+  }
+
+  void test_decompress_records() {
+    // Beyond 1024x a whole block doesn't decompress, but its records are
+    // walked a window at a time. They straddle the windows.
+    const size_t count = 4 * 1024 * 1024 / 12;
+    nf_block_p block = block_new();
+    block->header.id = DATA_BLOCK_TYPE_2;
+    block->header.size = count * 12;
+    block->header.NumRecords = count;
+    block->data = (char*)calloc(count, 12);
+    for (size_t i = 0; i < count; ++i) {
+      record_header_t* record = (record_header_t*)(block->data + 12 * i);
+      record->type = CommonRecordType;
+      record->size = 12;
+    }
+    CPPUNIT_ASSERT(compress(block, compressed_lzma) == 0);
+    CPPUNIT_ASSERT(block->header.size * 1024 < count * 12);
+    size_t records = 0;
+    CPPUNIT_ASSERT(decompress_for_each_record(block, &count_record, &records) == 0);
+    CPPUNIT_ASSERT(records == count);
+    CPPUNIT_ASSERT(decompress(block) != 0);
+    block_free(&block);
+  }
+
+  void test_decompress_lz4_high_ratio() {
+    // LZ4 gets close to 255x on runs of the same byte
+    const size_t size = 4 * 1024 * 1024;
+    nf_block_p block = block_new();
+    block->header.id = DATA_BLOCK_TYPE_2;
+    block->header.size = size;
+    block->data = (char*)calloc(1, size);
+    CPPUNIT_ASSERT(compress(block, compressed_lz4) == 0);
+    CPPUNIT_ASSERT(block->header.size * 200 < size);
+    CPPUNIT_ASSERT(decompress(block) == 0);
+    CPPUNIT_ASSERT(block->header.size == size);
+    block_free(&block);
+  }
+
+  void test_crc32c() {
+    const char check[] = "123456789";
+    CPPUNIT_ASSERT(crc32c(0, check, 9) == 0xe3069283);
+    CPPUNIT_ASSERT(crc32c(crc32c(0, check, 4), check + 4, 5) == 0xe3069283);
+    // Long enough for the 8 byte steps, at an odd offset
+    nf_block_p block = make_block(1001);
+    uint32_t crc = 0;
+    for (size_t i = 0; i < 1001; ++i)
+      crc = crc32c(crc, block->data + i, 1);
+    CPPUNIT_ASSERT(crc32c(0, block->data, 1001) == crc);
+    CPPUNIT_ASSERT(crc32c(crc32c(0, block->data, 3), block->data + 3, 998) == crc);
+    block_free(&block);
+  }
+public:
+  CPPUNIT_TEST_SUITE(CompressTest);
+  CPPUNIT_TEST(test_compress_mt);
+  CPPUNIT_TEST(test_decompress_high_ratio);
+  CPPUNIT_TEST(test_decompress_records);
+  CPPUNIT_TEST(test_decompress_lz4_high_ratio);
+  CPPUNIT_TEST(test_crc32c);
+  CPPUNIT_TEST_SUITE_END();
+};
+
+
+class LibraryTest : public CppUnit::TestCase
+{
+  std::string test_file() {
+    std::string filename = test_data_dir;
+    filename += "/nfcapd.test2";
+    return filename;
+  }
+
+  void test_read_records() {
+    nftools::File file(test_file());
+    CPPUNIT_ASSERT(file.blocks() == 1);
+    int records = 0;
+    file.for_each_record([&](const record_header_t*) { ++records; });
+    CPPUNIT_ASSERT(records == 150);
+    int flows = 0;
+    file.for_each_flow([&](const nft_flow_t& flow) { flows += flow.first > 0; });
+    CPPUNIT_ASSERT(flows == 149);
+  }
+
+  void test_save() {
+    const char* filename = "test.temp.library";
+    {
+      nftools::File file(test_file());
+      file.save(filename, compressed_lz4);
+    }
+    nftools::File original(test_file());
+    nftools::File saved(filename);
+    nft_block_view_t expected = original.block(0);
+    nft_block_view_t block = saved.block(0);
+    CPPUNIT_ASSERT(block.size == expected.size);
+    CPPUNIT_ASSERT(memcmp(block.data, expected.data, block.size) == 0);
+  }
+
+  void test_cache() {
+    const char* filename = "test.temp.cache";
+    {
+      nftools::File file(test_file());
+      file.save(filename, compressed_lz4);
+    }
+    nft_set_cache_size(1024 * 1024);
+    nft_cache_stats_t before, after;
+    nft_cache_stats(&before);
+    nftools::File first(filename);
+    first.decompress();
+    nftools::File second(filename);
+    nft_block_view_t block = second.block(0);
+    nft_cache_stats(&after);
+    CPPUNIT_ASSERT(after.misses == before.misses + 1);
+    CPPUNIT_ASSERT(after.hits == before.hits + 1);
+    CPPUNIT_ASSERT(block.data == first.block(0).data);
+    nftools::File original(test_file());
+    nft_block_view_t expected = original.block(0);
+    CPPUNIT_ASSERT(block.size == expected.size && block.records == expected.records);
+    CPPUNIT_ASSERT(memcmp(block.data, expected.data, block.size) == 0);
+    // Referenced entries stay until released
+    nft_set_cache_size(0);
+    nft_cache_stats(&after);
+    CPPUNIT_ASSERT(after.entries == 1);
+    CPPUNIT_ASSERT(memcmp(second.block(0).data, expected.data, block.size) == 0);
+  }
+
+  void test_open_failure() {
+    CPPUNIT_ASSERT_THROW(nftools::File("nonexistent"), nftools::Error);
+  }
+public:
+  CPPUNIT_TEST_SUITE(LibraryTest);
+  CPPUNIT_TEST(test_read_records);
+  CPPUNIT_TEST(test_save);
+  CPPUNIT_TEST(test_cache);
+  CPPUNIT_TEST(test_open_failure);
+  CPPUNIT_TEST_SUITE_END();
+};
+
+
 int main(int argc, char *argv[])
 {
 
@@ -50,6 +465,8 @@ int main(int argc, char *argv[])
   }
   CppUnit::TextUi::TestRunner runner;
   runner.addTest(FileTest::suite());
+  runner.addTest(CompressTest::suite());
+  runner.addTest(LibraryTest::suite());
   if (runner.run()) {
     return 0;
   } else {